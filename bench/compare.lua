@@ -0,0 +1,36 @@
+-- Compares two result files of bench/run.lua.
+--
+-- usage: lua bench/compare.lua old.json new.json
+--
+-- Prints the throughput of every benchmark in both files and the change;
+-- a positive change is faster.
+
+local json = require "json"
+
+local function load (name)
+	local f = assert(io.open(name, "r"))
+	local s = f:read("*a")
+	f:close()
+	return json.decode(s)
+end
+
+local old = assert(load(assert(arg[1], "expected two result files")))
+local new = assert(load(assert(arg[2], "expected two result files")))
+
+local before = {}
+for _, r in ipairs(old.results) do
+	before[r.target .. " " .. r.corpus] = r
+end
+
+print(("%-8s %-11s %10s %10s %8s %12s"):format("target", "corpus", "old MB/s", "new MB/s", "change", "peak change"))
+for _, r in ipairs(new.results) do
+	local o = before[r.target .. " " .. r.corpus]
+	if o then
+		local peak = ""
+		if o.expat_peak and r.expat_peak then
+			peak = ("%+d"):format(r.expat_peak - o.expat_peak)
+		end
+		print(("%-8s %-11s %10.2f %10.2f %+7.1f%% %12s"):format(r.target, r.corpus,
+			o.mb_per_s, r.mb_per_s, (r.mb_per_s / o.mb_per_s - 1) * 100, peak))
+	end
+end
@@ -0,0 +1,121 @@
+-- Deterministic synthetic documents for the benchmarks.
+-- Every generator takes a scale factor and always returns the same
+-- document for it, so results can be compared between commits.
+
+local concat = table.concat
+local floor = math.floor
+local rep = string.rep
+
+
+-- Park-Miller generator: exact with both float and integer numbers
+local function random (seed)
+	local state = seed
+	return function (n)
+		state = state * 16807 % 2147483647
+		return state % n + 1
+	end
+end
+
+local WORDS = {
+	"lorem", "ipsum", "dolor", "sit", "amet", "consectetur", "adipiscing",
+	"elit", "sed", "do", "eiusmod", "tempor", "incididunt", "ut", "labore",
+	"et", "dolore", "magna", "aliqua", "&amp;", "&lt;tag&gt;", "caf\195\169",
+}
+
+local function words (rnd, n)
+	local t = {}
+	for i = 1, n do
+		t[i] = WORDS[rnd(#WORDS)]
+	end
+	return concat(t, " ")
+end
+
+
+local corpus = {}
+
+-- many elements with a dozen attributes each, no text
+function corpus.attributes (scale)
+	local rnd = random(1)
+	local t = { "<records>" }
+	for i = 1, floor(10000 * scale) do
+		local a = { "<record id='", i, "'" }
+		for j = 1, 12 do
+			a[#a+1] = (" a%d='%s'"):format(j, words(rnd, 1 + rnd(3)))
+		end
+		a[#a+1] = "/>\n"
+		t[#t+1] = concat(a)
+	end
+	t[#t+1] = "</records>"
+	return concat(t)
+end
+
+-- few elements with long paragraphs of text
+function corpus.text (scale)
+	local rnd = random(2)
+	local t = { "<book>" }
+	for i = 1, floor(2000 * scale) do
+		t[#t+1] = ("<p n='%d'>%s</p>\n"):format(i, words(rnd, 100 + rnd(100)))
+	end
+	t[#t+1] = "</book>"
+	return concat(t)
+end
+
+-- elements nested 200 deep, with a little text at every level
+function corpus.deep (scale)
+	local rnd = random(3)
+	local t = { "<root>" }
+	for _ = 1, floor(100 * scale) do
+		for d = 1, 200 do
+			t[#t+1] = ("<level d='%d'>%s"):format(d, WORDS[rnd(#WORDS)])
+		end
+		t[#t+1] = rep("</level>", 200)
+		t[#t+1] = "\n"
+	end
+	t[#t+1] = "</root>"
+	return concat(t)
+end
+
+-- elements and attributes in 16 namespaces, parsed with a separator
+function corpus.namespaces (scale)
+	local rnd = random(4)
+	local t = { "<ns0:feed" }
+	for i = 0, 15 do
+		t[#t+1] = (" xmlns:ns%d='http://example.com/ns/%d'"):format(i, i)
+	end
+	t[#t+1] = ">\n"
+	for i = 1, floor(10000 * scale) do
+		local n = rnd(16) - 1
+		t[#t+1] = ("<ns%d:entry ns%d:id='%d' xmlns:x='urn:x:%d'><x:title>%s</x:title></ns%d:entry>\n")
+			:format(n, rnd(16) - 1, i, i % 64, words(rnd, 4), n)
+	end
+	t[#t+1] = "</ns0:feed>"
+	return concat(t), { separator = "|" }
+end
+
+-- large CDATA sections
+function corpus.cdata (scale)
+	local rnd = random(5)
+	local t = { "<blobs>" }
+	for i = 1, floor(40 * scale) do
+		t[#t+1] = ("<blob n='%d'><![CDATA[%s]]></blob>\n"):format(i, words(rnd, 8000))
+	end
+	t[#t+1] = "</blobs>"
+	return concat(t)
+end
+
+-- many tiny documents, each parsed on its own
+function corpus.tiny (scale)
+	local rnd = random(6)
+	local docs = {}
+	for i = 1, floor(20000 * scale) do
+		docs[i] = ("<?xml version='1.0'?><msg id='%d'><to>%s</to><body>%s</body></msg>")
+			:format(i, WORDS[rnd(#WORDS)], words(rnd, 3))
+	end
+	return docs
+end
+
+
+-- names in the order they are run
+corpus.names = { "attributes", "text", "deep", "namespaces", "cdata", "tiny" }
+
+return corpus
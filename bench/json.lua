@@ -0,0 +1,145 @@
+-- Minimal JSON encoder and decoder for the benchmark results.
+-- Objects are written with sorted keys, so equal results give equal files.
+
+local concat = table.concat
+local format = string.format
+local sort = table.sort
+local type = type
+
+
+local json = {}
+
+local escapes = { ['"'] = '\\"', ["\\"] = "\\\\", ["\n"] = "\\n", ["\r"] = "\\r", ["\t"] = "\\t" }
+
+local function encode (v, indent, out)
+	local t = type(v)
+	if t == "table" then
+		local inner = indent .. "  "
+		if v[1] ~= nil or next(v) == nil then
+			out[#out+1] = "["
+			for i = 1, #v do
+				out[#out+1] = (i > 1 and ",\n" or "\n") .. inner
+				encode(v[i], inner, out)
+			end
+			out[#out+1] = (#v > 0 and "\n" .. indent or "") .. "]"
+		else
+			local keys = {}
+			for k in pairs(v) do
+				keys[#keys+1] = k
+			end
+			sort(keys)
+			out[#out+1] = "{"
+			for i, k in ipairs(keys) do
+				out[#out+1] = (i > 1 and ",\n" or "\n") .. inner .. format("%q", k) .. ": "
+				encode(v[k], inner, out)
+			end
+			out[#out+1] = "\n" .. indent .. "}"
+		end
+	elseif t == "string" then
+		out[#out+1] = '"' .. v:gsub('[%c"\\]', function (c)
+			return escapes[c] or format("\\u%04x", c:byte())
+		end) .. '"'
+	elseif t == "number" then
+		if v ~= v or v == math.huge or v == -math.huge then
+			out[#out+1] = "null"
+		elseif v == math.floor(v) and math.abs(v) < 2^53 then
+			out[#out+1] = format("%d", v)
+		else
+			out[#out+1] = format("%.6g", v)
+		end
+	elseif t == "boolean" then
+		out[#out+1] = tostring(v)
+	else
+		out[#out+1] = "null"
+	end
+end
+
+function json.encode (v)
+	local out = {}
+	encode(v, "", out)
+	return concat(out)
+end
+
+
+local decode
+
+local function skip (s, i)
+	return s:find("[^ \t\r\n]", i) or #s + 1
+end
+
+local function decodestring (s, i)
+	local t = {}
+	local j = i + 1
+	while true do
+		local c = s:sub(j, j)
+		if c == '"' then
+			return concat(t), j + 1
+		elseif c == "\\" then
+			local e = s:sub(j + 1, j + 1)
+			if e == "u" then
+				t[#t+1] = string.char(tonumber(s:sub(j + 2, j + 5), 16) % 256)
+				j = j + 6
+			else
+				t[#t+1] = ({ n = "\n", r = "\r", t = "\t", b = "\b", f = "\f" })[e] or e
+				j = j + 2
+			end
+		elseif c == "" then
+			error("unterminated string at position " .. i)
+		else
+			t[#t+1] = c
+			j = j + 1
+		end
+	end
+end
+
+function decode (s, i)
+	i = skip(s, i)
+	local c = s:sub(i, i)
+	if c == "{" then
+		local t = {}
+		i = skip(s, i + 1)
+		if s:sub(i, i) == "}" then return t, i + 1 end
+		while true do
+			local k
+			k, i = decodestring(s, skip(s, i))
+			i = skip(s, i)
+			assert(s:sub(i, i) == ":", "expected ':' at position " .. i)
+			t[k], i = decode(s, i + 1)
+			i = skip(s, i)
+			c = s:sub(i, i)
+			if c == "}" then return t, i + 1 end
+			assert(c == ",", "expected ',' or '}' at position " .. i)
+			i = i + 1
+		end
+	elseif c == "[" then
+		local t = {}
+		i = skip(s, i + 1)
+		if s:sub(i, i) == "]" then return t, i + 1 end
+		while true do
+			t[#t+1], i = decode(s, i)
+			i = skip(s, i)
+			c = s:sub(i, i)
+			if c == "]" then return t, i + 1 end
+			assert(c == ",", "expected ',' or ']' at position " .. i)
+			i = i + 1
+		end
+	elseif c == '"' then
+		return decodestring(s, i)
+	elseif s:find("^true", i) then
+		return true, i + 4
+	elseif s:find("^false", i) then
+		return false, i + 5
+	elseif s:find("^null", i) then
+		return nil, i + 4
+	else
+		local num = s:match("^-?[%d.eE+-]+", i)
+		assert(num, "unexpected character at position " .. i)
+		return tonumber(num), i + #num
+	end
+end
+
+function json.decode (s)
+	return (decode(s, 1))
+end
+
+return json
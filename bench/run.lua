@@ -0,0 +1,181 @@
+-- Runs the benchmarks and writes the results as JSON to stdout.
+--
+-- usage: lua bench/run.lua [--scale N] [--repeat N] [--label TEXT] [target...]
+--
+-- The targets are lxp, lom, totable and threat (all by default). Each one
+-- parses every document of bench/corpus.lua; the best of the repeated runs
+-- gives the throughput. See bench/compare.lua to compare two result files.
+
+local lxp = require "lxp"
+local lom = require "lxp.lom"
+local totable = require "lxp.totable"
+local threat = require "lxp.threat"
+local corpus = require "corpus"
+local json = require "json"
+
+local clock = os.clock
+
+
+-- options -------------------------------------------------------------------
+local scale, repeats, label = 1, 5, nil
+local only = {}
+local i = 1
+while arg[i] do
+	local a = arg[i]
+	if a == "--scale" then
+		scale = assert(tonumber(arg[i+1]), "--scale expects a number")
+		i = i + 1
+	elseif a == "--repeat" then
+		repeats = assert(tonumber(arg[i+1]), "--repeat expects a number")
+		i = i + 1
+	elseif a == "--label" then
+		label = arg[i+1]
+		i = i + 1
+	else
+		only[a] = true
+	end
+	i = i + 1
+end
+
+
+-- targets -------------------------------------------------------------------
+-- each one parses a document and returns the peak of Expat's memory, when
+-- it can be known
+local count = 0
+local callbacks = {
+	StartElement = function () count = count + 1 end,
+	EndElement = function () count = count + 1 end,
+	CharacterData = function () count = count + 1 end,
+}
+
+-- the same callbacks, with limits large enough for all the documents
+-- (a new table each time, since 'threat.new' fills in the defaults)
+local checked = {}
+for k, v in pairs(callbacks) do
+	checked[k] = v
+end
+
+local function run (p, doc)
+	assert(p:parse(doc))
+	assert(p:parse())
+	local _, peak = p:memory()
+	p:close()
+	return peak
+end
+
+local targets = {
+	{ "lxp", function (doc, opts)
+		return run(lxp.new(callbacks, opts.separator), doc)
+	end },
+	{ "lom", function (doc, opts)
+		assert(lom.parse(doc, opts))
+	end },
+	{ "totable", function (doc, opts)
+		assert(totable.parse(doc, opts))
+	end },
+	{ "threat", function (doc, opts)
+		checked.threat = {
+			depth = 1000,
+			maxChildren = 1000000,
+			document = 1024*1024*1024,
+			buffer = 1024*1024*1024,
+			text = 1024*1024*1024,
+		}
+		return run(threat.new(checked, opts.separator), doc)
+	end },
+}
+
+
+-- measures ------------------------------------------------------------------
+-- runs 'parse' on every document, returning the time and Expat's peak
+local function pass (parse, docs, opts)
+	local peak
+	local t = clock()
+	for j = 1, #docs do
+		local m = parse(docs[j], opts)
+		if m and (not peak or m > peak) then peak = m end
+	end
+	return clock() - t, peak
+end
+
+-- start, end and character data events, as counted by the parser
+local function events (docs, opts)
+	local n = 0
+	for j = 1, #docs do
+		local p = lxp.new(callbacks, opts.separator, { stats = true })
+		assert(p:parse(docs[j]))
+		assert(p:parse())
+		for _, ev in pairs(p:stats().events) do
+			n = n + ev.count
+		end
+		p:close()
+	end
+	return n
+end
+
+local function measure (parse, docs, opts, bytes, nevents)
+	pass(parse, docs, opts)  -- warm up
+	local best = math.huge
+	local peak
+	for _ = 1, repeats do
+		local t
+		t, peak = pass(parse, docs, opts)
+		if t < best then best = t end
+	end
+	-- Lua memory allocated by one pass, with the collector stopped
+	collectgarbage("collect")
+	local base = collectgarbage("count")
+	collectgarbage("stop")
+	pass(parse, docs, opts)
+	local alloc = collectgarbage("count") - base
+	collectgarbage("restart")
+	collectgarbage("collect")
+	best = math.max(best, 1e-9)
+	return {
+		seconds = best,
+		mb_per_s = bytes / best / (1024 * 1024),
+		events_per_s = nevents / best,
+		expat_peak = peak,
+		lua_alloc_kb = math.floor(alloc),
+	}
+end
+
+
+-- main ----------------------------------------------------------------------
+local results = {}
+for _, name in ipairs(corpus.names) do
+	local docs, opts = corpus[name](scale)
+	if type(docs) == "string" then docs = { docs } end
+	opts = opts or {}
+	local bytes = 0
+	for j = 1, #docs do
+		bytes = bytes + #docs[j]
+	end
+	local nevents = events(docs, opts)
+	for _, target in ipairs(targets) do
+		if next(only) == nil or only[target[1]] then
+			io.stderr:write(("%-8s %-11s"):format(target[1], name))
+			local r = measure(target[2], docs, opts, bytes, nevents)
+			r.target = target[1]
+			r.corpus = name
+			r.documents = #docs
+			r.bytes = bytes
+			r.events = nevents
+			results[#results+1] = r
+			io.stderr:write(("%9.2f MB/s %12.0f events/s\n"):format(r.mb_per_s, r.events_per_s))
+		end
+	end
+end
+
+io.write(json.encode({
+	meta = {
+		label = label,
+		date = os.date("!%Y-%m-%dT%H:%M:%SZ"),
+		lua = jit and jit.version or _VERSION,
+		lxp = lxp._VERSION,
+		expat = lxp._EXPAT_VERSION,
+		scale = scale,
+		["repeat"] = repeats,
+	},
+	results = results,
+}), "\n")
@@ -184,6 +184,27 @@ describe("lxp:", function()
 	end)
 
 
+	it("sees callbacks changed during a parse after refreshcallbacks()", function()
+		local p
+		p = test_parser { "CharacterData",
+			StartElement = function(_, name)
+				if name == "b" then
+					p:getcallbacks().CharacterData = nil
+				elseif name == "d" then
+					p:refreshcallbacks()
+				end
+			end,
+		}
+		assert(p:parse("<root><a>1</a><b>2</b><c>3</c><d>4</d></root>"))
+		assert(p:parse())
+		assert.same({
+			{ "CharacterData", "1" },
+			{ "CharacterData", "2" },
+			{ "CharacterData", "3" },
+		}, cbdata)
+	end)
+
+
 
 	describe("parsing", function()
 
@@ -499,6 +520,39 @@ describe("lxp:", function()
 		end)
 
 
+		it("splits namespaced names", function()
+			local p = test_parser {
+				"StartNamespaceDecl", "StartElement", "EndElement"
+			}
+			p = lxp.new(p:getcallbacks(), "?", { splitnames = true })
+			assert(p:returnnstriplet(true):parse(d[[
+				<root xmlns:s='a/namespace'>
+					<s:a id="1" s:k="2"/>
+					<b xmlns='b/namespace'/>
+				</root>
+			]]))
+			assert(p:parse())
+			assert.same({
+				{ "StartNamespaceDecl", "s", "a/namespace" },
+				{ "StartElement", "root", {} },
+				{ "StartElement", "a", {
+					"id", "a/namespace?k?s", id = "1", ["a/namespace?k?s"] = "2",
+				}, "a/namespace", "s" },
+				{ "EndElement", "a", "a/namespace", "s" },
+				{ "StartNamespaceDecl", nil, "b/namespace" },
+				{ "StartElement", "b", {}, "b/namespace" },
+				{ "EndElement", "b", "b/namespace" },
+				{ "EndElement", "root" },
+			}, cbdata)
+			assert.matches.error(function()
+				lxp.new({}, nil, { splitnames = true })
+			end, "option 'splitnames' requires a namespace separator")
+			assert.matches.error(function()
+				lxp.new({}, "?", { splitnames = true, tree = "lom" })
+			end, "option 'splitnames' cannot be used with a tree builder or batches")
+		end)
+
+
 		it("handles namespace triplet", function()
 			local p = test_parser({
 					"StartNamespaceDecl", "EndNamespaceDecl",
@@ -617,6 +671,47 @@ describe("lxp:", function()
 		end)
 
 
+		describe("parses external entities with the callbacks", function()
+
+			local doc = [[<!DOCTYPE to [<!ENTITY e SYSTEM "e.xml">]><to>&e;</to>]]
+
+			-- the events of the external entity, delivered to the callbacks
+			local function entity_events(opts, start)
+				local events, entity = {}, nil
+				local p = lxp.new({
+					StartElement = function(p, name) events[#events+1] = name end,
+					CharacterData = function(p, text) events[#events+1] = text end,
+					Batch = function() end,
+					ExternalEntityRef = function(p, context)
+						local outer = events
+						events = {}
+						assert(context:parse("<hi>x</hi>"))
+						entity, events = events, outer
+						return true
+					end,
+				}, nil, opts)
+				if start then start(p) end
+				assert(p:parse(doc))
+				assert(p:parse())
+				p:close()
+				return entity
+			end
+
+			for _, case in ipairs {
+				{ "a tree builder", { tree = "lom" } },
+				{ "batches", { batch = 10 } },
+				{ "a filter", { filter = "/to" } },
+				{ "text nodes", { whitespace = "trim" } },
+				{ "a recording", nil, function(p) p:record() end },
+			} do
+				it("under " .. case[1], function()
+					assert.same({ "hi", "x" }, entity_events(case[2], case[3]))
+				end)
+			end
+
+		end)
+
+
 
 		describe("Element Declarations", function()
 
@@ -1092,6 +1187,39 @@ describe("lxp:", function()
 				}, r)
 			end)
 
+
+			it("callback errors with one protected call per parse", function()
+				local events = {}
+				local p = lxp.new({
+					StartElement = function(p, name)
+						events[#events+1] = name
+						if name == "bad" then error({ name = name }) end
+					end,
+					CharacterData = function(p, text)
+						events[#events+1] = text
+					end,
+				}, nil, { protect = "parse" })
+				local ok, err = pcall(p.parse, p, "<root>text<bad/><notparsed/>")
+				assert.is_false(ok)
+				assert.same({ name = "bad" }, err)
+				assert.same({ "root", "text", "bad" }, events)
+				assert.same({ nil, "cannot parse - document is finished" }, { p:parse("</root>") })
+				assert.equal(p, p:close())
+			end)
+
+
+			it("delivers pending text with one protected call per parse", function()
+				local p = lxp.new({
+					CharacterData = function(p, text) error("text: " .. text, 0) end,
+				}, nil, { protect = "parse" })
+				assert.has.error(function()
+					p:parse("<root>abc")
+				end, "text: abc")
+				assert.matches.error(function()
+					lxp.new({}, nil, { protect = "always" })
+				end, "invalid protect mode 'always'")
+			end)
+
 		end)
 
 
@@ -1120,6 +1248,1407 @@ describe("lxp:", function()
 
 
 
+	describe("tree builders", function()
+
+		it("builds a LOM tree", function()
+			local p = lxp.new({}, nil, { tree = "lom" })
+			assert(p:parse[[<root a="1" b="2">hello<child/>world</root>]])
+			assert(p:parse())
+			assert.same({
+				tag = "root",
+				attr = { "a", "b", a = "1", b = "2" },
+				"hello",
+				{ tag = "child", attr = {} },
+				"world",
+			}, p:gettree())
+			p:close()
+		end)
+
+
+		it("joins text split over multiple chunks", function()
+			local p = lxp.new({}, nil, { tree = "lom" })
+			assert(p:parse[[<root>hel]])
+			assert(p:parse[[lo wo]])
+			assert(p:parse[[rld</root>]])
+			assert(p:parse())
+			assert.same({ tag = "root", attr = {}, "hello world" }, p:gettree())
+		end)
+
+
+		it("returns the partial tree while parsing", function()
+			local p = lxp.new({}, nil, { tree = "lom" })
+			assert.is_nil(p:gettree())
+			assert(p:parse[[<root><a>text</a>]])
+			assert.same({ tag = "root", attr = {}, { tag = "a", attr = {}, "text" } }, p:gettree())
+		end)
+
+
+		it("still calls other callbacks", function()
+			local p = test_parser { "Comment" }
+			p = lxp.new(p:getcallbacks(), nil, { tree = "lom" })
+			assert(p:parse[[<root>a<!-- hi -->b</root>]])
+			assert(p:parse())
+			assert.same({ { "Comment", " hi " } }, cbdata)
+			assert.same({ tag = "root", attr = {}, "ab" }, p:gettree())
+		end)
+
+
+		it("accepts 'merge_character_data' as an option", function()
+			local p = test_parser { "CharacterData" }
+			p = lxp.new(p:getcallbacks(), nil, { merge_character_data = false })
+			assert(p:parse[[<root>a&amp;b</root>]])
+			assert(p:parse())
+			assert.same({
+				{ "CharacterData", "a" },
+				{ "CharacterData", "&" },
+				{ "CharacterData", "b" },
+			}, cbdata)
+		end)
+
+
+		it("builds a compact tree", function()
+			local p = lxp.new({}, nil, { tree = "compact", clean = true })
+			assert.is_nil(p:gettree())
+			assert(p:parse[[<root a="1" b="2">
+				<child>te]])
+			assert.equal("root", p:gettree().tag)
+			assert(p:parse[[xt</child> </root>]])
+			assert(p:parse())
+			local root = p:gettree()
+			assert.equal(root, p:gettree())
+			assert.same({ "a", "b", a = "1", b = "2" }, root.attr)
+			assert.equal(1, #root)
+			assert.equal("text", root[1][1])
+			assert.matches("^Expat%.node %(", tostring(root))
+			p:close()
+			assert.equal("child", root[1].tag)
+			assert.matches.error(function()
+				lxp.new({}, nil, { tree = "compact" }):trees("<r/>")
+			end, "cannot iterate %- parser has a compact tree builder")
+		end)
+
+
+		it("indexes a table tree", function()
+			local p = lxp.new({}, nil, { tree = "totable", index = { "id" } })
+			assert(p:parse[[<r><a id="1" k="x"><b id="2"/></a><b id="1"/></r>]])
+			assert(p:parse())
+			local index = p:getindex()
+			local r = p:gettree()
+			assert.equal(r[1], index.attrs.id["1"])
+			assert.equal(r[1][1], index.attrs.id["2"])
+			assert.is_nil(index.attrs.k)
+			assert.same({ r[1][1], r[2] }, index.tags.b)
+			assert.equal(r[1], index.parent[r[1][1]])
+			assert.equal(r, index.parent[r[1]])
+			assert.is_nil(index.parent[r])
+			assert.equal(index, lxp.indexof(r))
+			assert.equal(index, lxp.indexof(r[1][1]))
+			assert.is_nil(lxp.indexof({}))
+			assert.is_nil(lxp.new({}, nil, { tree = "lom" }):getindex())
+			assert.is_nil(lxp.new({}, nil, { tree = "compact", index = true }):getindex())
+		end)
+
+
+		it("checks the 'index' option", function()
+			assert.matches.error(function()
+				lxp.new({}, nil, { index = true })
+			end, "option 'index' requires a tree builder")
+			assert.matches.error(function()
+				lxp.new({}, nil, { tree = "totable", torecord = true, index = true })
+			end, "option 'index' cannot be used with 'torecord'")
+			assert.matches.error(function()
+				lxp.new({}, nil, { tree = "lom", index = { 1 } })
+			end, "option 'index' must list attribute names")
+		end)
+
+
+		it("rejects unknown builders", function()
+			assert.matches.error(function()
+				lxp.new({}, nil, { tree = "dom" })
+			end, "invalid tree builder 'dom'")
+		end)
+
+
+		it("gettree() fails without a builder", function()
+			assert.matches.error(function()
+				lxp.new({}):gettree()
+			end, "parser has no tree builder")
+		end)
+
+	end)
+
+
+
+	describe("batch mode", function()
+
+		local function batch_parser(size, extra)
+			local batches = {}
+			local cbs = extra or {}
+			cbs.Batch = function(p, events, n)
+				local b = {}
+				for i = 1, n * 3 do b[i] = events[i] end
+				batches[#batches+1] = b
+			end
+			return lxp.new(cbs, nil, { batch = size }), batches
+		end
+
+
+		it("delivers events in batches", function()
+			local p, batches = batch_parser(2)
+			assert(p:parse[[<root a="1">text<!--c--><?pi data?></root>]])
+			assert(p:parse())
+			assert.same({
+				{ "StartElement", "root", { "a", a = "1" }, "CharacterData", "text", false },
+				{ "Comment", "c", false, "ProcessingInstruction", "pi", "data" },
+				{ "EndElement", "root", false },
+			}, batches)
+		end)
+
+
+		it("flushes pending events at the end of a parse call", function()
+			local p, batches = batch_parser(100)
+			assert(p:parse[[<root>te]])
+			assert.same({ { "StartElement", "root", {} , "CharacterData", "te", false } }, batches)
+		end)
+
+
+		it("keeps the order with other callbacks", function()
+			local calls = {}
+			local p, batches
+			p, batches = batch_parser(100, {
+				StartCdataSection = function() calls[#calls+1] = #batches end,
+			})
+			assert(p:parse[=[<root>a<![CDATA[b]]></root>]=])
+			assert(p:parse())
+			assert.same({ 1 }, calls)
+			assert.same({
+				{ "StartElement", "root", {}, "CharacterData", "a", false },
+				{ "CharacterData", "b", false, "EndElement", "root", false },
+			}, batches)
+		end)
+
+
+		it("requires a Batch callback", function()
+			assert.matches.error(function()
+				lxp.new({}, nil, { batch = 10 })
+			end, "option 'batch' requires a 'Batch' callback")
+			assert.matches.error(function()
+				lxp.new({ Batch = print }, nil, { batch = 0 })
+			end, "option 'batch' must be a positive number")
+		end)
+
+	end)
+
+
+
+	describe("budgets", function()
+
+		local doc = "<root>" .. ("<a>x</a>"):rep(10) .. "</root>"
+
+		local function start_parser()
+			local names = {}
+			local p = lxp.new { StartElement = function(p, name) names[#names+1] = name end }
+			return p, names
+		end
+
+
+		it("suspends a parse call after 'max_events' and resumes it", function()
+			local p, names = start_parser()
+			local r, status = p:parse(doc, { max_events = 4 })
+			assert.equal(p, r)
+			assert.equal("suspended", status)
+			assert.same({ "root", "a", "a" }, names)
+			local calls = 1
+			while status == "suspended" do
+				r, status = p:resume { max_events = 4 }
+				assert.equal(p, r)
+				calls = calls + 1
+			end
+			assert.equal(11, #names)
+			assert.equal(6, calls)
+			assert.equal(p, p:parse())
+			assert.same({ nil, "cannot resume - parser is not suspended" }, { p:resume() })
+		end)
+
+
+		it("suspends a parse call after 'max_time_us'", function()
+			local slow = {}
+			for i = 1, 100 do
+				slow[i] = "<a>" .. ("x"):rep(1000) .. "</a>"
+			end
+			local n = 0
+			local p = lxp.new { StartElement = function()
+				n = n + 1
+				local t = os.clock()
+				repeat until os.clock() - t > 0.0005
+			end }
+			local _, status = p:parse("<root>" .. table.concat(slow) .. "</root>", { max_time_us = 1 })
+			assert.equal("suspended", status)
+			assert.is_true(n < 101)
+			repeat
+				_, status = p:resume()
+			until status == nil
+			assert.equal(101, n)
+			assert.equal(p, p:parse())
+		end)
+
+
+		it("refuses more input until resumed", function()
+			local p, names = start_parser()
+			assert.equal("suspended", select(2, p:parse("<root><a/>", { max_events = 1 })))
+			assert.same({ nil, "cannot parse - parser is suspended" }, { p:parse("<a/>") })
+			assert.equal(p, p:resume())
+			assert.equal(p, p:parse("<a/></root>"))
+			assert.equal(p, p:parse())
+			assert.same({ "root", "a", "a" }, names)
+		end)
+
+
+		it("bounds tree builders", function()
+			local p = lxp.new({}, nil, { tree = "lom" })
+			assert.equal("suspended", select(2, p:parse(doc, { max_events = 2 })))
+			assert.equal(p, p:resume())
+			assert.equal(p, p:parse())
+			assert.equal(10, #p:gettree())
+		end)
+
+
+		it("gives external entities to the callbacks", function()
+			local events = {}
+			local p = lxp.new {
+				StartElement = function(p, name) events[#events+1] = name end,
+				CharacterData = function(p, text) events[#events+1] = text end,
+				ExternalEntityRef = function(p, context)
+					return context:parse("<hi>x</hi>")
+				end,
+			}
+			local _, status = p:parse([[<!DOCTYPE to [<!ENTITY e SYSTEM "e.xml">]><to>&e;</to>]],
+			                          { max_events = 100 })
+			assert.is_nil(status)
+			assert.equal(p, p:parse())
+			assert.same({ "to", "hi", "x" }, events)
+		end)
+
+
+		it("checks the budget", function()
+			local p = start_parser()
+			assert.matches.error(function()
+				p:parse(doc, { max_events = 0 })
+			end, "budget 'max_events' must be a positive number")
+			assert.matches.error(function()
+				p:parse(doc, { max_time_us = "soon" })
+			end, "budget 'max_time_us' must be a positive number")
+		end)
+
+	end)
+
+
+
+	describe("reset", function()
+
+		it("parses a new document with the same callbacks", function()
+			local p = test_parser { "StartElement", "Comment" }
+			assert(p:parse("<root><!--c--></root>"))
+			assert(p:parse())
+			assert.equal(p, p:reset())
+			assert(p:parse("<other/>"))
+			assert(p:parse())
+			assert.same({
+				{ "StartElement", "root", {} },
+				{ "Comment", "c" },
+				{ "StartElement", "other", {} },
+			}, cbdata)
+		end)
+
+
+		it("recovers from errors", function()
+			local p = lxp.new({ StartElement = function() error("oops") end })
+			assert.matches.error(function() p:parse("<root/>") end, "oops")
+			p:reset()
+			assert.matches.error(function() p:parse("<root/>") end, "oops")
+			p = lxp.new({})
+			assert.is_nil(p:parse("<root></other>"))
+			p:reset()
+			assert(p:parse("<root/>"))
+			assert(p:parse())
+			p:close()
+		end)
+
+
+		it("uses the encoding given", function()
+			local p = test_parser { "CharacterData" }
+			p:reset("ISO-8859-1")
+			assert(p:parse("<root>\233</root>"))
+			assert(p:parse())
+			assert.same({ { "CharacterData", "\195\169" } }, cbdata)
+		end)
+
+
+		it("starts a new tree", function()
+			local p = lxp.new({}, nil, { tree = "lom" })
+			assert(p:parse("<a>1</a>"))
+			assert(p:parse())
+			local first = p:gettree()
+			p:reset()
+			assert.is_nil(p:gettree())
+			assert(p:parse("<b>2</b>"))
+			assert(p:parse())
+			assert.same({ tag = "a", attr = {}, "1" }, first)
+			assert.same({ tag = "b", attr = {}, "2" }, p:gettree())
+		end)
+
+
+		it("keeps the limits", function()
+			local p = lxp.new({}, nil, { limits = { depth = 2 } })
+			assert.same({ nil, "structure is too deep", 1, 7, 7 }, { p:parse("<a><b><c/></b></a>") })
+			p:reset()
+			assert(p:parse("<a><b/></a>"))
+			assert(p:parse())
+			p:reset()
+			assert.same({ nil, "structure is too deep", 1, 7, 7 }, { p:parse("<a><b><c/></b></a>") })
+		end)
+
+	end)
+
+
+
+	describe("memory", function()
+
+		local doc = "<root>" .. string.rep("<item a='1'>text</item>", 1000) .. "</root>"
+
+
+		it("counts the bytes allocated by Expat", function()
+			local p = lxp.new({})
+			local current, peak = p:memory()
+			assert(current > 0)
+			assert.equal(current, peak)
+			assert(p:parse(doc))
+			assert(p:parse())
+			local after, newpeak = p:memory()
+			assert(newpeak > peak)
+			assert(after <= newpeak)
+			p:close()
+		end)
+
+
+		it("fails the parse beyond the limit", function()
+			local p = lxp.new({}, nil, { memlimit = 8192 })
+			local ok, err = p:parse(doc)
+			assert.is_nil(ok)
+			assert.equal("memory limit exceeded", err)
+			local current = p:memory()
+			assert(current <= 8192)
+			p:reset()
+			assert(p:parse("<root/>"))
+			assert(p:parse())
+		end)
+
+
+		it("uses the allocator of the Lua state or an arena", function()
+			for _, allocator in ipairs { "lua", "arena" } do
+				local p = lxp.new({}, nil, { allocator = allocator })
+				assert(p:parse(doc))
+				assert(p:parse())
+				assert(p:memory() > 0)
+				p:close()
+			end
+		end)
+
+
+		it("frees a whole arena on reset", function()
+			local p = lxp.new({}, nil, { allocator = "arena" })
+			local start = p:memory()
+			assert(p:parse(doc))
+			assert(p:parse())
+			local used, peak = p:memory()
+			assert(used > start)
+			assert.equal(p, p:reset())
+			assert(p:memory() < used)
+			assert(p:parse(doc))
+			assert(p:parse())
+			assert.equal(peak, select(2, p:memory()))
+			p:close()
+		end)
+
+
+		it("bounds an arena by the limit", function()
+			local p = lxp.new({}, nil, { allocator = "arena", memlimit = 8192 })
+			local ok, err = p:parse(doc)
+			assert.is_nil(ok)
+			assert.equal("memory limit exceeded", err)
+			assert(p:memory() <= 8192)
+			p:reset()
+			assert(p:parse("<root/>"))
+			assert(p:parse())
+			local big = 4 * select(2, lxp.new({}, nil, { allocator = "arena" }):memory())
+			p = lxp.new({}, nil, { allocator = "arena", memlimit = big })
+			for _ = 1, 3 do
+				assert(p:parse("<root a='1'/>"))
+				assert(p:parse())
+				assert(p:memory() <= big)
+				p:reset()
+			end
+		end)
+
+
+		it("checks the options", function()
+			assert.matches.error(function()
+				lxp.new({}, nil, { allocator = "mmap" })
+			end, "invalid allocator 'mmap'")
+			assert.matches.error(function()
+				lxp.new({}, nil, { memlimit = 0 })
+			end, "option 'memlimit' must be a positive number")
+			assert.matches.error(function()
+				lxp.new({}, nil, { memlimit = 10 })
+			end, "memory limit exceeded")
+		end)
+
+	end)
+
+
+	describe("stats", function()
+
+		local doc = "<root><a x='1'>one</a><!--c--><b>two</b></root>"
+		local events
+		local cb = {
+			StartElement = function(p, name) events = events + 1 end,
+			EndElement = function(p, name) events = events + 1 end,
+			CharacterData = function(p, text) events = events + 1 end,
+		}
+
+
+		before_each(function()
+			events = 0
+		end)
+
+
+		it("is off by default", function()
+			local p = lxp.new(cb)
+			assert(p:parse(doc))
+			assert.is_nil(p:stats())
+		end)
+
+
+		it("counts the events, calls and bytes", function()
+			local p = lxp.new(cb, nil, { stats = true })
+			assert(p:parse(doc:sub(1, 20)))
+			assert(p:parse(doc:sub(21)))
+			assert(p:parse())
+			local stats = p:stats()
+			assert.same({
+				StartElement = { count = 3, bytes = 6 },
+				EndElement = { count = 3, bytes = 6 },
+				CharacterData = { count = 2, bytes = 6 },
+			}, stats.events)
+			assert.equal(events, stats.calls)
+			assert.equal(2, stats.flushes)
+			assert.equal(#doc, stats.input)
+			assert(stats.parse_time >= stats.callback_time)
+			assert(stats.callback_time >= 0)
+		end)
+
+
+		it("clears the counters", function()
+			local p = lxp.new(cb, nil, { stats = true })
+			assert(p:parse(doc))
+			assert(p:stats(true).calls > 0)
+			local stats = p:stats()
+			assert.same({}, stats.events)
+			assert.equal(0, stats.calls)
+			assert.equal(0, stats.input)
+		end)
+
+
+		it("counts batched events and tree nodes", function()
+			local p = lxp.new({ Batch = function() end }, nil, { stats = true, batch = 100 })
+			assert(p:parse(doc))
+			assert(p:parse())
+			local stats = p:stats()
+			assert.equal(3, stats.events.StartElement.count)
+			assert.equal(1, stats.events.Batch.count)
+			assert.equal(1, stats.calls)
+
+			p = lxp.new({}, nil, { stats = true, tree = "lom" })
+			assert(p:parse(doc))
+			assert(p:parse())
+			stats = p:stats()
+			assert.same({ count = 3, bytes = 6 }, stats.events.StartElement)
+			assert.same({ count = 2, bytes = 6 }, stats.events.CharacterData)
+			assert.equal(0, stats.calls)
+		end)
+
+	end)
+
+
+	describe("filter", function()
+
+		local doc = [[<feed><title>Feed</title><entry id="1" type="a"><title>One</title><!--c--></entry><entry id="2"><link href="x"/><title>Two<b>!</b></title></entry></feed>]]
+
+		local function filter_parser(paths, sep, opts)
+			local events = {}
+			local cbs = {
+				StartElement = function(p, name, attrs) events[#events+1] = { "start", name, attrs } end,
+				EndElement = function(p, name) events[#events+1] = { "end", name } end,
+				CharacterData = function(p, text) events[#events+1] = { "text", text } end,
+				Comment = function(p, text) events[#events+1] = { "comment", text } end,
+			}
+			opts = opts or {}
+			opts.filter = paths
+			return lxp.new(cbs, sep, opts), events
+		end
+
+
+		it("delivers matching elements with their content", function()
+			local p, events = filter_parser("/feed/entry/title")
+			assert(p:parse(doc))
+			assert(p:parse())
+			assert.same({
+				{ "start", "title", {} }, { "text", "One" }, { "end", "title" },
+				{ "start", "title", {} }, { "text", "Two" },
+				{ "start", "b", {} }, { "text", "!" }, { "end", "b" },
+				{ "end", "title" },
+			}, events)
+		end)
+
+
+		it("matches descendants, wildcards and several paths", function()
+			local p, events = filter_parser({ "//link", "/entry" })
+			assert(p:parse(doc))
+			assert(p:parse())
+			assert.same({ { "start", "link", { "href", href = "x" } }, { "end", "link" } }, events)
+
+			p, events = filter_parser({ "/feed/*/title", "//b" })
+			assert(p:parse(doc))
+			assert(p:parse())
+			assert.equal(9, #events)
+		end)
+
+
+		it("selects attributes", function()
+			local p, events = filter_parser("//entry/@id")
+			assert(p:parse(doc))
+			assert(p:parse())
+			assert.same({
+				{ "start", "entry", { "id", id = "1" } }, { "end", "entry" },
+				{ "start", "entry", { "id", id = "2" } }, { "end", "entry" },
+			}, events)
+
+			p, events = filter_parser({ "/feed/entry/@*", "/feed/entry/title" })
+			assert(p:parse(doc))
+			assert(p:parse())
+			assert.same({ "id", "type", id = "1", type = "a" }, events[1][3])
+			assert.same({ "start", "title", {} }, events[2])
+		end)
+
+
+		it("matches local names with namespaces", function()
+			local p, events = filter_parser("/feed/entry/@id", "|")
+			assert(p:parse[[<feed xmlns="urn:a"><entry id="1"/><x:entry xmlns:x="urn:x" id="2"/></feed>]])
+			assert(p:parse())
+			assert.same({
+				{ "start", "urn:a|entry", { "id", id = "1" } }, { "end", "urn:a|entry" },
+				{ "start", "urn:x|entry", { "id", id = "2" } }, { "end", "urn:x|entry" },
+			}, events)
+		end)
+
+
+		it("works in batch mode and after a reset", function()
+			local n = 0
+			local p = lxp.new({ Batch = function(p, events, k) n = n + k end }, nil,
+				{ batch = 10, filter = "//title" })
+			assert(p:parse(doc))
+			assert(p:parse())
+			assert.equal(12, n)
+			n = 0
+			p:reset()
+			assert(p:parse(doc))
+			assert(p:parse())
+			assert.equal(12, n)
+		end)
+
+
+		it("checks the depth of dropped elements", function()
+			local p = require("lxp.threat").new({ threat = { depth = 3 }, EndElement = function() end },
+				nil, { filter = "/r/a" })
+			local ok, err = p:parse("<r><a/><b><c><d/></c></b></r>")
+			assert.is_nil(ok)
+			assert.equal("structure is too deep", err)
+		end)
+
+
+		it("checks the paths", function()
+			for _, path in ipairs { "a", "/", "/a//", "/a/@b/c", "//@b", "/a/@" } do
+				assert.matches.error(function()
+					lxp.new({}, nil, { filter = path })
+				end, "invalid path '" .. path:gsub("%p", "%%%0") .. "'")
+			end
+			assert.matches.error(function()
+				lxp.new({}, nil, { filter = ("/a"):rep(32) })
+			end, "too many steps in path")
+			assert.matches.error(function()
+				lxp.new({}, nil, { filter = {} })
+			end, "option 'filter' must have at least one path")
+		end)
+
+	end)
+
+
+	describe("text nodes", function()
+
+		local doc = "<r>\n  <a> x y </a>\n  <b>  <![CDATA[ c ]]>  t</b><!--c-->\n <c>h\195\169llo</c></r>"
+
+		local function texts(opts, chunked)
+			local out = {}
+			local p = lxp.new({
+				CharacterData = function(_, s) out[#out+1] = s end,
+				StartCdataSection = function() out[#out+1] = "<![CDATA[" end,
+				Comment = function() out[#out+1] = "<!---->" end,
+			}, nil, opts)
+			if chunked then
+				for i = 1, #doc do
+					assert(p:parse(doc:sub(i, i)))
+				end
+			else
+				assert(p:parse(doc))
+			end
+			assert(p:parse())
+			p:close()
+			return out
+		end
+
+
+		it("skips whitespace-only text", function()
+			local expected = { " x y ", "<![CDATA[", " c ", "  t", "<!---->", "h\195\169llo" }
+			assert.same(expected, texts({ whitespace = "skip" }))
+			assert.same(expected, texts({ whitespace = "skip" }, true))
+		end)
+
+
+		it("trims text", function()
+			local expected = { "x y", "<![CDATA[", "c", "t", "<!---->", "h\195\169llo" }
+			assert.same(expected, texts({ whitespace = "trim" }))
+			assert.same(expected, texts({ whitespace = "trim", merge_character_data = false }, true))
+		end)
+
+
+		it("merges text across CDATA sections", function()
+			assert.same({ "x y", "c   t", "<!---->", "h\195\169llo" },
+				texts({ whitespace = "trim", mergecdata = true }, true))
+		end)
+
+
+		it("caps text nodes on whole characters", function()
+			assert.same({ "\n ", " x", "\n ", "  ", "<![CDATA[", " c", "  ", "<!---->", "\n ", "h" },
+				texts({ maxtext = 2 }))
+		end)
+
+
+		it("applies to the tree builders", function()
+			local p = lxp.new({}, nil, { tree = "lom", whitespace = "trim", mergecdata = true })
+			assert(p:parse(doc))
+			assert(p:parse())
+			assert.same({ tag = "r", attr = {},
+				{ tag = "a", attr = {}, "x y" },
+				{ tag = "b", attr = {}, "c   t" },
+				{ tag = "c", attr = {}, "h\195\169llo" },
+			}, p:gettree())
+		end)
+
+
+		it("checks the text limit and the options", function()
+			local p = lxp.new({ CharacterData = function() end }, nil,
+				{ whitespace = "trim", limits = { text = 5 } })
+			local ok, err = p:parse("<r>"..("a"):rep(10).."</r>")
+			assert.is_nil(ok)
+			assert.equal("text/CDATA node(s) too long", err)
+			assert.matches.error(function()
+				lxp.new({}, nil, { whitespace = "all" })
+			end, "invalid whitespace mode 'all'")
+			assert.matches.error(function()
+				lxp.new({}, nil, { maxtext = 0 })
+			end, "option 'maxtext' must be a positive number")
+		end)
+
+	end)
+
+
+
+	describe("trees", function()
+
+		it("hands out the filtered elements one by one", function()
+			local p = lxp.new({}, nil, { tree = "totable", filter = "/r/item" })
+			local chunks = { "<r><item>1</item><it", "em>2</item>", "<x/></r>" }
+			local i = 0
+			local items = {}
+			for item in p:trees(function() i = i + 1; return chunks[i] end) do
+				items[#items+1] = item
+				assert.is_nil(p:gettree())  -- not kept
+			end
+			assert.same({ { [0] = "item", "1" }, { [0] = "item", "2" } }, items)
+		end)
+
+
+		it("requires a new parser with a tree builder", function()
+			assert.matches.error(function()
+				lxp.new({}):trees("<r/>")
+			end, "cannot iterate %- parser has no tree builder")
+			local p = lxp.new({}, nil, { tree = "lom" })
+			assert(p:parse("<r>"))
+			assert.matches.error(function()
+				p:trees("</r>")
+			end, "cannot iterate %- parser has already started")
+		end)
+
+	end)
+
+
+
+	describe("writer", function()
+
+		it("escapes text and attribute values", function()
+			local long = ("abcdefgh"):rep(4)
+			assert.equal(long.."&lt;&amp;&gt;'\"\t\n&#13;"..long, lxp.tostring(long.."<&>'\"\t\n\r"..long))
+			assert.equal([[<a v="'&quot;&amp;&lt;&gt;&#9;&#10;&#13;"/>]], lxp.tostring({ tag = "a", attr = { v = "'\"&<>\t\n\r" } }))
+			assert.equal("42", lxp.tostring(42))
+		end)
+
+
+		it("writes listed attributes first, then the others sorted", function()
+			local node = { tag = "a", attr = { "z", "m", z = "1", m = "2", b = "3", a = "4" } }
+			assert.equal([[<a z="1" m="2" a="4" b="3"/>]], lxp.tostring(node))
+			assert.equal([[<a b="2" c="1">x</a>]], lxp.tostring({ [0] = "a", c = "1", b = 2, "x" }))
+		end)
+
+
+		it("rejects invalid nodes", function()
+			assert.matches.error(function()
+				lxp.tostring({ tag = "a", true })
+			end, "invalid node %(a boolean%)")
+			assert.matches.error(function()
+				lxp.tostring({ tag = "a", attr = { x = {} } })
+			end, "invalid value for attribute 'x' %(a table%)")
+			assert.matches.error(function()
+				lxp.tostring({ "no tag" })
+			end, "invalid element")
+			local cycle = { tag = "a" }
+			cycle[1] = cycle
+			assert.matches.error(function()
+				lxp.tostring(cycle)
+			end, "tree too deep %(or cyclic%)")
+		end)
+
+
+		it("writes to a file handle", function()
+			local f = io.tmpfile()
+			local node = { tag = "r" }
+			for i = 1, 5000 do
+				node[i] = { tag = "e", attr = { "id", id = tostring(i) }, "<"..i..">" }
+			end
+			assert.equal(f, lxp.write(f, node, { declaration = true }))
+			f:seek("set")
+			assert.equal(lxp.tostring(node, { declaration = true }), f:read("*a"))
+			f:close()
+			assert.matches.error(function()
+				lxp.write(f, node)
+			end, "closed file")
+		end)
+
+	end)
+
+
+
+	describe("tapes", function()
+
+		local function collect(iter, state, init)
+			local events = {}
+			for ev, a, b in iter, state, init do
+				events[#events+1] = { ev, a, b }
+			end
+			return events
+		end
+
+		local doc = [==[<?xml version="1.0"?>
+<!DOCTYPE r [<!ATTLIST e d CDATA "def">]>
+<r a="1" b="2"><e x="y">text<![CDATA[<cdata>]]></e><!--c--><?pi data?><e/></r>]==]
+
+
+		it("records the events of a parser", function()
+			local expected = collect(lxp.new({}):events(doc, 1000))
+			assert.equal("text<cdata>", expected[3][2])
+			assert.same(expected, collect(lxp.tokenize(doc):events()))
+		end)
+
+
+		it("records big documents over many blocks", function()
+			local parts = { "<r>" }
+			for i = 1, 20000 do
+				parts[#parts+1] = ([[<e id="%d">%s</e>]]):format(i, ("x"):rep(i % 50))
+			end
+			parts[#parts+1] = "</r>"
+			local big = table.concat(parts)
+			local n, last = 0
+			for ev, name, attr in lxp.tokenize(big):events() do
+				if ev == "StartElement" and name == "e" then
+					n = n + 1
+					last = attr.id
+				end
+			end
+			assert.equal(20000, n)
+			assert.equal("20000", last)
+		end)
+
+
+		it("splits names with a separator", function()
+			local events = collect(lxp.tokenize([[<a:r xmlns:a="urn:x" a:b="1"/>]],
+				{ separator = "?" }):events())
+			assert.same({
+				{ "StartElement", "urn:x?r", { "urn:x?b", ["urn:x?b"] = "1" } },
+				{ "EndElement", "urn:x?r", false },
+			}, events)
+		end)
+
+
+		it("raises errors at the end of the events", function()
+			local tape = lxp.tokenize("<r><a></b></r>")
+			local iter, state, init = tape:events()
+			assert.same({ "StartElement", "r", {} }, { iter(state, init) })
+			assert.same({ "StartElement", "a", {} }, { iter(state, init) })
+			assert.matches.error(function()
+				iter(state, init)
+			end, "mismatched tag %(line 1, column 9, position 9%)")
+			assert.same({ nil, "mismatched tag", 1, 9, 9 }, { tape:status() })
+			assert.is_true(lxp.tokenize(doc):status())
+		end)
+
+
+		it("give the status before the events are read", function()
+			local parts = { "<r>" }
+			for i = 1, 200000 do
+				parts[#parts+1] = ('<e id="%d"/>'):format(i)
+			end
+			parts[#parts+1] = "</r>"
+			local tape = lxp.tokenize(table.concat(parts))
+			assert.is_true(tape:status())
+			local n = 0
+			for ev in tape:events() do
+				if ev == "StartElement" then n = n + 1 end
+			end
+			assert.equal(200001, n)
+		end)
+
+
+		it("are read in a single pass", function()
+			local tape = lxp.tokenize(doc)
+			tape:events()
+			assert.matches.error(function()
+				tape:events()
+			end, "cannot iterate %- tape is read in a single pass")
+		end)
+
+
+		it("tokenizes many documents", function()
+			local docs = {}
+			for i = 1, 10 do
+				docs[i] = ([[<r n="%d">%s</r>]]):format(i, ("t"):rep(i))
+			end
+			docs[5] = "<r>bad"
+			for _, threads in ipairs({ 1, 4 }) do
+				local tapes = lxp.tokenizeall(docs, { threads = threads })
+				assert.equal(10, #tapes)
+				for i, tape in ipairs(tapes) do
+					if i == 5 then
+						assert.same({ nil, "no element found", 1, 7, 7 }, { tape:status() })
+					else
+						local expected = collect(lxp.new({}):events(docs[i], 100))
+						assert.same(expected, collect(tape:events()))
+						assert.same(expected, collect(tape:events()))
+					end
+				end
+			end
+			assert.same({}, lxp.tokenizeall({}))
+			assert.matches.error(function()
+				lxp.tokenizeall({ "<r/>", 1 })
+			end, "document 2 is not a string")
+		end)
+
+
+		it("cannot be used once closed", function()
+			local tape = lxp.tokenize(doc)
+			tape:close()
+			tape:close()
+			assert.matches.error(function()
+				tape:events()
+			end, "attempt to use a closed tape")
+			assert.matches.error(function()
+				tape:status()
+			end, "attempt to use a closed tape")
+		end)
+
+	end)
+
+
+
+	describe("record and replay", function()
+
+		local doc = [==[<?xml version="1.0"?>
+<!DOCTYPE r [<!ATTLIST e d CDATA "def">]>
+<r a="1" b="2"><e x="y">text<![CDATA[<cdata>]]> more</e><!--c--><?pi data?><e/></r>]==]
+
+		local function logger(log, keys)
+			local cb = {}
+			for _, key in ipairs(keys or { "StartElement", "EndElement", "CharacterData",
+					"Comment", "ProcessingInstruction", "StartCdataSection", "EndCdataSection" }) do
+				cb[key] = function(p, ...)
+					log[#log+1] = { key, ... }
+				end
+			end
+			return cb
+		end
+
+		local function record(callbacks, ...)
+			local p = lxp.new(callbacks, ...):record()
+			assert(p:parse(doc))
+			assert(p:parse())
+			return p:gettape()
+		end
+
+
+		it("does not change what the Default callback gets", function()
+			local function default_text(recording)
+				local text = {}
+				local p = lxp.new { Default = function(p, s) text[#text+1] = s end }
+				if recording then p:record() end
+				assert(p:parse("<a x='1'><!--c--><?pi d?><b/>t</a>"))
+				assert(p:parse())
+				return table.concat(text)
+			end
+			assert.equal("<a x='1'><!--c--><?pi d?><b/>t</a>", default_text(false))
+			assert.equal(default_text(false), default_text(true))
+		end)
+
+
+		it("replays the events delivered", function()
+			local parsed, replayed = {}, {}
+			local tape = record(logger(parsed))
+			assert.equal("LXPT\1\0", tape:sub(1, 6))
+			assert.is_true(lxp.replay(tape, logger(replayed)))
+			assert.equal(13, #replayed)
+			assert.same(parsed, replayed)
+			assert.same({ "StartElement", "e", { d = "def" } }, replayed[11])
+		end)
+
+
+		it("records CDATA sections only with their callbacks", function()
+			local parsed, replayed = {}, {}
+			local tape = record(logger(parsed, { "CharacterData" }))
+			assert.same({ { "CharacterData", "text<cdata> more" } }, parsed)
+			lxp.replay(tape, logger(replayed))
+			assert.equal(9, #replayed)
+			assert.same({ "CharacterData", "text<cdata> more" }, replayed[3])
+		end)
+
+
+		it("keeps the namespace separator", function()
+			local p = lxp.new({}, "?"):record()
+			assert(p:parse([[<a:r xmlns:a="urn:x" a:b="1"/>]]))
+			assert(p:parse())
+			local replayed = {}
+			lxp.replay(p:gettape(), {
+				StartElement = function(parser, name, attr)
+					replayed[#replayed+1] = { name, attr }
+				end,
+			})
+			assert.same({ { "urn:x?r", { "urn:x?b", ["urn:x?b"] = "1" } } }, replayed)
+		end)
+
+
+		it("replays from a file", function()
+			local parsed, replayed = {}, {}
+			local name = os.tmpname()
+			local f = assert(io.open(name, "wb"))
+			f:write(record(logger(parsed)))
+			f:close()
+			assert.is_true(lxp.replayfile(name, logger(replayed)))
+			assert.same(parsed, replayed)
+			os.remove(name)
+			local ok, err = lxp.replayfile(name, {})
+			assert.is_nil(ok)
+			assert.matches("No such file", err)
+		end)
+
+
+		it("propagates errors from callbacks", function()
+			local tape = record({})
+			assert.matches.error(function()
+				lxp.replay(tape, { Comment = function() error("oops") end })
+			end, "oops")
+			assert.matches.error(function()
+				lxp.replay(tape, { Comment = true })
+			end, "lxp 'Comment' callback is not a function")
+		end)
+
+
+		it("rejects invalid recordings", function()
+			local tape = record({})
+			assert.matches.error(function()
+				lxp.replay("<r/>", {})
+			end, "invalid tape %(not a recording%)")
+			assert.matches.error(function()
+				lxp.replay("LXPT\99\0\0", {})
+			end, "invalid tape %(version 99, expected 1%)")
+			for _, cut in ipairs({ 7, 20, #tape - 1 }) do
+				assert.matches.error(function()
+					lxp.replay(tape:sub(1, cut), {})
+				end, "invalid tape %(truncated or corrupt%)")
+			end
+		end)
+
+
+		it("is only available on a complete document", function()
+			local p = lxp.new({})
+			assert.matches.error(function() p:gettape() end, "parser is not recording")
+			p:record()
+			assert(p:parse("<r>"))
+			assert.matches.error(function() p:gettape() end, "document is not finished")
+			assert.matches.error(function() p:record() end, "parser has already started")
+			assert.is_nil(p:parse("</x>"))
+			assert.matches.error(function() p:gettape() end, "document is not finished")
+			p:reset()
+			assert(p:parse("<s/>"))
+			assert(p:parse())
+			local replayed = {}
+			lxp.replay(p:gettape(), logger(replayed))
+			assert.same({ { "StartElement", "s", {} }, { "EndElement", "s" } }, replayed)
+		end)
+
+	end)
+
+
+
+	describe("parsefile", function()
+
+		local fn
+		local doc = [[<root><a id="1">text</a><a id="2"/></root>]]
+
+		before_each(function()
+			fn = assert(require("pl.path").tmpname())
+			assert(require("pl.utils").writefile(fn, doc))
+		end)
+
+		after_each(function()
+			os.remove(fn)
+		end)
+
+
+		it("parses a file by name", function()
+			local p = test_parser { "StartElement", "CharacterData", "EndElement" }
+			assert.equal(p, p:parsefile(fn))
+			assert.same({
+				{ "StartElement", "root", {} },
+				{ "StartElement", "a", { "id", id = "1" } },
+				{ "CharacterData", "text" },
+				{ "EndElement", "a" },
+				{ "StartElement", "a", { "id", id = "2" } },
+				{ "EndElement", "a" },
+				{ "EndElement", "root" },
+			}, cbdata)
+			p:close()
+		end)
+
+
+		it("parses an open file in small chunks", function()
+			local f = assert(io.open(fn))
+			local p = test_parser { "StartElement" }
+			assert.equal(p, p:parsefile(f, 3))
+			assert.equal(3, #cbdata)
+			f:close()
+			assert.matches.error(function()
+				lxp.new({}):parsefile(f)
+			end, "closed file")
+		end)
+
+
+		it("finishes the document", function()
+			local p = lxp.new({})
+			assert(p:parsefile(fn))
+			assert.same({ nil, "cannot parse - document is finished" }, { p:parsefile(fn) })
+		end)
+
+
+		it("returns errors", function()
+			local p = lxp.new({})
+			local ok, msg = p:parsefile(fn .. ".missing")
+			assert.is_nil(ok)
+			assert.matches("%.missing: ", msg)
+			local bad = fn .. ".bad"
+			assert(require("pl.utils").writefile(bad, "<root><a></root>"))
+			finally(function() os.remove(bad) end)
+			assert.same({ nil, "mismatched tag", 1, 12, 12 }, { lxp.new({}):parsefile(bad) })
+		end)
+
+	end)
+
+
+
+	describe("pull iterator", function()
+
+		local function collect(p, source, group)
+			local events = {}
+			for ev, a, b in p:events(source, group) do
+				events[#events+1] = { ev, a, b }
+			end
+			return events
+		end
+
+
+		it("iterates over the events of a string", function()
+			local p = lxp.new({})
+			assert.same({
+				{ "StartElement", "root", { "a", a = "1" } },
+				{ "CharacterData", "text", false },
+				{ "Comment", "c", false },
+				{ "ProcessingInstruction", "pi", "data" },
+				{ "EndElement", "root", false },
+			}, collect(p, [[<root a="1">text<!--c--><?pi data?></root>]]))
+			p:close()
+		end)
+
+
+		it("reads chunks from a function", function()
+			local chunks = { "<root><a>1</a>", "<a>2</a>", "</root>" }
+			local i = 0
+			local p = lxp.new({})
+			local events = collect(p, function() i = i + 1 return chunks[i] end, 3)
+			assert.equal(8, #events)
+			assert.same({ "EndElement", "root", false }, events[8])
+		end)
+
+
+		it("stops reading when the loop is left", function()
+			local chunks = { "<root><a>1</a>", "<a>2</a>", "<a>3</a></root>" }
+			local i = 0
+			local p = lxp.new({})
+			for ev, a in p:events(function() i = i + 1 return chunks[i] end) do
+				if a == "2" then break end
+			end
+			assert.equal(2, i)
+			assert.same({ 1, 23, 23 }, { p:pos() })
+			p:close()
+		end)
+
+
+		it("still calls the other callbacks", function()
+			local p = lxp.new({ StartCdataSection = function() end })
+			assert.same({
+				{ "StartElement", "root", {} },
+				{ "CharacterData", "x", false },
+				{ "EndElement", "root", false },
+			}, collect(p, [=[<root><![CDATA[x]]></root>]=]))
+		end)
+
+
+		it("raises parse errors", function()
+			local p = lxp.new({})
+			assert.matches.error(function()
+				collect(p, "<root><a></root>")
+			end, "mismatched tag %(line 1, column 12, position 12%)")
+		end)
+
+
+		it("cannot be started twice", function()
+			local p = lxp.new({})
+			p:events("<root/>")
+			assert.matches.error(function()
+				p:events("<root/>")
+			end, "cannot iterate %- parser has already started")
+		end)
+
+	end)
+
+
+
+	describe("attribute proxy", function()
+
+		it("reads attributes during the callback", function()
+			local seen
+			local p = lxp.new({
+				StartElement = function(p, name, attr)
+					seen = { attr.id, attr.missing, #attr, attr[1], attr[2], attr[3] }
+				end,
+			}, nil, { attributes = "proxy" })
+			assert(p:parse[[<root id="1" lang="en"/>]])
+			assert(p:parse())
+			assert.same({ "1", nil, 2, "id", "lang", nil }, seen)
+		end)
+
+
+		it("cannot be used after the callback", function()
+			local kept
+			local p = lxp.new({
+				StartElement = function(p, name, attr) kept = attr end,
+			}, nil, { attributes = "proxy" })
+			assert(p:parse[[<root id="1"/>]])
+			assert.matches.error(function()
+				return kept.id
+			end, "attribute proxy used outside its StartElement callback")
+			p:close()
+			assert.matches.error(function()
+				return kept.id
+			end, "attribute proxy used outside its StartElement callback")
+		end)
+
+
+		it("rejects unknown modes", function()
+			assert.matches.error(function()
+				lxp.new({}, nil, { attributes = "lazy" })
+			end, "invalid attributes mode 'lazy'")
+		end)
+
+	end)
+
+
+
+	describe("name cache", function()
+
+		it("pushes each name once", function()
+			local p = test_parser { "StartElement", "EndElement" }
+			assert(p:parse[[<root><a id="1"/><a id="2"/></root>]])
+			assert(p:parse())
+			assert.same({
+				{ "StartElement", "root", {} },
+				{ "StartElement", "a", { "id", id = "1" } },
+				{ "EndElement", "a" },
+				{ "StartElement", "a", { "id", id = "2" } },
+				{ "EndElement", "a" },
+				{ "EndElement", "root" },
+			}, cbdata)
+			local hits, misses, names = p:namecache()
+			assert.same({ 5, 3, 3 }, { hits, misses, names })
+		end)
+
+
+		it("can be disabled", function()
+			local p = lxp.new({}, nil, { tree = "lom", namecache = false })
+			assert(p:parse[[<root><a/><a/></root>]])
+			assert(p:parse())
+			assert.same({ tag = "root", attr = {},
+				{ tag = "a", attr = {} }, { tag = "a", attr = {} } }, p:gettree())
+			assert.same({ 0, 0, 0 }, { p:namecache() })
+		end)
+
+	end)
+
+
+
+	describe("limits", function()
+
+		it("stops parsing when a limit is breached", function()
+			local p = lxp.new({}, nil, { limits = { depth = 2 } })
+			assert(p:parse[[<root><a>]])
+			local r, err, line, col, pos = p:parse[[<b/></a></root>]]
+			assert.is_nil(r)
+			assert.same({ "structure is too deep", 1, 10, 10 }, { err, line, col, pos })
+			-- the error sticks
+			r, err = p:parse[[<c/>]]
+			assert.is_nil(r)
+			assert.equal("structure is too deep", err)
+		end)
+
+
+		it("stops a filtered parse on a breach", function()
+			local ends = {}
+			local p = lxp.new({
+				EndElement = function(p, name) ends[#ends+1] = name end,
+			}, nil, { filter = "//c", limits = { depth = 2 } })
+			local r, err = p:parse[[<a><b><c/></b></a>]]
+			assert.is_nil(r)
+			assert.equal("structure is too deep", err)
+			assert.same({}, ends)
+		end)
+
+
+		it("checks what a filter drops", function()
+			local function parse(doc, limits)
+				local p = lxp.new({ StartElement = function() end },
+				                  nil, { filter = "/r/keep", limits = limits })
+				local r, err = p:parse(doc)
+				return r and true or err
+			end
+			local limits = { maxAttributes = 2, attribute = 5, maxChildren = 3, text = 4, comment = 4 }
+			assert.equal("too many attributes",
+				parse([[<r><skip a="1" b="2" c="3"/><keep/></r>]], limits))
+			assert.equal("attribute value too long",
+				parse([[<r><skip><x a="123456"/></skip><keep/></r>]], limits))
+			assert.equal("too many children",
+				parse([[<r><skip><x/><x/><x/><x/></skip><keep/></r>]], limits))
+			assert.equal("text/CDATA node(s) too long",
+				parse([[<r><skip>12345</skip><keep/></r>]], limits))
+			assert.equal("comment too long",
+				parse([[<r><skip><!--12345--></skip><keep/></r>]], limits))
+			-- the children of each element are counted apart
+			assert.is_true(parse([[<r><skip><x/><x/><x/></skip><skip><x/><x/><x/></skip><keep/></r>]], limits))
+		end)
+
+
+		it("checks the attributes a filter leaves out", function()
+			local p = lxp.new({ StartElement = function() end },
+			                  nil, { filter = "//x/@id", limits = { attribute = 5 } })
+			local r, err = p:parse([[<r><x id="1" other="123456"/></r>]])
+			assert.is_nil(r)
+			assert.equal("attribute value too long", err)
+		end)
+
+
+		it("counts adjacent text and CDATA as one node", function()
+			local p = lxp.new({}, nil, { limits = { maxChildren = 1, text = 6 } })
+			assert(p:parse[=[<root>abc<![CDATA[def]]></root>]=])
+			p = lxp.new({}, nil, { limits = { maxChildren = 1, text = 5 } })
+			local r, err = p:parse[=[<root>abc<![CDATA[def]]></root>]=]
+			assert.is_nil(r)
+			assert.equal("text/CDATA node(s) too long", err)
+		end)
+
+
+		it("checks the document size", function()
+			local p = lxp.new({}, nil, { limits = { document = 10 } })
+			assert(p:parse[[<root>]])
+			local r, err = p:parse[[</root>]]
+			assert.is_nil(r)
+			assert.equal("document too large", err)
+		end)
+
+
+		it("checks limits while building a tree", function()
+			local p = lxp.new({}, nil, { tree = "lom", limits = { maxAttributes = 1 } })
+			local r, err = p:parse[[<root a="1" b="2"/>]]
+			assert.is_nil(r)
+			assert.equal("too many attributes", err)
+		end)
+
+
+		it("gives events without callbacks to 'Default'", function()
+			local p = test_parser { "Default" }
+			p = lxp.new(p:getcallbacks(), nil, { limits = { comment = 10 } })
+			assert(p:parse[[<root><!--hi--></root>]])
+			assert(p:parse())
+			assert.same({
+				{ "Default", "<root>" },
+				{ "Default", "<!--hi-->" },
+				{ "Default", "</root>" },
+			}, cbdata)
+		end)
+
+
+		it("rejects invalid limits", function()
+			assert.matches.error(function()
+				lxp.new({}, nil, { limits = { depth = "deep" } })
+			end, "invalid limit 'depth' %(a number expected%)")
+		end)
+
+	end)
+
+
+
 	describe("BLA protection", function()
 		local bla_body = [[<?xml version="1.0"?>
 			<!DOCTYPE lolz [
@@ -101,6 +101,18 @@ describe("threats", function()
 	end)
 
 
+	it("counts events with the 'stats' option", function()
+		p = require("lxp.threat").new(callbacks, sep, { stats = true })
+		assert(p:parse("<root>hello</root>"))
+		assert(p:parse())
+		local stats = p:stats()
+		assert.same({ count = 1, bytes = 4 }, stats.events.StartElement)
+		assert.same({ count = 1, bytes = 5 }, stats.events.CharacterData)
+		assert.equal(#cbdata, stats.calls)
+		assert.equal(18, stats.input)
+	end)
+
+
 	it("doesn't accept maxNamespaces, prefix, or namespaceUri without separator", function()
 		callbacks.threat = {}
 		for k,v in pairs(threat_no_ns) do callbacks.threat[k] = v end
@@ -147,6 +147,17 @@ describe("Lua object model:", function()
 				end)
 
 
+				it("test case " .. i .. ": file name", function()
+					local fn = assert(require("pl.path").tmpname())
+					finally(function()
+						os.remove(fn)
+					end)
+					assert(require("pl.utils").writefile(fn, doc))
+					local o = assert(lom.parsefile(fn, opts))
+					assert.same(test.lom, o)
+				end)
+
+
 				it("test case " .. i .. ": table", function()
 					local t = {}
 					for i = 1, #doc, 10 do
@@ -177,6 +188,245 @@ describe("Lua object model:", function()
 
 
 
+	describe("parse() with pooled parsers", function()
+
+		it("returns independent trees", function()
+			local first = assert(lom.parse("<a>1</a>"))
+			local second = assert(lom.parse("<b>2</b>"))
+			assert.same({ tag = "a", attr = {}, "1" }, first)
+			assert.same({ tag = "b", attr = {}, "2" }, second)
+		end)
+
+
+		it("parses after an error", function()
+			assert.same({ nil, "mismatched tag", 1, 6, 6 }, { lom.parse("<a></b>") })
+			assert.same({ tag = "a", attr = {} }, lom.parse("<a/>"))
+		end)
+
+
+		it("keeps the options apart", function()
+			local doc = [[<x:a xmlns:x="u"/>]]
+			assert.equal("u?a", assert(lom.parse(doc, { separator = "?" })).tag)
+			assert.equal("x:a", assert(lom.parse(doc)).tag)
+			assert.equal("u?a", assert(lom.parse(doc, { separator = "?" })).tag)
+		end)
+
+	end)
+
+
+
+	describe("parse() with text options", function()
+
+		it("trims text and merges CDATA sections", function()
+			local doc = "<r>\n  <a> x <![CDATA[<y>]]> </a>\n</r>"
+			assert.same({ tag = "r", attr = {}, { tag = "a", attr = {}, "x <y>" } },
+				lom.parse(doc, { whitespace = "trim", mergecdata = true }))
+			assert.same({ tag = "r", attr = {}, "\n  ", { tag = "a", attr = {}, " x <y> " }, "\n" },
+				lom.parse(doc))
+		end)
+
+	end)
+
+
+
+	describe("parse() with compact trees", function()
+
+		local doc = [[<r a="1" b="2"><x id="1">one &amp; two</x><y/>text<x id="2"><z>deep</z></x></r>]]
+
+		-- copies a compact tree into a LOM one
+		local function expand (node)
+			if type(node) == "string" then
+				return node
+			end
+			local t = { tag = node.tag, attr = node.attr }
+			for i = 1, #node do
+				t[i] = expand(node[i])
+			end
+			return t
+		end
+
+
+		it("reads as a LOM tree", function()
+			local tree = assert(lom.parse(doc, { compact = true }))
+			assert.equal("userdata", type(tree))
+			assert.same(lom.parse(doc), expand(tree))
+			assert.equal(tree[1], tree[1])
+			assert.is_nil(tree[6])
+			assert.is_nil(tree.other)
+			assert.has.error(function() tree.tag = "s" end, "compact trees are read-only")
+		end)
+
+
+		it("finds elements and lists children", function()
+			local tree = assert(lom.parse(doc, { compact = true }))
+			assert.equal("deep", lom.find_elem(tree, "z")[1])
+			assert.equal(tree, lom.find_elem(tree, "r"))
+			assert.is_nil(lom.find_elem(tree, "none"))
+			assert.is_nil(lom.find_elem(tree[1], "z"))
+			local ids = {}
+			for x in lom.list_children(tree, "x") do
+				ids[#ids+1] = x.attr.id
+			end
+			assert.same({ "1", "2" }, ids)
+			local tags = {}
+			for child in lom.list_children(tree) do
+				tags[#tags+1] = child.tag
+			end
+			assert.same({ "x", "y", "x" }, tags)
+		end)
+
+
+		it("applies the text options", function()
+			local tree = lom.parse("<r>\n  <a> x <![CDATA[<y>]]> </a>\n</r>",
+				{ compact = true, whitespace = "trim", mergecdata = true })
+			assert.same({ tag = "r", attr = {}, { tag = "a", attr = {}, "x <y>" } }, expand(tree))
+		end)
+
+
+		it("joins text split over chunks", function()
+			local tree = lom.parse({ "<r>ab", "cd<a/>e", "f</r>" }, { compact = true })
+			assert.same({ tag = "r", attr = {}, "abcd", { tag = "a", attr = {} }, "ef" }, expand(tree))
+		end)
+
+
+		it("keeps the tree alive through its nodes", function()
+			local node = lom.parse(doc, { compact = true })[4][1]
+			collectgarbage()
+			collectgarbage()
+			assert.equal("deep", node[1])
+		end)
+
+
+		it("is written as a LOM tree", function()
+			local tree = lom.parse(doc, { compact = true })
+			assert.equal(doc, lom.tostring(tree))
+			assert.equal(lom.tostring(lom.parse(doc), { indent = 1 }),
+				lom.tostring(tree, { indent = 1 }))
+		end)
+
+	end)
+
+
+
+	describe("stream()", function()
+
+		local doc = [[<records><record id="1"><name>one</name></record><skip><record id="x"/></skip><record id="2"><name>two</name></record></records>]]
+
+
+		it("yields every matching element", function()
+			local ids = {}
+			for rec in lom.stream(doc, "/records/record") do
+				ids[#ids+1] = rec.attr.id
+				assert.equal("name", rec[1].tag)
+			end
+			assert.same({ "1", "2" }, ids)
+
+			local recs = {}
+			for rec in lom.stream(doc, "//record/@id") do
+				recs[#recs+1] = rec
+			end
+			assert.same({ tag = "record", attr = { "id", id = "x" } }, recs[2])
+		end)
+
+
+		it("reads chunks from a file, a function or a table", function()
+			local fn = assert(require("pl.path").tmpname())
+			finally(function()
+				os.remove(fn)
+			end)
+			assert(require("pl.utils").writefile(fn, doc))
+			local f = assert(io.open(fn))
+			local sources = { f, string.gmatch(doc, ".-%>"), { doc:sub(1, 50), doc:sub(51) } }
+			for _, source in ipairs(sources) do
+				local n = 0
+				for rec in lom.stream(source, "//name") do
+					n = n + 1
+					assert.equal(n == 1 and "one" or "two", rec[1])
+				end
+				assert.equal(2, n)
+			end
+			f:close()
+		end)
+
+
+		it("yields the root without a path", function()
+			local n = 0
+			for root in lom.stream(doc) do
+				n = n + 1
+				assert.equal("records", root.tag)
+			end
+			assert.equal(1, n)
+		end)
+
+
+		it("raises parse errors and checks threats", function()
+			assert.matches.error(function()
+				for _ in lom.stream("<r><a></b></r>", "/r/a") do end
+			end, "mismatched tag %(line 1, column 9, position 9%)")
+			assert.matches.error(function()
+				for _ in lom.stream(doc, "/records/record", { threat = { depth = 2 } }) do end
+			end, "structure is too deep")
+		end)
+
+
+		it("checks threats in what the path drops", function()
+			assert.matches.error(function()
+				local src = [[<records><skip v="123456"/><record id="1"/></records>]]
+				for _ in lom.stream(src, "/records/record", { threat = { attribute = 5 } }) do end
+			end, "attribute value too long")
+			assert.matches.error(function()
+				local src = [[<records><skip><a/><a/><a/></skip><record id="1"/></records>]]
+				for _ in lom.stream(src, "/records/record", { threat = { maxChildren = 2 } }) do end
+			end, "too many children")
+		end)
+
+	end)
+
+
+
+	describe("tostring()", function()
+
+		local doc = [==[<root a="1" b="x &amp; &quot;y&quot;&#10;"><item id="1">text &lt;here&gt; &amp; there</item><empty/><![CDATA[<raw>]]><!-- dropped --><mixed>some <b>bold</b> text</mixed></root>]==]
+
+
+		it("round-trips a parsed tree", function()
+			local tree = assert(lom.parse(doc))
+			local text = lom.tostring(tree)
+			assert.equal([==[<root a="1" b="x &amp; &quot;y&quot;&#10;"><item id="1">text &lt;here&gt; &amp; there</item><empty/>&lt;raw&gt;<mixed>some <b>bold</b> text</mixed></root>]==], text)
+			assert.same(tree, assert(lom.parse(text)))
+		end)
+
+
+		it("indents element content only", function()
+			local tree = assert(lom.parse(doc))
+			local text = lom.tostring(tree, { indent = 2, declaration = true })
+			assert.equal([==[<?xml version="1.0" encoding="UTF-8"?>
+<root a="1" b="x &amp; &quot;y&quot;&#10;"><item id="1">text &lt;here&gt; &amp; there</item><empty/>&lt;raw&gt;<mixed>some <b>bold</b> text</mixed></root>]==], text)
+			tree = assert(lom.parse("<a><b><c>x</c></b><d/></a>"))
+			assert.equal("<a>\n\t<b>\n\t\t<c>x</c>\n\t</b>\n\t<d/>\n</a>", lom.tostring(tree, { indent = "\t" }))
+		end)
+
+
+		it("writes to a file", function()
+			local fn = assert(require("pl.path").tmpname())
+			finally(function()
+				os.remove(fn)
+			end)
+			local tree = assert(lom.parse(doc))
+			assert.is_true(lom.write(fn, tree))
+			assert.same(tree, assert(lom.parsefile(fn)))
+			local f = assert(io.open(fn, "wb"))
+			assert.is_true(lom.write(f, tree, { indent = 1 }))
+			f:close()
+			f = assert(io.open(fn, "rb"))
+			assert.equal(lom.tostring(tree, { indent = 1 }), f:read("*a"))
+			f:close()
+		end)
+
+	end)
+
+
+
 	describe("find_elem()", function()
 
 		it("returns element", function()
@@ -234,4 +484,67 @@ describe("Lua object model:", function()
 
 	end)
 
+
+
+	describe("indexed lookups", function()
+
+		local doc = [[<r id="r"><x id="1" k="a">one</x><y id="2"/><x id="3"><z id="4" k="a"/><x id="5"/></x></r>]]
+
+		local function ids (nodes)
+			local t = {}
+			for i, node in ipairs(nodes) do
+				t[i] = node.attr.id
+			end
+			return t
+		end
+
+		for _, compact in ipairs { false, true } do
+			for _, index in ipairs { false, true, { "id" } } do
+				local opts = { compact = compact, index = index }
+				local name = (compact and "compact" or "LOM") .. " tree, index " ..
+					(type(index) == "table" and "{ 'id' }" or tostring(index))
+
+				it("finds elements in a " .. name, function()
+					local tree = assert(lom.parse(doc, opts))
+					assert.same({ "1", "3", "5" }, ids(lom.find_all(tree, "x")))
+					assert.same({}, lom.find_all(tree, "none"))
+					local x3 = lom.by_attr(tree, "id", "3")
+					assert.same({ "3", "5" }, ids(lom.find_all(x3, "x")))
+					assert.equal("1", lom.by_attr(tree, "k", "a").attr.id)
+					assert.equal("4", lom.by_attr(x3, "k", "a").attr.id)
+					assert.is_nil(lom.by_attr(tree, "id", "9"))
+					assert.is_nil(lom.by_attr(tree, "none", "1"))
+					if index or compact then
+						local z = lom.by_attr(tree, "id", "4")
+						assert.equal(x3, lom.parent(z))
+						assert.equal(tree, lom.parent(x3))
+						assert.is_nil(lom.parent(tree))
+					end
+				end)
+			end
+		end
+
+
+		it("finds the parents of elements of several trees", function()
+			local t1 = assert(lom.parse(doc, { index = true }))
+			local t2 = assert(lom.parse(doc, { index = true }))
+			local z1 = lom.by_attr(t1, "id", "4")
+			local z2 = lom.by_attr(t2, "id", "4")
+			assert.equal(lom.by_attr(t1, "id", "3"), lom.parent(z1))
+			assert.equal(lom.by_attr(t2, "id", "3"), lom.parent(z2))
+			assert.is_nil(lom.parent(assert(lom.parse(doc))[1]))
+		end)
+
+
+		it("does not keep indexed trees alive", function()
+			local tree = lom.parse(doc, { index = true })
+			local refs = setmetatable({ tree }, { __mode = "v" })
+			tree = nil
+			collectgarbage()
+			collectgarbage()
+			assert.is_nil(refs[1])
+		end)
+
+	end)
+
 end)
@@ -299,6 +299,52 @@ local tests = {
 			},
 		},
 	},
+	{
+		input = [[<r> <a><b>x</b>text</a> <c> </c> </r>]],
+		totable = {
+			[0] = "r",
+			" ",
+			{
+				[0] = "a",
+				{
+					[0] = "b",
+					"x",
+				},
+				"text",
+			},
+			" ",
+			{
+				[0] = "c",
+				" ",
+			},
+			" ",
+		},
+		clean = {
+			[0] = "r",
+			{
+				[0] = "a",
+				{
+					[0] = "b",
+					"x",
+				},
+				"text",
+			},
+			{
+				[0] = "c",
+			},
+		},
+		torecord = { -- 'a' had more than a single text node, so it stays a table
+			[0] = "r",
+			{
+				[0] = "a",
+				b = "x",
+				"text",
+			},
+			{
+				[0] = "c",
+			},
+		},
+	},
 }
 
 
@@ -351,6 +397,17 @@ describe("totable:", function()
 					end)
 
 
+					it("file name", function()
+						local fn = assert(require("pl.path").tmpname())
+						finally(function()
+							os.remove(fn)
+						end)
+						assert(require("pl.utils").writefile(fn, doc))
+						local o = assert(totable.parsefile(fn, opts))
+						assert.same(test.totable, o)
+					end)
+
+
 					it("table", function()
 						local t = {}
 						for i = 1, #doc, 10 do
@@ -378,8 +435,78 @@ describe("totable:", function()
 				assert.same(test.torecord, result)
 			end)
 
+
+			it("clean option", function()
+				local result = assert(totable.parse(doc, { separator = "?", clean = true }))
+				assert.same(test.clean, result)
+			end)
+
+
+			it("clean and torecord options", function()
+				local t = {}
+				for i = 1, #doc, 10 do
+					t[#t+1] = doc:sub(i, i+9)
+				end
+				local result = assert(totable.parse(t, { separator = "?", clean = true, torecord = true }))
+				assert.same(test.torecord, result)
+			end)
+
+
+			it("clean and torecord options with threat protection", function()
+				local result = assert(totable.parse(doc, { separator = "?", clean = true, torecord = true, threat = {} }))
+				assert.same(test.torecord, result)
+			end)
+
 		end)
 
 	end
 
+
+	describe("stream()", function()
+
+		it("yields every matching element", function()
+			local doc = [[<records>
+				<record id="1"><name>one</name><tags><tag>a</tag></tags></record>
+				<record id="2"><name>two</name></record>
+			</records>]]
+			local recs = {}
+			for rec in totable.stream(doc, "/records/record", { clean = true, torecord = true }) do
+				recs[#recs+1] = rec
+			end
+			assert.same({
+				{ [0] = "record", id = "1", name = "one", { [0] = "tags", tag = "a" } },
+				{ [0] = "record", id = "2", name = "two" },
+			}, recs)
+		end)
+
+
+		it("checks threats in what the path drops", function()
+			assert.matches.error(function()
+				local doc = [[<records><skip v="123456"/><record id="1"/></records>]]
+				for _ in totable.stream(doc, "/records/record", { threat = { attribute = 5 } }) do end
+			end, "attribute value too long")
+			assert.matches.error(function()
+				local doc = [[<records><skip><a/><a/><a/></skip><record id="1"/></records>]]
+				for _ in totable.stream(doc, "/records/record", { threat = { maxChildren = 2 } }) do end
+			end, "too many children")
+		end)
+
+	end)
+
+
+	describe("tostring()", function()
+
+		it("round-trips a parsed tree", function()
+			local doc = [[<root><item id="1" kind="a&amp;b">one</item><item id="2"/>tail</root>]]
+			local tree = assert(totable.parse(doc))
+			local text = totable.tostring(tree)
+			assert.equal(doc, text)
+			assert.same(tree, assert(totable.parse(text)))
+			assert.equal([[<root>
+ <a x="1"/>
+</root>]], totable.tostring({ [0] = "root", { [0] = "a", x = 1 } }, { indent = 1 }))
+		end)
+
+	end)
+
 end)
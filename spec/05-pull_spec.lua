@@ -0,0 +1,130 @@
+describe("pull iterators:", function()
+
+	local lxp, pull
+	before_each(function()
+		lxp = require "lxp"
+		pull = require "lxp.pull"
+	end)
+
+
+	local function collect(iter, p, source, size)
+		local events = {}
+		for ev, a, b in iter(p, source, size) do
+			events[#events+1] = { ev, a, b }
+		end
+		return events
+	end
+
+	local function parser_events(p, source, size)
+		return p:events(source, size)
+	end
+
+
+	describe("events()", function()
+
+		it("gives the events of parser:events", function()
+			local doc = [=[<root a="1" b="2"><!--c-->text &amp; <![CDATA[more]]><x/><?pi data?></root>]=]
+			for size = 1, 4 do
+				assert.same(collect(parser_events, lxp.new({}), doc, size),
+				            collect(pull.events, lxp.new({}), doc, size))
+			end
+		end)
+
+
+		it("reads chunks from a function", function()
+			local chunks = { "<root><a k='v'>1</a>", "<a>2</a>", "</root>" }
+			local i = 0
+			local events = collect(pull.events, lxp.new({}), function()
+				i = i + 1
+				return chunks[i]
+			end, 2)
+			assert.equal(8, #events)
+			assert.same({ "StartElement", "a", { "k", k = "v" } }, events[2])
+			assert.same({ "EndElement", "root", false }, events[8])
+		end)
+
+
+		it("applies the parser options", function()
+			local p = lxp.new({}, nil, { whitespace = "skip" })
+			assert.same({
+				{ "StartElement", "root", {} },
+				{ "EndElement", "root", false },
+			}, collect(pull.events, p, "<root>\n  </root>"))
+		end)
+
+
+		it("raises parse errors", function()
+			assert.matches.error(function()
+				collect(pull.events, lxp.new({}), "<root><a></root>")
+			end, "mismatched tag")
+		end)
+
+	end)
+
+
+
+	describe("blocks()", function()
+
+		it("hands out blocks of events through the FFI", function()
+			if not pull.ffi then
+				assert.matches.error(function()
+					pull.blocks(lxp.new({}), "<root/>")
+				end, "blocks require the LuaJIT FFI")
+				return
+			end
+			local ffi = require "ffi"
+			local got = {}
+			for events, n, arena in pull.blocks(lxp.new({}), [[<root id="7">x<a/></root>]], 2) do
+				for i = 0, n - 1 do
+					local e = events[i]
+					got[#got+1] = { e.type, e.n, ffi.string(arena + e.s, e.len) }
+				end
+			end
+			assert.same({
+				{ pull.START, 1, "root" },
+				{ pull.ATTR, 0, "id" },
+				{ pull.TEXT, 0, "x" },
+				{ pull.START, 0, "a" },
+				{ pull.END, 0, "a" },
+				{ pull.END, 0, "root" },
+			}, got)
+		end)
+
+
+		it("is a parser method", function()
+			local p = lxp.new({})
+			local blocks = 0
+			for events, n, arena in p:blocks("<root><a/><b/></root>", 2) do
+				assert.equal("userdata", type(events))
+				assert.equal("userdata", type(arena))
+				blocks = blocks + 1
+			end
+			assert.equal(3, blocks)
+			assert.matches.error(function()
+				p:blocks("<root/>")
+			end, "cannot iterate %- parser has already started")
+			assert.matches.error(function()
+				lxp.new({}, nil, { tree = "lom" }):blocks("<root/>")
+			end, "cannot iterate %- parser has a tree builder or batches")
+		end)
+
+
+		it("gives external entities to the callbacks", function()
+			local names = {}
+			local p = lxp.new {
+				StartElement = function(p, name) names[#names+1] = name end,
+				ExternalEntityRef = function(p, context)
+					return context:parse("<hi>x</hi>")
+				end,
+			}
+			local blocks = 0
+			for events, n in p:blocks([[<!DOCTYPE to [<!ENTITY e SYSTEM "e.xml">]><to>&e;</to>]]) do
+				blocks = blocks + 1
+			end
+			assert.equal(1, blocks)
+			assert.same({ "hi" }, names)
+		end)
+
+	end)
+
+end)
@@ -1,58 +1,80 @@
 -- See Copyright Notice in license.html
 
-local table = require"table"
-local tinsert, tremove = table.insert, table.remove
-local assert, type = assert, type
+local type = type
+local getmetatable = getmetatable
+local setmetatable = setmetatable
+local io_type = io.type
 
 
--- auxiliary functions -------------------------------------------------------
-local function starttag (p, tag, attr)
-	local stack = p:getcallbacks().stack
-	local newelement = {tag = tag, attr = attr}
-	tinsert(stack, newelement)
-end
+-- parser pool ---------------------------------------------------------------
+-- a few reset parsers are kept for each set of options, so that parsing
+-- many small documents does not create a new parser for each one
+local POOL_SIZE = 4
+local pool = {}
+
+-- indexes of the trees parsed with the 'index' option, by root element;
+-- they hold the elements weakly, so the trees can still be collected
+local indexes = setmetatable({}, { __mode = "k" })
 
-local function endtag (p, tag)
-	local stack = p:getcallbacks().stack
-	local element = tremove(stack)
-	assert(element.tag == tag)
-	local level = #stack
-	tinsert(stack[level], element)
+local function newparser (opts)
+	local opts = opts or {}
+	-- the tree is built natively by the parser; a compact one stays in C
+	local options = {
+		tree = opts.compact and "compact" or "lom",
+		index = opts.index,
+		whitespace = opts.whitespace,
+		mergecdata = opts.mergecdata,
+		maxtext = opts.maxtext,
+	}
+	if opts.threat then
+		-- the parser keeps the threat options, so it is not pooled
+		return require("lxp.threat").new({ threat = opts.threat }, opts.separator, options)
+	end
+	if opts.index and opts.index ~= true then
+		-- the parser keeps the names of the indexed attributes
+		return require("lxp").new({}, opts.separator, options)
+	end
+	local key = (opts.separator or "")..(opts.whitespace or "")..":"..
+		(opts.mergecdata and "m" or "-")..(opts.compact and "c" or "-")..
+		(opts.index and "i" or "-")..(opts.maxtext or "")
+	local free = pool[key]
+	if free and free[1] then
+		local p = free[#free]
+		free[#free] = nil
+		return p, key
+	end
+	return require("lxp").new({}, opts.separator, options), key
 end
 
-local function text (p, txt)
-	local stack = p:getcallbacks().stack
-	local element = stack[#stack]
-	local n = #element
-	if type(element[n]) == "string" then
-		element[n] = element[n] .. txt
-	else
-		tinsert(element, txt)
+-- returns the tree (or the error), giving the parser back to its pool
+local function finish (p, key, status, err, line, col, pos)
+	local tree = status and p:gettree()
+	if type(tree) == "table" then
+		indexes[tree] = p:getindex()
+	end
+	local free = key and pool[key]
+	if key and not free then
+		free = {}
+		pool[key] = free
 	end
+	if free and #free < POOL_SIZE then
+		free[#free+1] = p:reset()
+	elseif status then
+		p:close()
+	end
+	if not status then return nil, err, line, col, pos end
+	return tree
 end
 
+
 -- main function -------------------------------------------------------------
 local function parse (o, opts)
-	local opts = opts or {}
-	local c = { StartElement = starttag,
-		EndElement = endtag,
-		CharacterData = text,
-		_nonstrict = true,
-		stack = {{}}
-	}
-
-	local p
-	if opts.threat then
-		c.threat = opts.threat
-		p = require("lxp.threat").new(c, opts.separator)
-	else
-		p = require("lxp").new(c, opts.separator)
-	end
+	local p, key = newparser(opts)
 
 	local to = type(o)
 	if to == "string" then
 		local status, err, line, col, pos = p:parse(o)
-		if not status then return nil, err, line, col, pos end
+		if not status then return finish(p, key, status, err, line, col, pos) end
 	else
 		local iter
 		if to == "table" then
@@ -60,6 +82,9 @@ local function parse (o, opts)
 			iter = function() i = i + 1; return o[i] end
 		elseif to == "function" then
 			iter = o
+		elseif io_type(o) == "file" then
+			-- read straight into the parser's buffer
+			return finish(p, key, p:parsefile(o))
 		elseif to == "userdata" and o.read then
 			iter = function()
 				local l = o:read()
@@ -72,17 +97,88 @@ local function parse (o, opts)
 		end
 		for l in iter do
 			local status, err, line, col, pos = p:parse(l)
-			if not status then return nil, err, line, col, pos end
+			if not status then return finish(p, key, status, err, line, col, pos) end
 		end
 	end
-	local status, err, line, col, pos = p:parse() -- close document
-	if not status then return nil, err, line, col, pos end
-	p:close()
-	return c.stack[1][1]
+	return finish(p, key, p:parse()) -- close document
+end
+
+local function parsefile (f, opts)
+	local p, key = newparser(opts)
+	return finish(p, key, p:parsefile(f))
+end
+
+-- streaming -----------------------------------------------------------------
+local CHUNK_SIZE = 65536
+
+-- returns the source of a document as a string or a function giving its chunks
+local function chunks (o)
+	local to = type(o)
+	if to == "string" or to == "function" then
+		return o
+	elseif to == "table" then
+		local i = 0
+		return function() i = i + 1; return o[i] end
+	elseif io_type(o) == "file" then
+		return function() return o:read(CHUNK_SIZE) end
+	elseif to == "userdata" and o.read then
+		return function()
+			local l = o:read()
+			if l then
+				return l.."\n"
+			end
+		end
+	end
+	error ("Bad argument #1 to stream: expected a string, a table, a function or a file, but got "..to, 3)
+end
+
+-- iterates over the elements matching 'path', each one built on its own
+local function stream (o, path, opts)
+	local opts = opts or {}
+	local options = {
+		tree = "lom",
+		whitespace = opts.whitespace,
+		mergecdata = opts.mergecdata,
+		maxtext = opts.maxtext,
+		filter = path,
+	}
+	local source = chunks(o)
+	local p
+	if opts.threat then
+		p = require("lxp.threat").new({ threat = opts.threat }, opts.separator, options)
+	else
+		p = require("lxp").new({}, opts.separator, options)
+	end
+	return p:trees(source)
+end
+
+-- serialization -------------------------------------------------------------
+-- the tree is written natively; 'opts' may set 'indent' and 'declaration'
+local function totext (tree, opts)
+	return require("lxp").tostring(tree, opts)
+end
+
+-- writes the tree to a file handle or to the file with the given name
+local function write (f, tree, opts)
+	if type(f) == "string" then
+		local fh = assert(io.open(f, "wb"))
+		local ok, err = pcall(require("lxp").write, fh, tree, opts)
+		fh:close()
+		if not ok then
+			error(err, 2)
+		end
+		return true
+	end
+	require("lxp").write(f, tree, opts)
+	return true
 end
 
 -- utility functions ---------------------------------------------------------
+-- the nodes of compact trees bring their own versions, which run in C
 local function find_elem (self, tag)
+	if type(self) == "userdata" then
+		return getmetatable(self).find_elem(self, tag)
+	end
 	if self.tag == tag then
 		return self
 	end
@@ -99,6 +195,9 @@ local function find_elem (self, tag)
 end
 
 local function list_children (self, tag)
+	if type(self) == "userdata" then
+		return getmetatable(self).list_children(self, tag)
+	end
 	local i = 0
 	return function ()
 		i = i+1
@@ -114,8 +213,84 @@ local function list_children (self, tag)
 	end
 end
 
+-- indexed lookups ------------------------------------------------------------
+-- trees parsed with the 'index' option are looked up in their index, other
+-- trees (and nodes other than the root) are scanned
+local function collect (node, tag, found)
+	if node.tag == tag then
+		found[#found+1] = node
+	end
+	for i = 1, #node do
+		local v = node[i]
+		if type(v) == "table" then
+			collect(v, tag, found)
+		end
+	end
+	return found
+end
+
+local function find_all (self, tag)
+	if type(self) == "userdata" then
+		return getmetatable(self).find_all(self, tag)
+	end
+	local index = indexes[self]
+	if not index then
+		return collect(self, tag, {})
+	end
+	local found, list = {}, index.tags[tag]
+	if list then
+		for i = 1, #list do
+			found[i] = list[i]
+		end
+	end
+	return found
+end
+
+local function scan (node, name, value)
+	if node.attr[name] == value then
+		return node
+	end
+	for i = 1, #node do
+		local v = node[i]
+		if type(v) == "table" then
+			local found = scan(v, name, value)
+			if found then
+				return found
+			end
+		end
+	end
+	return nil
+end
+
+local function by_attr (self, name, value)
+	if type(self) == "userdata" then
+		return getmetatable(self).by_attr(self, name, value)
+	end
+	local index = indexes[self]
+	local values = index and index.attrs[name]
+	if values then
+		return values[value]
+	end
+	return scan(self, name, value)
+end
+
+local function parent (node)
+	if type(node) == "userdata" then
+		return getmetatable(node).parent(node)
+	end
+	local index = require("lxp").indexof(node)
+	return index and index.parent[node] or nil
+end
+
 return {
+	by_attr = by_attr,
+	find_all = find_all,
 	find_elem = find_elem,
 	list_children = list_children,
+	parent = parent,
 	parse = parse,
+	parsefile = parsefile,
+	stream = stream,
+	tostring = totext,
+	write = write,
 }
@@ -0,0 +1,112 @@
+-- See Copyright Notice in license.html
+
+-- Pull iterators over the events of a document. With LuaJIT the parser
+-- writes the events to blocks in C ('parser:blocks') which are read here
+-- through the FFI, so a loop over the events makes no Lua C API call per
+-- event and stays on compiled traces. Elsewhere 'parser:events' is used.
+
+local error = error
+local pcall = pcall
+local rawget = rawget
+local require = require
+
+local jit = rawget(_G, "jit")
+local ok, ffi = pcall(require, "ffi")
+if not (jit and ok) then
+	ffi = nil
+end
+
+-- kinds of events, the codes of the blocks
+local START, END, TEXT, COMMENT, PI, ATTR = 1, 2, 3, 4, 5, 6
+
+local events_t, char_t, ffistring
+if ffi then
+	-- must match 'lxp_event' in lxplib.c
+	ffi.cdef[[
+	typedef struct lxp_event {
+		int type;
+		int n;
+		size_t s, len;
+		size_t v, vlen;
+	} lxp_event;
+	]]
+	events_t = ffi.typeof("const lxp_event *")
+	char_t = ffi.typeof("const char *")
+	ffistring = ffi.string
+end
+
+
+-- Iterator over the blocks of events of the document read from 'source'
+-- (a string, or a function returning the next chunk or nil at the end):
+-- each step gives the events ('lxp_event *', from 0), their number and the
+-- arena their strings are in, all valid until the next step
+local function blocks (p, source, size)
+	if not ffi then
+		error("lxp.pull: blocks require the LuaJIT FFI", 2)
+	end
+	local nextblock, state = p:blocks(source, size)
+	return function ()
+		local events, n, arena = nextblock(state)
+		if events then
+			return ffi.cast(events_t, events), n, ffi.cast(char_t, arena)
+		end
+	end
+end
+
+
+-- Iterator over the events of the document read from 'source', as given
+-- by 'parser:events': the name of the event and two values
+local function events (p, source, size)
+	if not ffi then
+		return p:events(source, size)
+	end
+	local nextblock, state = p:blocks(source, size)
+	local evs, arena
+	local i, n = 0, 0
+	return function ()
+		if i >= n then
+			local b, m, a = nextblock(state)
+			if not b then
+				return nil
+			end
+			evs, n, arena = ffi.cast(events_t, b), m, ffi.cast(char_t, a)
+			i = 0
+		end
+		local e = evs[i]
+		local t = e.type
+		local s = ffistring(arena + e.s, e.len)
+		i = i + 1
+		if t == START then
+			local attrs = {}
+			for k = 1, e.n do
+				local a = evs[i]
+				local name = ffistring(arena + a.s, a.len)
+				attrs[k] = name
+				attrs[name] = ffistring(arena + a.v, a.vlen)
+				i = i + 1
+			end
+			return "StartElement", s, attrs
+		elseif t == END then
+			return "EndElement", s, false
+		elseif t == TEXT then
+			return "CharacterData", s, false
+		elseif t == COMMENT then
+			return "Comment", s, false
+		else
+			return "ProcessingInstruction", s, ffistring(arena + e.v, e.vlen)
+		end
+	end
+end
+
+
+return {
+	blocks = blocks,
+	events = events,
+	ffi = ffi ~= nil,
+	START = START,
+	END = END,
+	TEXT = TEXT,
+	COMMENT = COMMENT,
+	PI = PI,
+	ATTR = ATTR,
+}
@@ -2,65 +2,113 @@
 -- Based on Luiz Henrique de Figueiredo's lxml:
 -- http://www.tecgraf.puc-rio.br/~lhf/ftp/lua/#lxml
 
-local table = require"table"
-local tinsert, tremove = table.insert, table.remove
-local assert, tostring, type = assert, tostring, type
-
--- auxiliary functions -------------------------------------------------------
-local function starttag (p, tag, attr)
-	local stack = p:getcallbacks().stack
-	local newelement = {[0] = tag}
-	for i = 1, #attr do
-		local attrname = attr[i]
-		local attrvalue = attr[attrname]
-		newelement[attrname] = attrvalue
+local type = type
+local io_type = io.type
+
+-- utility functions ---------------------------------------------------------
+local function compact (t) -- remove empty entries
+	local n = 0
+	for i = 1, #t do
+		local v = t[i]
+		if v then
+			n = n+1
+			if n ~= i then
+				t[n] = v
+				t[i] = nil
+			end
+		else
+			t[i] = nil
+		end
 	end
-	tinsert(stack, newelement)
+	return t
 end
 
-local function endtag (p, tag)
-	local stack = p:getcallbacks().stack
-	local element = tremove(stack)
-	assert(element[0] == tag, "Error while closing element: table[0] should be `"..
-		tostring(tag).."' but is `"..tostring(element[0]).."'")
-	local level = #stack
-	tinsert(stack[level], element)
+local function clean (t) -- remove empty strings
+	for i = 1, #t do
+		local v = t[i]
+		local tv = type(v)
+		if tv == "table" then
+			clean (v)
+		elseif tv == "string" and v:match"^%s*$" then
+			t[i] = false
+		end
+	end
+	return compact (t)
 end
 
-local function text (p, txt)
-	local stack = p:getcallbacks().stack
-	local element = stack[#stack]
-	local n = #element
-	if type(element[n]) == "string" and n > 0 then
-		element[n] = element[n] .. txt
-	else
-		tinsert(element, txt)
+local function torecord (t) -- move 1-value subtables to table entries
+	for i = 1, #t do
+		local v = t[i]
+		if type(v) == "table" then
+			if #v == 1 and type(v[1]) == "string" and t[v[0]] == nil then
+				t[v[0]] = v[1]
+				t[i] = false
+			else
+				torecord (v)
+			end
+		end
 	end
+	return compact (t)
 end
 
--- main function -------------------------------------------------------------
-local function parse (o, opts)
+-- parser pool ---------------------------------------------------------------
+-- a few reset parsers are kept for each set of options, so that parsing
+-- many small documents does not create a new parser for each one
+local POOL_SIZE = 4
+local pool = {}
+
+local function newparser (opts)
 	local opts = opts or {}
-	local c = {
-		StartElement = starttag,
-		EndElement = endtag,
-		CharacterData = text,
-		_nonstrict = true,
-		stack = {{}},
+	-- the tree is built natively by the parser, including the
+	-- 'clean' and 'torecord' conversions
+	local options = {
+		tree = "totable",
+		clean = opts.clean,
+		torecord = opts.torecord,
+		whitespace = opts.whitespace,
+		mergecdata = opts.mergecdata,
+		maxtext = opts.maxtext,
 	}
-
-	local p
 	if opts.threat then
-		c.threat = opts.threat
-		p = require("lxp.threat").new(c, opts.separator)
-	else
-		p = require("lxp").new(c, opts.separator)
+		-- the parser keeps the threat options, so it is not pooled
+		return require("lxp.threat").new({ threat = opts.threat }, opts.separator, options)
+	end
+	local key = (opts.separator or "")..(opts.clean and "c" or "-")..(opts.torecord and "r" or "-")..
+		(opts.whitespace or "")..":"..(opts.mergecdata and "m" or "-")..(opts.maxtext or "")
+	local free = pool[key]
+	if free and free[1] then
+		local p = free[#free]
+		free[#free] = nil
+		return p, key
+	end
+	return require("lxp").new({}, opts.separator, options), key
+end
+
+-- returns the tree (or the error), giving the parser back to its pool
+local function finish (p, key, status, err, line, col, pos)
+	local tree = status and p:gettree()
+	local free = key and pool[key]
+	if key and not free then
+		free = {}
+		pool[key] = free
+	end
+	if free and #free < POOL_SIZE then
+		free[#free+1] = p:reset()
+	elseif status then
+		p:close()
 	end
+	if not status then return nil, err, line, col, pos end
+	return tree
+end
+
+-- main function -------------------------------------------------------------
+local function parse (o, opts)
+	local p, key = newparser(opts)
 
 	local to = type(o)
 	if to == "string" then
 		local status, err, line, col, pos = p:parse(o)
-		if not status then return nil, err, line, col, pos end
+		if not status then return finish(p, key, status, err, line, col, pos) end
 	else
 		local iter
 		if to == "table" then
@@ -68,6 +116,9 @@ local function parse (o, opts)
 			iter = function() i = i + 1; return o[i] end
 		elseif to == "function" then
 			iter = o
+		elseif io_type(o) == "file" then
+			-- read straight into the parser's buffer
+			return finish(p, key, p:parsefile(o))
 		elseif to == "userdata" and o.read then
 			iter = function()
 				local l = o:read()
@@ -80,64 +131,91 @@ local function parse (o, opts)
 		end
 		for l in iter do
 			local status, err, line, col, pos = p:parse(l)
-			if not status then return nil, err, line, col, pos end
+			if not status then return finish(p, key, status, err, line, col, pos) end
 		end
 	end
-	local status, err, line, col, pos = p:parse() -- close document
-	if not status then return nil, err, line, col, pos end
-	p:close()
-	return c.stack[1][1]
+	return finish(p, key, p:parse()) -- close document
 end
 
--- utility functions ---------------------------------------------------------
-local function compact (t) -- remove empty entries
-	local n = 0
-	for i = 1, #t do
-		local v = t[i]
-		if v then
-			n = n+1
-			if n ~= i then
-				t[n] = v
-				t[i] = nil
+local function parsefile (f, opts)
+	local p, key = newparser(opts)
+	return finish(p, key, p:parsefile(f))
+end
+
+-- streaming -----------------------------------------------------------------
+local CHUNK_SIZE = 65536
+
+-- returns the source of a document as a string or a function giving its chunks
+local function chunks (o)
+	local to = type(o)
+	if to == "string" or to == "function" then
+		return o
+	elseif to == "table" then
+		local i = 0
+		return function() i = i + 1; return o[i] end
+	elseif io_type(o) == "file" then
+		return function() return o:read(CHUNK_SIZE) end
+	elseif to == "userdata" and o.read then
+		return function()
+			local l = o:read()
+			if l then
+				return l.."\n"
 			end
-		else
-			t[i] = nil
 		end
 	end
-	return t
+	error ("Bad argument #1 to stream: expected a string, a table, a function or a file, but got "..to, 3)
 end
 
-local function clean (t) -- remove empty strings
-	for i = 1, #t do
-		local v = t[i]
-		local tv = type(v)
-		if tv == "table" then
-			clean (v)
-		elseif tv == "string" and v:match"^%s*$" then
-			t[i] = false
-		end
+-- iterates over the elements matching 'path', each one built on its own
+local function stream (o, path, opts)
+	local opts = opts or {}
+	local options = {
+		tree = "totable",
+		clean = opts.clean,
+		torecord = opts.torecord,
+		whitespace = opts.whitespace,
+		mergecdata = opts.mergecdata,
+		maxtext = opts.maxtext,
+		filter = path,
+	}
+	local source = chunks(o)
+	local p
+	if opts.threat then
+		p = require("lxp.threat").new({ threat = opts.threat }, opts.separator, options)
+	else
+		p = require("lxp").new({}, opts.separator, options)
 	end
-	return compact (t)
+	return p:trees(source)
 end
 
-local function torecord (t) -- move 1-value subtables to table entries
-	for i = 1, #t do
-		local v = t[i]
-		if type(v) == "table" then
-			if #v == 1 and type(v[1]) == "string" and t[v[0]] == nil then
-				t[v[0]] = v[1]
-				t[i] = false
-			else
-				torecord (v)
-			end
+-- serialization -------------------------------------------------------------
+-- the tree is written natively; 'opts' may set 'indent' and 'declaration'
+local function totext (tree, opts)
+	return require("lxp").tostring(tree, opts)
+end
+
+-- writes the tree to a file handle or to the file with the given name
+local function write (f, tree, opts)
+	if type(f) == "string" then
+		local fh = assert(io.open(f, "wb"))
+		local ok, err = pcall(require("lxp").write, fh, tree, opts)
+		fh:close()
+		if not ok then
+			error(err, 2)
 		end
+		return true
 	end
-	return compact (t)
+	require("lxp").write(f, tree, opts)
+	return true
 end
 
 return {
 	clean = clean,
 	compact = compact, -- TODO: internal only, should not be exported
 	parse = parse,
+	parsefile = parsefile,
+	stream = stream,
+	tostring = totext,
 	torecord = torecord,
+	write = write,
 }
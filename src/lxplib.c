@@ -6,8 +6,28 @@
 
 
 #include <assert.h>
+#include <errno.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#if !defined(LXP_NOTHREADS) && !defined(_WIN32)
+#define LXP_THREADS
+#include <pthread.h>
+#endif
+#ifdef _WIN32
+#include <io.h>
+#define lxp_read(fd, buff, n)	_read(fd, buff, (unsigned int)(n))
+#else
+#include <unistd.h>
+#define lxp_read(fd, buff, n)	read(fd, buff, (size_t)(n))
+#if !defined(LXP_NOMMAP)
+#define LXP_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#endif
 
 #include "expat_config.h"
 #include "expat.h"
@@ -17,6 +37,7 @@
 
 #include "lua.h"
 #include "lauxlib.h"
+#include "lualib.h"
 
 
 #include "lxplib.h"
@@ -25,6 +46,7 @@
 #define lua_getuservalue(L, i) lua_getfenv(L, i)
 #define lua_setuservalue(L, i) lua_setfenv(L, i)
 #define luaL_setfuncs(L, R, N) luaL_register(L, NULL, R)
+#define lua_rawlen(L, i) lua_objlen(L, i)
 #endif
 
 #if !defined(lua_pushliteral)
@@ -38,26 +60,584 @@ enum XPState {
   XPSok,   /* state while parsing */
   XPSfinished,  /* state after finished parsing */
   XPSerror,
+  XPSlimit,  /* a limit was breached; the parser is stopped */
   XPSstring  /* state while reading a string */
 };
 
+#define stopped(xpu)	((xpu)->state == XPSerror || (xpu)->state == XPSlimit)
+
+enum XPTree {
+  XPTnone,  /* events are delivered to the Lua callbacks */
+  XPTlom,   /* events build a LOM tree in C */
+  XPTtotable,  /* events build a 'totable' tree in C */
+  XPTcompact  /* events build a compact tree, kept in C */
+};
+
+/* attributes indexed by a tree builder ('index' option) */
+enum XPIndex {
+  XPInone,  /* no index */
+  XPInames,  /* the attributes with the names listed */
+  XPIall
+};
+
+/* events with a Lua callback; slots of the dispatch table */
+enum XPEvent {
+  XPEStartCdata = 1, XPEEndCdata, XPECharData, XPEComment, XPEDefault,
+  XPEDefaultExpand, XPEStartElement, XPEEndElement, XPEExternalEntity,
+  XPEStartNamespaceDecl, XPEEndNamespaceDecl, XPENotationDecl,
+  XPENotStandalone, XPEProcessingInstruction, XPEUnparsedEntityDecl,
+  XPEEntityDecl, XPEAttlistDecl, XPESkippedEntity, XPEStartDoctypeDecl,
+  XPEEndDoctypeDecl, XPEXmlDecl, XPEElementDecl, XPEBatch,
+  XPEn  /* number of events + 1 */
+};
+
+static const char *const eventkeys[] = {NULL,
+  StartCdataKey, EndCdataKey, CharDataKey, CommentKey, DefaultKey,
+  DefaultExpandKey, StartElementKey, EndElementKey, ExternalEntityKey,
+  StartNamespaceDeclKey, EndNamespaceDeclKey, NotationDeclKey,
+  NotStandaloneKey, ProcessingInstructionKey, UnparsedEntityDeclKey,
+  EntityDeclKey, AttlistDeclKey, SkippedEntityKey, StartDoctypeDeclKey,
+  EndDoctypeDeclKey, XmlDeclKey, ElementDeclKey, BatchKey};
+
+/* stack index of the resolved callbacks during a parse */
+#define DISPATCH	4
+
+/* stack index of the anchored cached names during a parse (or nil) */
+#define NAMES		5
+
+/* stack index of the open elements table during a parse (tree builders) */
+#define TREESTACK	6
+
+/* stack index of the pending events during a parse (batch mode) */
+#define BATCH		6
+
+/* stack index of the index of a table tree during a parse (or nil) */
+#define TREEINDEX	7
+
+/* default size of the chunks read by 'parser:parsefile' */
+#define PARSEFILE_CHUNK	65536
+
+/* longer names, and names beyond the first NAMECACHE_MAX, are not cached */
+#define NAMECACHE_LEN	64
+#define NAMECACHE_MAX	1024
+
+/*
+** An entry of the name cache, an open addressing hash table of element
+** and attribute names; the Lua string is kept in the NAMES table
+*/
+typedef struct lxp_name {
+  unsigned int hash;
+  int slot;  /* index in the NAMES table, 0 if the entry is empty */
+  size_t len;
+  char *str;
+} lxp_name;
+
+/*
+** Expat often hands the same name at the same address, so a name is
+** first looked up by address (and checked with 'strcmp', as the address
+** may since hold another name), which saves hashing it
+*/
+#define NAMEPTRS	64
+
+typedef struct lxp_nameptr {
+  const char *name;  /* address given by Expat */
+  const char *str;  /* cached copy */
+  int slot;
+} lxp_nameptr;
+
+/* limits checked by the parser itself (see 'lxp.threat') */
+enum XPLimit {
+  XPLdepth, XPLmaxChildren, XPLmaxAttributes, XPLmaxNamespaces,
+  XPLdocument, XPLbuffer, XPLcomment, XPLlocalName, XPLprefix,
+  XPLnamespaceUri, XPLattribute, XPLtext, XPLPITarget, XPLPIData,
+  XPLentityName, XPLentity, XPLentityProperty,
+  XPLn  /* number of limits */
+};
+
+static const char *const limitnames[] = {
+  "depth", "maxChildren", "maxAttributes", "maxNamespaces",
+  "document", "buffer", "comment", "localName", "prefix",
+  "namespaceUri", "attribute", "text", "PITarget", "PIData",
+  "entityName", "entity", "entityProperty", NULL};
+
+/*
+** Expat handlers set by a parser ('handlers'), registered again after a
+** reset. The first four may be set only to check the limits; their events
+** then go to 'Default' ('passdefault')
+*/
+#define XPHelement	(1 << 0)
+#define XPHchardata	(1 << 1)
+#define XPHcomment	(1 << 2)
+#define XPHpi		(1 << 3)
+#define XPHcdata	(1 << 4)
+#define XPHdefault	(1 << 5)
+#define XPHdefaultexp	(1 << 6)
+#define XPHexternal	(1 << 7)
+#define XPHnamespace	(1 << 8)
+#define XPHnotation	(1 << 9)
+#define XPHstandalone	(1 << 10)
+#define XPHunparsed	(1 << 11)
+#define XPHentity	(1 << 12)
+#define XPHattlist	(1 << 13)
+#define XPHskipped	(1 << 14)
+#define XPHstartdoctype	(1 << 15)
+#define XPHenddoctype	(1 << 16)
+#define XPHxmldecl	(1 << 17)
+#define XPHelementdecl	(1 << 18)
+
+/*
+** An entry in the stack of open elements; the first one is the document
+*/
+typedef struct lxp_level {
+  long children;  /* number of child nodes (limits) */
+  long text;  /* size of the current text node, -1 if none (limits) */
+  long namespaces;  /* namespaces declared for the next child (limits) */
+  int recorded;  /* whether a child became a field ('torecord') */
+} lxp_level;
+
+
+/*
+** Handlers of the document content; with a filter they are called by
+** the filter handlers instead of Expat
+*/
+typedef struct lxp_content {
+  XML_StartElementHandler start;
+  XML_EndElementHandler end;
+  XML_CharacterDataHandler text;
+  XML_CommentHandler comment;
+  XML_ProcessingInstructionHandler pi;
+  XML_StartCdataSectionHandler startcdata;
+  XML_EndCdataSectionHandler endcdata;
+} lxp_content;
+
+/* a step of a filter path, 'name' is NULL for '*' */
+typedef struct lxp_step {
+  const char *name;
+  size_t len;
+  int descendant;  /* preceded by '//' */
+} lxp_step;
+
+#define FILTER_MAXSTEPS	31  /* steps matched are bits of an 'unsigned long' */
+
+typedef struct lxp_path {
+  lxp_step steps[FILTER_MAXSTEPS];
+  int nsteps;
+  lxp_step attr;  /* attribute selected ('@name'), if 'isattr' */
+  int isattr;
+} lxp_path;
+
+/* what is delivered of an element */
+enum XPFilter {
+  XPFdrop,  /* nothing */
+  XPFattrs,  /* start and end, with the selected attributes only */
+  XPFall  /* the element and its content */
+};
+
+typedef struct lxp_filter {
+  lxp_path *paths;
+  int npaths;
+  char *strings;  /* names of the steps */
+  lxp_content h;  /* handlers of the events delivered */
+  unsigned long *masks;  /* steps matched, 'npaths' for each open element */
+  unsigned char *states;  /* what is delivered of each open element */
+  lxp_level *levels;  /* child nodes of each open element (limits) */
+  int size;  /* number of entries in 'masks', 'states', and 'levels' */
+  int depth;  /* number of open elements */
+  int inside;  /* depth of the element whose content is delivered, or 0 */
+  const char **attrs;  /* attributes selected for XPFattrs */
+  int nattrs;  /* size of 'attrs' */
+  int nspec;  /* specified attributes in 'attrs' (-1 if not in use) */
+} lxp_filter;
+
+/* what is done with the whitespace of text nodes */
+enum XPSpace {
+  XPWkeep,
+  XPWskip,  /* whitespace-only text nodes are dropped */
+  XPWtrim  /* leading and trailing whitespace is dropped */
+};
+
+typedef struct lxp_text {
+  lxp_content h;  /* handlers of the events delivered */
+  enum XPSpace space;
+  int mergecdata;  /* whether CDATA sections join the text around them */
+  size_t max;  /* bytes kept of a text node, 0 if not capped */
+  char *buf;  /* text of the current node */
+  size_t len;
+  size_t size;
+  size_t raw;  /* bytes of the current node given by Expat, 0 if none */
+  int blank;  /* whether 'buf' is whitespace-only */
+  int capped;  /* whether the current node was cut at 'max' */
+} lxp_text;
+
+/* events and time left to a parse call ('parser:parse' with a budget) */
+typedef struct lxp_budget {
+  lxp_content h;  /* handlers of the events delivered */
+  long events;  /* events left, 0 if not counted */
+  double deadline;  /* clock time to suspend at, 0 if none */
+  int tick;  /* events until the clock is read again */
+  int on;  /* whether the budget handlers are set */
+  int spent;  /* whether the parser was suspended by the budget */
+} lxp_budget;
+
+/* events between two readings of the clock */
+#define BUDGET_TICK	16
+
+#define budgeted(xpu)	((xpu)->budget.events > 0 || (xpu)->budget.deadline > 0)
+
+/* events of a recording; these codes are part of its format */
+enum XPRecord {
+  XPRend, XPRstart, XPRendelement, XPRtext, XPRcomment, XPRpi,
+  XPRstartcdata, XPRendcdata,
+  XPRn  /* number of codes */
+};
+
+#define RECORD_MAGIC	"LXPT"
+#define RECORD_VERSION	1
+#define RECORD_HEADER	6  /* magic, version, and separator */
+
+typedef struct lxp_recorder {
+  lxp_content h;  /* handlers of the events delivered */
+  char *buf;  /* the recording */
+  size_t len;
+  size_t size;
+  char *text;  /* character data not recorded yet */
+  size_t textlen;
+  size_t textsize;
+  lxp_name *names;  /* names recorded, by their ids ('slot') */
+  int namessize;
+  int nnames;
+  int failed;  /* whether memory ran out */
+  int ended;  /* whether XPRend was written */
+} lxp_recorder;
+
+/* kinds of the events of a block; these codes are part of its format */
+enum XPBEvent {
+  XPBstart = 1, XPBend, XPBtext, XPBcomment, XPBpi,
+  XPBattr  /* an attribute of the XPBstart event before it */
+};
+
+/* an event of a block ('parser:blocks'), as read by 'lxp.pull' */
+typedef struct lxp_event {
+  int type;  /* XPBstart... */
+  int n;  /* XPBstart: number of XPBattr events after it */
+  size_t s, len;  /* offset and length in the arena: name, text, target */
+  size_t v, vlen;  /* attribute value, PI data */
+} lxp_event;
+
+/* the events of 'parser:blocks' not handed out yet */
+typedef struct lxp_evblock {
+  lxp_event *events;
+  int n;  /* number of events */
+  int size;  /* size of 'events' */
+  int max;  /* events after which the parser is suspended */
+  char *arena;  /* strings of the events */
+  size_t len;
+  size_t arenasize;
+} lxp_evblock;
+
+
+/*
+** {======================================================
+** Memory accounting
+** Expat allocates through the functions below (XML_ParserCreate_MM).
+** Each block has a header with its size and owner, so that it can be
+** counted, and freed by the right allocator. Expat gives no context when
+** allocating, so new blocks belong to 'curmem', the memory of the parser
+** for which Expat was last called ('usememory').
+** =======================================================
+*/
+
+#if defined(_MSC_VER)
+#define LXP_THREAD	__declspec(thread)
+#elif defined(__GNUC__)
+#define LXP_THREAD	__thread
+#else
+#define LXP_THREAD	/* parsers used by a single thread */
+#endif
+
+/* size of the blocks of an arena */
+#define ARENA_BLOCK	16384
+
+typedef union lxp_memalign {  /* for blocks aligned as malloc's */
+  double d;
+  void *p;
+  long l;
+} lxp_memalign;
+
+/* a block of an arena, followed by its data */
+typedef union lxp_arena {
+  struct {
+    union lxp_arena *prev;
+    size_t size, used;
+  } a;
+  lxp_memalign align;
+} lxp_arena;
+
+typedef struct lxp_memory {
+  size_t current, peak;  /* bytes allocated by Expat */
+  size_t limit;  /* 0 if none */
+  int exceeded;  /* whether an allocation failed for the limit */
+  lua_Alloc allocf;  /* NULL for malloc */
+  void *ud;
+  int arena;  /* whether blocks are only freed when the parser is closed */
+  lxp_arena *blocks;
+} lxp_memory;
+
+typedef union lxp_memhdr {
+  struct {
+    lxp_memory *owner;  /* NULL if allocated with no parser */
+    size_t size;
+  } h;
+  lxp_memalign align;
+} lxp_memhdr;
+
+static LXP_THREAD lxp_memory *curmem = NULL;
+
+
+static void *rawalloc (lxp_memory *m, void *p, size_t osize, size_t nsize) {
+  if (m != NULL && m->allocf != NULL)
+    return m->allocf(m->ud, p, osize, nsize);
+  if (nsize == 0) {
+    free(p);
+    return NULL;
+  }
+  return realloc(p, nsize);
+}
+
+
+static int withinlimit (lxp_memory *m, size_t more) {
+  if (m == NULL || m->limit == 0 || m->current + more <= m->limit)
+    return 1;
+  m->exceeded = 1;
+  return 0;
+}
+
+
+/*
+** Take 'size' bytes from the arena; its blocks are counted as allocated
+** until they are all freed
+*/
+static void *arenaalloc (lxp_memory *m, size_t size) {
+  lxp_arena *a = m->blocks;
+  void *p;
+  size = (size + sizeof(lxp_memalign) - 1) & ~(sizeof(lxp_memalign) - 1);
+  if (a == NULL || a->a.size - a->a.used < size) {
+    size_t bsize = ARENA_BLOCK;
+    if (m->limit != 0 && m->current + sizeof(lxp_arena) + bsize > m->limit)
+      bsize = (m->limit > m->current + sizeof(lxp_arena))  /* what is left */
+            ? m->limit - m->current - sizeof(lxp_arena) : 0;
+    if (bsize < size)
+      bsize = size;
+    if (!withinlimit(m, sizeof(lxp_arena) + bsize))
+      return NULL;
+    a = (lxp_arena *)rawalloc(m, NULL, 0, sizeof(lxp_arena) + bsize);
+    if (a == NULL)
+      return NULL;
+    a->a.prev = m->blocks;
+    a->a.size = bsize;
+    a->a.used = 0;
+    m->blocks = a;
+    m->current += sizeof(lxp_arena) + bsize;
+    if (m->current > m->peak) m->peak = m->current;
+  }
+  p = (char *)(a + 1) + a->a.used;
+  a->a.used += size;
+  return p;
+}
+
+
+static void freearena (lxp_memory *m) {
+  while (m->blocks != NULL) {
+    lxp_arena *a = m->blocks;
+    m->blocks = a->a.prev;
+    m->current -= sizeof(lxp_arena) + a->a.size;
+    rawalloc(m, a, sizeof(lxp_arena) + a->a.size, 0);
+  }
+}
+
+
+static void *blockalloc (lxp_memory *m, size_t size) {
+  lxp_memhdr *h;
+  int arena = (m != NULL && m->arena);
+  if (!arena && !withinlimit(m, size))
+    return NULL;
+  if (arena)  /* counted by the arena */
+    h = (lxp_memhdr *)arenaalloc(m, sizeof(lxp_memhdr) + size);
+  else
+    h = (lxp_memhdr *)rawalloc(m, NULL, 0, sizeof(lxp_memhdr) + size);
+  if (h == NULL)
+    return NULL;
+  h->h.owner = m;
+  h->h.size = size;
+  if (m != NULL && !arena) {
+    m->current += size;
+    if (m->current > m->peak) m->peak = m->current;
+  }
+  return h + 1;
+}
+
+
+static void *mem_malloc (size_t size) {
+  return blockalloc(curmem, size);
+}
+
+
+static void mem_free (void *p) {
+  lxp_memhdr *h = (lxp_memhdr *)p - 1;
+  lxp_memory *m;
+  if (p == NULL)
+    return;
+  m = h->h.owner;
+  if (m != NULL && m->arena)
+    return;  /* freed with the whole arena */
+  if (m != NULL)
+    m->current -= h->h.size;
+  rawalloc(m, h, sizeof(lxp_memhdr) + h->h.size, 0);
+}
+
+
+static void *mem_realloc (void *p, size_t size) {
+  lxp_memhdr *h = (lxp_memhdr *)p - 1;
+  lxp_memory *m;
+  if (p == NULL)
+    return mem_malloc(size);
+  m = h->h.owner;
+  if (m != NULL && m->arena) {  /* blocks cannot grow in place */
+    void *np;
+    if (size <= h->h.size) {
+      h->h.size = size;
+      return p;
+    }
+    np = blockalloc(m, size);
+    if (np != NULL)
+      memcpy(np, p, h->h.size);
+    return np;
+  }
+  if (size > h->h.size && !withinlimit(m, size - h->h.size))
+    return NULL;
+  h = (lxp_memhdr *)rawalloc(m, h, sizeof(lxp_memhdr) + h->h.size,
+                                   sizeof(lxp_memhdr) + size);
+  if (h == NULL)
+    return NULL;
+  if (m != NULL) {
+    m->current = m->current - h->h.size + size;
+    if (m->current > m->peak) m->peak = m->current;
+  }
+  h->h.size = size;
+  return h + 1;
+}
+
+
+static const XML_Memory_Handling_Suite memsuite = {
+  mem_malloc, mem_realloc, mem_free
+};
+
+#define usememory(xpu)	(curmem = (xpu)->mem)
+/* }====================================================== */
+
+/*
+** Counters of 'parser:stats' (only allocated with the 'stats' option, so
+** the hot paths just test a NULL pointer)
+*/
+typedef struct lxp_stats {
+  unsigned long count[XPEn];  /* events delivered, by type */
+  unsigned long bytes[XPEn];  /* size of the strings delivered, by type */
+  unsigned long calls;  /* Lua callbacks called */
+  unsigned long flushes;  /* buffered character data delivered */
+  double input;  /* bytes given to Expat */
+  double parsetime;  /* seconds inside Expat, callbacks included */
+  double calltime;  /* seconds inside Lua callbacks */
+  enum XPEvent ev;  /* event of the callback being called */
+} lxp_stats;
+
+
+static double clocktime (void) {
+#if defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#else
+  return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
 struct lxp_userdata {
   lua_State *L;
   XML_Parser parser;  /* associated expat parser */
+  lxp_memory *mem;  /* memory used by Expat (a child uses its parent's) */
+  lxp_memory memory;
+  lxp_stats *stats;  /* NULL unless counting */
+  lxp_filter *filter;  /* NULL unless filtering */
+  lxp_text *text;  /* NULL unless text nodes are gathered in C */
+  lxp_recorder *record;  /* NULL unless recording */
+  lxp_evblock *block;  /* NULL unless iterating over blocks */
+  lxp_budget budget;  /* budget of the current parse call */
+  int protectparse;  /* one protected call per parse call ('protect') */
+  struct lxp_feeding *feeding;  /* Expat call of the current parse call */
   int errorref;  /* reference to error message if state is XPSerror */
   enum XPState state;
   luaL_Buffer *b;  /* to concatenate sequences of cdata pieces */
   int bufferCharData; /* whether to buffer cdata pieces */
+  int dispatchref;  /* reference to the callbacks resolved per event */
+  int namecache;  /* whether names are cached */
+  int splitnames;  /* hand out element names split at the separator */
+  lxp_name *names;  /* name cache (NULL until the first parse call) */
+  lxp_nameptr nameptrs[NAMEPTRS];
+  int namessize;  /* size of 'names' (a power of 2) */
+  int nnames;  /* number of cached names */
+  int namesref;  /* reference to the table of cached names */
+  unsigned long namehits, namemisses;
+  int proxyref;  /* reference to the attribute proxy, if enabled */
+  const char **proxyattrs;  /* attributes seen by the proxy, or NULL */
+  int proxyspec;  /* number of specified attributes in 'proxyattrs' */
+  int batch;  /* events per batch, 0 if not batching */
+  int batchn;  /* number of pending events */
+  int batchref;  /* reference to the table of pending events */
+  int pull;  /* whether events or trees are pulled by an iterator */
+  int pullpos;  /* number of pending events already pulled */
+  enum XPTree tree;  /* native tree builder, if any */
+  int treeref;  /* reference to the stack of open elements (tree builders) */
+  int treeclean;  /* drop whitespace-only text nodes from the tree */
+  int treerecord;  /* turn single text elements into fields ('totable') */
+  enum XPIndex treeindex;  /* attributes indexed by the tree builder */
+  int indexref;  /* reference to the names of the indexed attributes */
+  lxp_level *levels;  /* stack of open elements (tree builders and limits) */
+  int nlevels;  /* size of 'levels' */
+  int depth;  /* number of entries in the stack of open elements */
+  char sep;  /* namespace separator, '\0' if none */
+  int haslimits;  /* whether the limits below are checked */
+  int limitsref;  /* reference to the limits table, read on each parse */
+  long limits[XPLn];  /* -1 if not set */
+  int allowDTD;
+  int handlers;  /* Expat handlers to set (XPHelement...) */
+  int passdefault;  /* handlers set only for the limits */
+  long bytes;  /* size of the input so far */
+  const char *limiterr;  /* limit breached if state is XPSlimit */
+  lua_Integer limitpos[3];  /* line, column, and position of the breach */
 };
 
 typedef struct lxp_userdata lxp_userdata;
 
+/*
+** Whether 'setcontent' puts layers in front of the content callbacks (or
+** in place of them). A parser for an external entity inherits the Expat
+** handlers but not the layers, so it must then get the callbacks' own
+*/
+#define haslayers(xpu)	\
+  ((xpu)->tree != XPTnone || (xpu)->block != NULL || (xpu)->batch || \
+   (xpu)->record != NULL || (xpu)->text != NULL || \
+   (xpu)->filter != NULL || (xpu)->budget.on)
+
 
 static int reporterror (lxp_userdata *xpu) {
   lua_State *L = xpu->L;
   XML_Parser p = xpu->parser;
+  enum XML_Error code = XML_GetErrorCode(p);
   lua_pushnil(L);
-  lua_pushstring(L, XML_ErrorString(XML_GetErrorCode(p)));
+  if (code == XML_ERROR_NO_MEMORY && xpu->mem->exceeded)
+    lua_pushliteral(L, "memory limit exceeded");
+  else
+    lua_pushstring(L, XML_ErrorString(code));
   lua_pushinteger(L, XML_GetCurrentLineNumber(p));
   lua_pushinteger(L, XML_GetCurrentColumnNumber(p) + 1);
   lua_pushinteger(L, XML_GetCurrentByteIndex(p) + 1);
@@ -69,35 +649,243 @@ static lxp_userdata *createlxp (lua_State *L) {
   lxp_userdata *xpu = (lxp_userdata *)lua_newuserdata(L, sizeof(lxp_userdata));
   xpu->errorref = LUA_REFNIL;
   xpu->parser = NULL;
+  memset(&xpu->memory, 0, sizeof(lxp_memory));
+  xpu->mem = &xpu->memory;
+  xpu->stats = NULL;
+  xpu->filter = NULL;
+  xpu->text = NULL;
+  xpu->record = NULL;
+  xpu->block = NULL;
+  memset(&xpu->budget, 0, sizeof(lxp_budget));
+  xpu->protectparse = 0;
+  xpu->feeding = NULL;
   xpu->L = NULL;
   xpu->state = XPSpre;
+  xpu->dispatchref = LUA_REFNIL;
+  xpu->namecache = 0;
+  xpu->splitnames = 0;
+  xpu->names = NULL;
+  memset(xpu->nameptrs, 0, sizeof(xpu->nameptrs));
+  xpu->namessize = 0;
+  xpu->nnames = 0;
+  xpu->namesref = LUA_REFNIL;
+  xpu->namehits = xpu->namemisses = 0;
+  xpu->proxyref = LUA_REFNIL;
+  xpu->proxyattrs = NULL;
+  xpu->batch = xpu->batchn = 0;
+  xpu->batchref = LUA_REFNIL;
+  xpu->pull = xpu->pullpos = 0;
+  xpu->tree = XPTnone;
+  xpu->treeref = LUA_REFNIL;
+  xpu->treeclean = 0;
+  xpu->treerecord = 0;
+  xpu->treeindex = XPInone;
+  xpu->indexref = LUA_REFNIL;
+  xpu->levels = NULL;
+  xpu->nlevels = 0;
+  xpu->depth = 0;
+  xpu->sep = '\0';
+  xpu->haslimits = 0;
+  xpu->limitsref = LUA_REFNIL;
+  xpu->allowDTD = 1;
+  xpu->handlers = 0;
+  xpu->passdefault = 0;
+  xpu->bytes = 0;
+  xpu->limiterr = NULL;
   luaL_getmetatable(L, ParserType);
   lua_setmetatable(L, -2);
   return xpu;
 }
 
 
+static void freenames (lua_State *L, lxp_userdata *xpu) {
+  int i;
+  for (i = 0; i < xpu->namessize; i++)
+    free(xpu->names[i].str);
+  free(xpu->names);
+  xpu->names = NULL;
+  memset(xpu->nameptrs, 0, sizeof(xpu->nameptrs));
+  xpu->namessize = xpu->nnames = 0;
+  luaL_unref(L, LUA_REGISTRYINDEX, xpu->namesref);
+  xpu->namesref = LUA_REFNIL;
+}
+
+
+typedef struct lxp_attrproxy {
+  lxp_userdata *xpu;  /* NULL once the parser is closed */
+} lxp_attrproxy;
+
+
+static void freefilter (lxp_userdata *xpu) {
+  lxp_filter *f = xpu->filter;
+  if (f == NULL)
+    return;
+  free(f->paths);
+  free(f->strings);
+  free(f->masks);
+  free(f->states);
+  free(f->levels);
+  free(f->attrs);
+  free(f);
+  xpu->filter = NULL;
+}
+
+
+static void freetext (lxp_userdata *xpu) {
+  if (xpu->text == NULL)
+    return;
+  free(xpu->text->buf);
+  free(xpu->text);
+  xpu->text = NULL;
+}
+
+
+static void clearnames (lxp_name *names, int size) {
+  int i;
+  for (i = 0; i < size; i++) {
+    free(names[i].str);
+    names[i].str = NULL;
+    names[i].slot = 0;
+  }
+}
+
+
+static void freerecord (lxp_userdata *xpu) {
+  lxp_recorder *r = xpu->record;
+  if (r == NULL)
+    return;
+  clearnames(r->names, r->namessize);
+  free(r->names);
+  free(r->buf);
+  free(r->text);
+  free(r);
+  xpu->record = NULL;
+}
+
+
+static void freeblock (lxp_userdata *xpu) {
+  lxp_evblock *bk = xpu->block;
+  if (bk == NULL)
+    return;
+  free(bk->events);
+  free(bk->arena);
+  free(bk);
+  xpu->block = NULL;
+}
+
+
 static void lxpclose (lua_State *L, lxp_userdata *xpu) {
   luaL_unref(L, LUA_REGISTRYINDEX, xpu->errorref);
   xpu->errorref = LUA_REFNIL;
+  luaL_unref(L, LUA_REGISTRYINDEX, xpu->dispatchref);
+  xpu->dispatchref = LUA_REFNIL;
+  freenames(L, xpu);
+  if (xpu->proxyref != LUA_REFNIL) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, xpu->proxyref);
+    ((lxp_attrproxy *)lua_touserdata(L, -1))->xpu = NULL;
+    lua_pop(L, 1);
+    luaL_unref(L, LUA_REGISTRYINDEX, xpu->proxyref);
+    xpu->proxyref = LUA_REFNIL;
+  }
+  luaL_unref(L, LUA_REGISTRYINDEX, xpu->treeref);
+  xpu->treeref = LUA_REFNIL;
+  luaL_unref(L, LUA_REGISTRYINDEX, xpu->indexref);
+  xpu->indexref = LUA_REFNIL;
+  luaL_unref(L, LUA_REGISTRYINDEX, xpu->batchref);
+  xpu->batchref = LUA_REFNIL;
+  luaL_unref(L, LUA_REGISTRYINDEX, xpu->limitsref);
+  xpu->limitsref = LUA_REFNIL;
+  free(xpu->levels);
+  xpu->levels = NULL;
+  xpu->nlevels = 0;
   if (xpu->parser)
     XML_ParserFree(xpu->parser);
   xpu->parser = NULL;
+  freearena(&xpu->memory);
+  free(xpu->stats);
+  xpu->stats = NULL;
+  freefilter(xpu);
+  freetext(xpu);
+  freerecord(xpu);
+  freeblock(xpu);
 }
 
 
 
 
+/*
+** Add the sizes of the strings among the top 'n' values to the bytes
+** delivered for event 'ev'
+*/
+static void statbytes (lxp_userdata *xpu, enum XPEvent ev, int n) {
+  int i;
+  for (i = 1; i <= n; i++) {
+    if (lua_type(xpu->L, -i) == LUA_TSTRING)
+      xpu->stats->bytes[ev] += (unsigned long)lua_rawlen(xpu->L, -i);
+  }
+}
+
+
+/*
+** Call a Lua handle: protected, or, when the whole parse call is
+** protected ('protect' option), unprotected, as its errors are caught
+** by 'parse_aux'
+*/
+static int callhandle (lxp_userdata *xpu, int nargs, int nres) {
+  if (xpu->protectparse) {
+    lua_call(xpu->L, nargs + 1, nres);
+    return 0;
+  }
+  return lua_pcall(xpu->L, nargs + 1, nres, 0);
+}
+
+
+static int timedcall (lxp_userdata *xpu, int nargs, int nres) {
+  lxp_stats *st = xpu->stats;
+  double t;
+  int status;
+  statbytes(xpu, st->ev, nargs);
+  st->calls++;
+  t = clocktime();
+  status = callhandle(xpu, nargs, nres);
+  st->calltime += clocktime() - t;
+  return status;
+}
+
+
 /*
 ** Auxiliary function to call a Lua handle
 */
 static void docall (lxp_userdata *xpu, int nargs, int nres) {
   lua_State *L = xpu->L;
+  int status;
   assert(xpu->state == XPSok);
-  if (lua_pcall(L, nargs + 1, nres, 0) != 0) {
+  if (xpu->stats != NULL)
+    status = timedcall(xpu, nargs, nres);
+  else
+    status = callhandle(xpu, nargs, nres);
+  if (status != 0) {
     xpu->state = XPSerror;
     xpu->errorref = luaL_ref(L, LUA_REGISTRYINDEX);  /* error message */
   }
+  usememory(xpu);  /* the callback may have used other parsers */
+}
+
+
+static void addtreetext (lxp_userdata *xpu);
+static void addbatchtext (lxp_userdata *xpu);
+static void flushbatch (lxp_userdata *xpu);
+static void flushtext (lxp_userdata *xpu);
+
+/* any event ends the text node being gathered */
+#define endtext(xpu)	\
+  { if ((xpu)->text != NULL && (xpu)->text->raw > 0) flushtext(xpu); }
+
+
+static int suspended (lxp_userdata *xpu) {
+  XML_ParsingStatus ps;
+  XML_GetParsingStatus(xpu->parser, &ps);
+  return ps.parsing == XML_SUSPENDED;
 }
 
 
@@ -108,7 +896,13 @@ static void dischargestring (lxp_userdata *xpu) {
   assert(xpu->state == XPSstring);
   xpu->state = XPSok;
   luaL_pushresult(xpu->b);
-  docall(xpu, 1, 0);
+  if (xpu->stats != NULL) xpu->stats->flushes++;
+  if (xpu->tree != XPTnone)
+    addtreetext(xpu);
+  else if (xpu->batch)
+    addbatchtext(xpu);
+  else
+    docall(xpu, 1, 0);
 }
 
 
@@ -116,19 +910,30 @@ static void dischargestring (lxp_userdata *xpu) {
 ** Check whether there is a Lua handle for a given event: If so,
 ** put it on the stack (to be called later), and also push `self'
 */
-static int getHandle (lxp_userdata *xpu, const char *handle) {
+static int getHandle (lxp_userdata *xpu, enum XPEvent ev) {
   lua_State *L = xpu->L;
+  endtext(xpu);
   if (xpu->state == XPSstring) dischargestring(xpu);
-  if (xpu->state == XPSerror)
+  if (stopped(xpu))
     return 0;  /* some error happened before; skip all handles */
-  lua_pushstring(L, handle);
-  lua_gettable(L, 3);
+  lua_rawgeti(L, DISPATCH, ev);
   if (lua_toboolean(L, -1) == 0) {
     lua_pop(L, 1);
     return 0;
   }
   if (!lua_isfunction(L, -1)) {
-    luaL_error(L, "lxp '%s' callback is not a function", handle);
+    luaL_error(L, "lxp '%s' callback is not a function", eventkeys[ev]);
+  }
+  if (xpu->batchn > 0 && !xpu->pull) {  /* keep events in order */
+    flushbatch(xpu);
+    if (stopped(xpu)) {
+      lua_pop(L, 1);
+      return 0;
+    }
+  }
+  if (xpu->stats != NULL) {
+    xpu->stats->count[ev]++;
+    xpu->stats->ev = ev;
   }
   lua_pushvalue(L, 1);  /* first argument in every call (self) */
   return 1;
@@ -138,627 +943,6272 @@ static int getHandle (lxp_userdata *xpu, const char *handle) {
 
 /*
 ** {======================================================
-** Handles
+** Name cache
+** Documents use a small set of element and attribute names over and
+** over; each one is turned into a Lua string only once per parser.
 ** =======================================================
 */
 
 
-static void f_StartCdata (void *ud) {
-  lxp_userdata *xpu = (lxp_userdata *)ud;
-  if (getHandle(xpu, StartCdataKey) == 0) return;  /* no handle */
-  docall(xpu, 0, 0);
+static void initnames (lua_State *L, lxp_userdata *xpu) {
+  xpu->names = (lxp_name *)calloc(64, sizeof(lxp_name));
+  if (xpu->names == NULL)
+    luaL_error(L, "not enough memory");
+  xpu->namessize = 64;
+  lua_createtable(L, 64, 0);
+  xpu->namesref = luaL_ref(L, LUA_REGISTRYINDEX);
 }
 
 
-static void f_EndCdataKey (void *ud) {
-  lxp_userdata *xpu = (lxp_userdata *)ud;
-  if (getHandle(xpu, EndCdataKey) == 0) return;  /* no handle */
-  docall(xpu, 0, 0);
+static lxp_name *findname (lxp_name *names, int size, unsigned int h,
+                           const char *name, size_t len) {
+  int i = (int)(h & (unsigned int)(size - 1));
+  while (names[i].slot != 0 &&
+         (names[i].hash != h || names[i].len != len ||
+          memcmp(names[i].str, name, len) != 0))
+    i = (i + 1) & (size - 1);
+  return &names[i];
 }
 
 
-static void f_CharData (void *ud, const char *s, int len) {
-  lxp_userdata *xpu = (lxp_userdata *)ud;
-  if (xpu->state == XPSok) {
-    if (getHandle(xpu, CharDataKey) == 0) return;  /* no handle */
-    if(xpu->bufferCharData != 0) {
-      xpu->state = XPSstring;
-      luaL_buffinit(xpu->L, xpu->b);
-    } else {
-      lua_pushlstring(xpu->L, s, len);
-      docall(xpu, 1, 0);
-    }
+/*
+** Double the size of a hash table of names; if that fails the name
+** cache simply stays full
+*/
+static int grownames (lxp_name **pnames, int *psize) {
+  int size = *psize * 2;
+  int i;
+  lxp_name *names = (lxp_name *)calloc(size, sizeof(lxp_name));
+  if (names == NULL)
+    return 0;
+  for (i = 0; i < *psize; i++) {
+    lxp_name *e = &(*pnames)[i];
+    if (e->slot != 0)
+      *findname(names, size, e->hash, e->str, e->len) = *e;
   }
-  if (xpu->state == XPSstring)
-    luaL_addlstring(xpu->b, s, len);
+  free(*pnames);
+  *pnames = names;
+  *psize = size;
+  return 1;
 }
 
 
-static void f_Comment (void *ud, const char *data) {
-  lxp_userdata *xpu = (lxp_userdata *)ud;
-  if (getHandle(xpu, CommentKey) == 0) return;  /* no handle */
-  lua_pushstring(xpu->L, data);
-  docall(xpu, 1, 0);
+/*
+** Push the 'len' bytes at 'name' (hashed to 'h') through the hash table
+** of the cache, and remember them in 'p' for their address (if given)
+*/
+static void cachename (lxp_userdata *xpu, const char *name, size_t len,
+                       unsigned int h, lxp_nameptr *p) {
+  lua_State *L = xpu->L;
+  lxp_name *e = findname(xpu->names, xpu->namessize, h, name, len);
+  if (e->slot != 0) {
+    xpu->namehits++;
+    lua_rawgeti(L, NAMES, e->slot);
+  }
+  else {
+    xpu->namemisses++;
+    lua_pushlstring(L, name, len);
+    if (xpu->nnames >= NAMECACHE_MAX ||
+        (e->str = (char *)malloc(len + 1)) == NULL)
+      return;
+    memcpy(e->str, name, len);
+    e->str[len] = '\0';
+    e->hash = h;
+    e->len = len;
+    e->slot = ++xpu->nnames;
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, NAMES, e->slot);
+  }
+  if (p != NULL) {
+    p->name = name;
+    p->str = e->str;
+    p->slot = e->slot;
+  }
+  if (xpu->nnames * 4 >= xpu->namessize * 3)
+    grownames(&xpu->names, &xpu->namessize);
 }
 
 
-static void f_Default (void *ud, const char *data, int len) {
-  lxp_userdata *xpu = (lxp_userdata *)ud;
-  if (getHandle(xpu, DefaultKey) == 0) return;  /* no handle */
-  lua_pushlstring(xpu->L, data, len);
-  docall(xpu, 1, 0);
+/*
+** Push a name, through the cache if it is enabled
+*/
+static void pushname (lxp_userdata *xpu, const char *name) {
+  lua_State *L = xpu->L;
+  unsigned int h = 2166136261u;  /* FNV-1a */
+  size_t len;
+  lxp_nameptr *p;
+  if (xpu->names == NULL) {
+    lua_pushstring(L, name);
+    return;
+  }
+  p = &xpu->nameptrs[((size_t)name >> 3) & (NAMEPTRS - 1)];
+  if (p->name == name && strcmp(p->str, name) == 0) {
+    xpu->namehits++;
+    lua_rawgeti(L, NAMES, p->slot);
+    return;
+  }
+  for (len = 0; name[len] != '\0' && len <= NAMECACHE_LEN; len++)
+    h = (h ^ (unsigned char)name[len]) * 16777619u;
+  if (len > NAMECACHE_LEN) {  /* too long to be cached */
+    xpu->namemisses++;
+    lua_pushstring(L, name);
+    return;
+  }
+  cachename(xpu, name, len, h, p);
 }
 
 
-static void f_DefaultExpand (void *ud, const char *data, int len) {
-  lxp_userdata *xpu = (lxp_userdata *)ud;
-  if (getHandle(xpu, DefaultExpandKey) == 0) return;  /* no handle */
-  lua_pushlstring(xpu->L, data, len);
-  docall(xpu, 1, 0);
+/*
+** Push a part of a namespaced name (a URI, a local name or a prefix),
+** through the cache if it is enabled. URIs are long, but few and
+** repeated, so parts are cached whatever their size
+*/
+static void pushpart (lxp_userdata *xpu, const char *s, size_t len) {
+  unsigned int h = 2166136261u;
+  size_t i;
+  if (xpu->names == NULL) {
+    lua_pushlstring(xpu->L, s, len);
+    return;
+  }
+  for (i = 0; i < len; i++)
+    h = (h ^ (unsigned char)s[i]) * 16777619u;
+  cachename(xpu, s, len, h, NULL);
 }
 
 
-static void f_StartElement (void *ud, const char *name, const char **attrs) {
-  lxp_userdata *xpu = (lxp_userdata *)ud;
-  lua_State *L = xpu->L;
-  int lastspec = XML_GetSpecifiedAttributeCount(xpu->parser) / 2;
-  int i = 1;
-  if (getHandle(xpu, StartElementKey) == 0) return;  /* no handle */
-  lua_pushstring(L, name);
-  lua_newtable(L);
-  while (*attrs) {
-    if (i <= lastspec) {
-      lua_pushinteger(L, i++);
-      lua_pushstring(L, *attrs);
-      lua_settable(L, -3);
+/*
+** With 'splitnames', push the local name of 'name' (given by Expat as
+** 'uri<sep>localname', with '<sep>prefix' if it returns triplets, or
+** as 'localname' without a namespace)
+*/
+static void pushlocalname (lxp_userdata *xpu, const char *name) {
+  const char *local = strchr(name, xpu->sep);
+  const char *end;
+  if (local == NULL) {
+    pushname(xpu, name);
+    return;
+  }
+  local++;
+  end = strchr(local, xpu->sep);
+  pushpart(xpu, local, (end != NULL) ? (size_t)(end - local) : strlen(local));
+}
+
+
+/*
+** ...and push its URI and prefix (nil if missing)
+*/
+static void pushnamespace (lxp_userdata *xpu, const char *name) {
+  const char *local = strchr(name, xpu->sep);
+  const char *prefix;
+  if (local == NULL) {
+    lua_pushnil(xpu->L);
+    lua_pushnil(xpu->L);
+    return;
+  }
+  pushpart(xpu, name, (size_t)(local - name));
+  prefix = strchr(local + 1, xpu->sep);
+  if (prefix != NULL)
+    pushpart(xpu, prefix + 1, strlen(prefix + 1));
+  else
+    lua_pushnil(xpu->L);
+}
+/* }====================================================== */
+
+
+
+/*
+** Give an event without callback to the Default handler, as Expat would
+** have done if its handler had not been set just to check the limits
+*/
+static void passdefault (lxp_userdata *xpu, int handler) {
+  if ((xpu->passdefault & handler) && !stopped(xpu))
+    XML_DefaultCurrent(xpu->parser);
+}
+
+
+
+/*
+** {======================================================
+** Limits
+** Checks return 0 after stopping the parser when a limit is breached,
+** the error is reported by 'parse_aux'.
+** =======================================================
+*/
+
+
+static int reportlimit (lxp_userdata *xpu) {
+  lua_State *L = xpu->L;
+  lua_pushnil(L);
+  lua_pushstring(L, xpu->limiterr);
+  lua_pushinteger(L, xpu->limitpos[0]);
+  lua_pushinteger(L, xpu->limitpos[1]);
+  lua_pushinteger(L, xpu->limitpos[2]);
+  return 5;
+}
+
+
+static int breach (lxp_userdata *xpu, const char *msg) {
+  XML_Parser p = xpu->parser;
+  if (xpu->state == XPSstring) {  /* drop pending text */
+    luaL_pushresult(xpu->b);
+    lua_pop(xpu->L, 1);
+  }
+  xpu->state = XPSlimit;
+  xpu->limiterr = msg;
+  xpu->limitpos[0] = XML_GetCurrentLineNumber(p);
+  xpu->limitpos[1] = XML_GetCurrentColumnNumber(p) + 1;
+  xpu->limitpos[2] = XML_GetCurrentByteIndex(p) + 1;
+  XML_StopParser(p, XML_FALSE);
+  return 0;
+}
+
+
+static int overlimit (lxp_userdata *xpu, enum XPLimit l, long size) {
+  return xpu->limits[l] >= 0 && size > xpu->limits[l];
+}
+
+
+/*
+** Flush pending text and tell whether events must still be processed
+*/
+static int ready (lxp_userdata *xpu) {
+  if (xpu->state == XPSstring) dischargestring(xpu);
+  return !stopped(xpu);
+}
+
+
+static void resetlevels (lxp_userdata *xpu) {
+  xpu->depth = 1;
+  memset(&xpu->levels[1], 0, sizeof(lxp_level));
+  xpu->levels[1].text = -1;
+}
+
+
+static void initlevels (lua_State *L, lxp_userdata *xpu) {
+  xpu->levels = (lxp_level *)malloc(16 * sizeof(lxp_level));
+  if (xpu->levels == NULL)
+    luaL_error(L, "not enough memory");
+  xpu->nlevels = 16;
+  resetlevels(xpu);
+}
+
+
+static void pushlevel (lxp_userdata *xpu) {
+  lxp_level *lv;
+  if (xpu->depth + 1 >= xpu->nlevels) {
+    int size = xpu->nlevels * 2;
+    lv = (lxp_level *)realloc(xpu->levels, size * sizeof(lxp_level));
+    if (lv == NULL)
+      luaL_error(xpu->L, "not enough memory");
+    xpu->levels = lv;
+    xpu->nlevels = size;
+  }
+  lv = &xpu->levels[++xpu->depth];
+  lv->children = 0;
+  lv->text = -1;
+  lv->namespaces = 0;
+  lv->recorded = 0;
+}
+
+
+/*
+** Count a new child node of the element at level 'lv', which ends its
+** text node
+*/
+static int countchild (lxp_userdata *xpu, lxp_level *lv) {
+  lv->text = -1;
+  if (overlimit(xpu, XPLmaxChildren, ++lv->children))
+    return breach(xpu, "too many children");
+  return 1;
+}
+
+
+static int addchild (lxp_userdata *xpu) {
+  return countchild(xpu, &xpu->levels[xpu->depth]);
+}
+
+
+/*
+** Size of a name without its namespace URI ('uri<sep>localname')
+*/
+static size_t localnamelen (lxp_userdata *xpu, const char *name) {
+  const char *sep;
+  if (xpu->sep != '\0' && (sep = strchr(name, xpu->sep)) != NULL)
+    return strlen(sep + 1);
+  return strlen(name);
+}
+
+
+/*
+** Sizes of the local name and prefix of a DTD name ('prefix:localname')
+*/
+static size_t qnamelen (const char *name, size_t *prefix) {
+  const char *colon = strchr(name, ':');
+  *prefix = (colon == NULL) ? 0 : (size_t)(colon - name);
+  return (colon == NULL) ? strlen(name) : strlen(colon + 1);
+}
+
+
+/*
+** Check the names and values of an element and its attributes
+*/
+static int checknames (lxp_userdata *xpu, const char *name,
+                                          const char **attrs) {
+  int i;
+  if (overlimit(xpu, XPLlocalName, localnamelen(xpu, name)))
+    return breach(xpu, xpu->sep ? "element localName too long"
+                                : "element name too long");
+  for (i = 0; attrs[i]; i += 2) {
+    if (overlimit(xpu, XPLlocalName, localnamelen(xpu, attrs[i])))
+      return breach(xpu, xpu->sep ? "attribute localName too long"
+                                  : "attribute name too long");
+    if (overlimit(xpu, XPLattribute, strlen(attrs[i + 1])))
+      return breach(xpu, "attribute value too long");
+  }
+  if (overlimit(xpu, XPLmaxAttributes, i / 2))
+    return breach(xpu, "too many attributes");
+  return 1;
+}
+
+
+static int checkstart (lxp_userdata *xpu, const char *name,
+                                          const char **attrs) {
+  if (!addchild(xpu))
+    return 0;
+  if (overlimit(xpu, XPLdepth, xpu->depth))
+    return breach(xpu, "structure is too deep");
+  if (!checknames(xpu, name, attrs))
+    return 0;
+  xpu->levels[xpu->depth].namespaces = 0;  /* counted per element */
+  return 1;
+}
+
+
+/*
+** Check the limits for a new element and open its level
+*/
+static int enterelement (lxp_userdata *xpu, const char *name,
+                                            const char **attrs) {
+  if (!ready(xpu))
+    return 0;
+  if (xpu->haslimits && !checkstart(xpu, name, attrs))
+    return 0;
+  pushlevel(xpu);
+  return 1;
+}
+
+
+/*
+** Adjacent text and CDATA pieces make a single text node
+*/
+static int counttext (lxp_userdata *xpu, lxp_level *lv, int len) {
+  if (lv->text < 0) {
+    lv->text = 0;
+    if (overlimit(xpu, XPLmaxChildren, ++lv->children))
+      return breach(xpu, "too many children");
+  }
+  lv->text += len;
+  if (overlimit(xpu, XPLtext, lv->text))
+    return breach(xpu, "text/CDATA node(s) too long");
+  return 1;
+}
+
+
+static int checktext (lxp_userdata *xpu, int len) {
+  if (stopped(xpu))
+    return 0;
+  return counttext(xpu, &xpu->levels[xpu->depth], len);
+}
+
+
+static int countcomment (lxp_userdata *xpu, lxp_level *lv, const char *data) {
+  if (overlimit(xpu, XPLcomment, strlen(data)))
+    return breach(xpu, "comment too long");
+  return countchild(xpu, lv);
+}
+
+
+static int checkcomment (lxp_userdata *xpu, const char *data) {
+  if (!ready(xpu))
+    return 0;
+  return countcomment(xpu, &xpu->levels[xpu->depth], data);
+}
+
+
+static int countpi (lxp_userdata *xpu, lxp_level *lv, const char *target,
+                                                      const char *data) {
+  if (overlimit(xpu, XPLPITarget, strlen(target)))
+    return breach(xpu, "processing instruction target too long");
+  if (overlimit(xpu, XPLPIData, strlen(data)))
+    return breach(xpu, "processing instruction data too long");
+  return countchild(xpu, lv);
+}
+
+
+static int checkpi (lxp_userdata *xpu, const char *target, const char *data) {
+  if (!ready(xpu))
+    return 0;
+  return countpi(xpu, &xpu->levels[xpu->depth], target, data);
+}
+
+
+static int checknamespace (lxp_userdata *xpu, const char *prefix,
+                                              const char *uri) {
+  if (!ready(xpu))
+    return 0;
+  if (overlimit(xpu, XPLmaxNamespaces, ++xpu->levels[xpu->depth].namespaces))
+    return breach(xpu, "too many namespaces");
+  if (prefix && overlimit(xpu, XPLprefix, strlen(prefix)))
+    return breach(xpu, "prefix too long");
+  if (uri && overlimit(xpu, XPLnamespaceUri, strlen(uri)))
+    return breach(xpu, "namespaceUri too long");
+  return 1;
+}
+
+
+static int checkentitydecl (lxp_userdata *xpu, const char *entityName,
+                            const char *value, int value_length,
+                            const char *systemId, const char *publicId,
+                            const char *notationName) {
+  if (!ready(xpu))
+    return 0;
+  if (overlimit(xpu, XPLentityName, strlen(entityName)))
+    return breach(xpu, "entityName too long");
+  if (value && overlimit(xpu, XPLentity, value_length))
+    return breach(xpu, "entity value too long");
+  if (systemId && overlimit(xpu, XPLentityProperty, strlen(systemId)))
+    return breach(xpu, "systemId too long");
+  if (publicId && overlimit(xpu, XPLentityProperty, strlen(publicId)))
+    return breach(xpu, "publicId too long");
+  if (notationName && overlimit(xpu, XPLentityProperty, strlen(notationName)))
+    return breach(xpu, "notationName too long");
+  return 1;
+}
+
+
+static int checkattlist (lxp_userdata *xpu, const char *elName,
+                         const char *attName, const char *dflt) {
+  if (!ready(xpu))
+    return 0;
+  if (xpu->sep) {
+    size_t eprefix, aprefix;
+    size_t elocal = qnamelen(elName, &eprefix);
+    size_t alocal = qnamelen(attName, &aprefix);
+    if (overlimit(xpu, XPLlocalName, elocal))
+      return breach(xpu, "element localName too long");
+    if (overlimit(xpu, XPLlocalName, alocal))
+      return breach(xpu, "attribute localName too long");
+    if (overlimit(xpu, XPLprefix, eprefix))
+      return breach(xpu, "element prefix too long");
+    if (overlimit(xpu, XPLprefix, aprefix))
+      return breach(xpu, "attribute prefix too long");
+  }
+  else {
+    if (overlimit(xpu, XPLlocalName, strlen(elName)))
+      return breach(xpu, "elementName too long");
+    if (overlimit(xpu, XPLlocalName, strlen(attName)))
+      return breach(xpu, "attributeName too long");
+  }
+  if (dflt && overlimit(xpu, XPLattribute, strlen(dflt)))
+    return breach(xpu, "attribute default too long");
+  return 1;
+}
+
+
+static int checkdeclname (lxp_userdata *xpu, const char *name) {
+  if (xpu->sep) {
+    size_t prefix;
+    if (overlimit(xpu, XPLlocalName, qnamelen(name, &prefix)))
+      return breach(xpu, "elementDecl localName too long");
+    if (overlimit(xpu, XPLprefix, prefix))
+      return breach(xpu, "elementDecl prefix too long");
+  }
+  else if (overlimit(xpu, XPLlocalName, strlen(name)))
+    return breach(xpu, "elementDecl name too long");
+  return 1;
+}
+
+
+static int checkcontent (lxp_userdata *xpu, XML_Content *model) {
+  unsigned int i;
+  if (model->name && !checkdeclname(xpu, model->name))
+    return 0;
+  for (i = 0; i < model->numchildren; i++)
+    if (!checkcontent(xpu, &model->children[i]))
+      return 0;
+  return 1;
+}
+
+
+static int checkelementdecl (lxp_userdata *xpu, const char *name,
+                                                XML_Content *model) {
+  if (!ready(xpu))
+    return 0;
+  if (name && !checkdeclname(xpu, name))
+    return 0;
+  return checkcontent(xpu, model);
+}
+
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Handles
+** =======================================================
+*/
+
+
+static void f_StartCdata (void *ud) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  if (getHandle(xpu, XPEStartCdata) == 0) return;  /* no handle */
+  docall(xpu, 0, 0);
+}
+
+
+static void f_EndCdataKey (void *ud) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  if (getHandle(xpu, XPEEndCdata) == 0) return;  /* no handle */
+  docall(xpu, 0, 0);
+}
+
+
+static void f_CharData (void *ud, const char *s, int len) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  if (xpu->haslimits && !checktext(xpu, len)) return;
+  if (xpu->state == XPSok) {
+    if (getHandle(xpu, XPECharData) == 0) {  /* no handle */
+      passdefault(xpu, XPHchardata);
+      return;
+    }
+    if(xpu->bufferCharData != 0) {
+      xpu->state = XPSstring;
+      luaL_buffinit(xpu->L, xpu->b);
+    } else {
+      lua_pushlstring(xpu->L, s, len);
+      docall(xpu, 1, 0);
+    }
+  }
+  if (xpu->state == XPSstring)
+    luaL_addlstring(xpu->b, s, len);
+}
+
+
+static void f_Comment (void *ud, const char *data) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  if (xpu->haslimits && !checkcomment(xpu, data)) return;
+  if (getHandle(xpu, XPEComment) == 0) {  /* no handle */
+    passdefault(xpu, XPHcomment);
+    return;
+  }
+  lua_pushstring(xpu->L, data);
+  docall(xpu, 1, 0);
+}
+
+
+static void f_Default (void *ud, const char *data, int len) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  if (getHandle(xpu, XPEDefault) == 0) return;  /* no handle */
+  lua_pushlstring(xpu->L, data, len);
+  docall(xpu, 1, 0);
+}
+
+
+static void f_DefaultExpand (void *ud, const char *data, int len) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  if (getHandle(xpu, XPEDefaultExpand) == 0) return;  /* no handle */
+  lua_pushlstring(xpu->L, data, len);
+  docall(xpu, 1, 0);
+}
+
+
+/*
+** Number of specified attributes (names and values) of the current
+** element, which a filter may have reduced to the selected ones
+*/
+static int specifiedcount (lxp_userdata *xpu) {
+  if (xpu->filter != NULL && xpu->filter->nspec >= 0)
+    return xpu->filter->nspec * 2;
+  return XML_GetSpecifiedAttributeCount(xpu->parser);
+}
+
+
+/*
+** Push the attributes table of an element: every attribute by name, and
+** the specified ones (not the defaulted ones) also by position
+*/
+static void pushattributes (lxp_userdata *xpu, const char **attrs) {
+  lua_State *L = xpu->L;
+  int lastspec = specifiedcount(xpu) / 2;
+  int nattrs = 0;
+  int i = 1;
+  while (attrs[nattrs * 2]) nattrs++;
+  lua_createtable(L, lastspec, nattrs);
+  while (*attrs) {
+    pushname(xpu, *attrs++);
+    if (i <= lastspec) {
+      lua_pushvalue(L, -1);
+      lua_rawseti(L, -3, i++);
     }
     lua_pushstring(L, *attrs++);
-    lua_pushstring(L, *attrs++);
-    lua_settable(L, -3);
+    lua_rawset(L, -3);
+  }
+}
+
+
+/*
+** {======================================================
+** Attribute proxy
+** With the 'attributes = "proxy"' option, StartElement callbacks get a
+** proxy instead of a table of attributes; Lua strings are only created
+** for the attributes read. The same proxy is used for every element and
+** is only valid during the callback.
+** =======================================================
+*/
+
+
+static const char **checkproxy (lua_State *L) {
+  lxp_attrproxy *ap = (lxp_attrproxy *)luaL_checkudata(L, 1, AttributesType);
+  if (ap->xpu == NULL || ap->xpu->proxyattrs == NULL)
+    luaL_error(L, "attribute proxy used outside its StartElement callback");
+  return ap->xpu->proxyattrs;
+}
+
+
+/*
+** proxy[i] is the name of the i-th specified attribute, and proxy[name]
+** is the value of an attribute
+*/
+static int proxy_index (lua_State *L) {
+  const char **attrs = checkproxy(L);
+  int i;
+  if (lua_type(L, 2) == LUA_TNUMBER) {
+    lxp_attrproxy *ap = (lxp_attrproxy *)lua_touserdata(L, 1);
+    i = (int)lua_tointeger(L, 2);
+    if (i >= 1 && i <= ap->xpu->proxyspec && (lua_Number)i == lua_tonumber(L, 2))
+      lua_pushstring(L, attrs[(i - 1) * 2]);
+    else
+      lua_pushnil(L);
+    return 1;
   }
-  docall(xpu, 2, 0);  /* call function with self, name, and attributes */
+  else if (lua_type(L, 2) == LUA_TSTRING) {
+    const char *name = lua_tostring(L, 2);
+    for (i = 0; attrs[i]; i += 2) {
+      if (strcmp(attrs[i], name) == 0) {
+        lua_pushstring(L, attrs[i + 1]);
+        return 1;
+      }
+    }
+  }
+  lua_pushnil(L);
+  return 1;
 }
 
 
-static void f_EndElement (void *ud, const char *name) {
-  lxp_userdata *xpu = (lxp_userdata *)ud;
-  if (getHandle(xpu, EndElementKey) == 0) return;  /* no handle */
-  lua_pushstring(xpu->L, name);
-  docall(xpu, 1, 0);
+static int proxy_len (lua_State *L) {
+  checkproxy(L);
+  lua_pushinteger(L, ((lxp_attrproxy *)lua_touserdata(L, 1))->xpu->proxyspec);
+  return 1;
+}
+
+
+static int proxy_next (lua_State *L) {
+  const char **attrs = checkproxy(L);
+  int i = (int)lua_tointeger(L, lua_upvalueindex(1));
+  if (attrs[i] == NULL)
+    return 0;
+  lua_pushinteger(L, i + 2);
+  lua_replace(L, lua_upvalueindex(1));
+  lua_pushstring(L, attrs[i]);
+  lua_pushstring(L, attrs[i + 1]);
+  return 2;
+}
+
+
+/*
+** Iterate over the name-value pairs (Lua 5.2 and newer)
+*/
+static int proxy_pairs (lua_State *L) {
+  checkproxy(L);
+  lua_pushinteger(L, 0);
+  lua_pushcclosure(L, proxy_next, 1);
+  lua_pushvalue(L, 1);
+  lua_pushnil(L);
+  return 3;
+}
+
+
+static int proxy_tostring (lua_State *L) {
+  lua_pushfstring(L, "%s (%p)", AttributesType, lua_touserdata(L, 1));
+  return 1;
+}
+
+
+static void createproxy (lua_State *L, lxp_userdata *xpu) {
+  lxp_attrproxy *ap = (lxp_attrproxy *)lua_newuserdata(L, sizeof(lxp_attrproxy));
+  ap->xpu = xpu;
+  luaL_getmetatable(L, AttributesType);
+  lua_setmetatable(L, -2);
+  xpu->proxyref = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+
+static const struct luaL_Reg proxy_meths[] = {
+  {"__index", proxy_index},
+  {"__len", proxy_len},
+  {"__pairs", proxy_pairs},
+  {"__tostring", proxy_tostring},
+  {NULL, NULL}
+};
+/* }====================================================== */
+
+
+static void f_StartElement (void *ud, const char *name, const char **attrs) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  if (xpu->levels && !enterelement(xpu, name, attrs)) return;
+  if (getHandle(xpu, XPEStartElement) == 0) {  /* no handle */
+    passdefault(xpu, XPHelement);
+    return;
+  }
+  if (xpu->splitnames)
+    pushlocalname(xpu, name);
+  else
+    pushname(xpu, name);
+  if (xpu->proxyref != LUA_REFNIL) {
+    lua_rawgeti(xpu->L, LUA_REGISTRYINDEX, xpu->proxyref);
+    xpu->proxyattrs = attrs;
+    xpu->proxyspec = specifiedcount(xpu) / 2;
+  }
+  else
+    pushattributes(xpu, attrs);
+  if (xpu->splitnames) {
+    pushnamespace(xpu, name);
+    docall(xpu, 4, 0);  /* self, local name, attributes, URI, and prefix */
+  }
+  else
+    docall(xpu, 2, 0);  /* call function with self, name, and attributes */
+  xpu->proxyattrs = NULL;
+}
+
+
+static void f_EndElement (void *ud, const char *name) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  if (xpu->levels) {
+    if (!ready(xpu)) return;
+    xpu->depth--;
+  }
+  if (getHandle(xpu, XPEEndElement) == 0) {  /* no handle */
+    passdefault(xpu, XPHelement);
+    return;
+  }
+  if (xpu->splitnames) {
+    pushlocalname(xpu, name);
+    pushnamespace(xpu, name);
+    docall(xpu, 3, 0);
+  }
+  else {
+    pushname(xpu, name);
+    docall(xpu, 1, 0);
+  }
+}
+
+
+static void f_ProcessingInstruction (void *ud, const char *target,
+                                               const char *data);
+
+
+/*
+** The content handlers of the callbacks, without any layer
+*/
+static void basecontent (lxp_userdata *xpu, lxp_content *c) {
+  int h = xpu->handlers;
+  c->start = (h & XPHelement) ? f_StartElement : NULL;
+  c->end = (h & XPHelement) ? f_EndElement : NULL;
+  c->text = (h & XPHchardata) ? f_CharData : NULL;
+  c->comment = (h & XPHcomment) ? f_Comment : NULL;
+  c->pi = (h & XPHpi) ? f_ProcessingInstruction : NULL;
+  c->startcdata = (h & XPHcdata) ? f_StartCdata : NULL;
+  c->endcdata = (h & XPHcdata) ? f_EndCdataKey : NULL;
+}
+
+
+static void applycontent (XML_Parser p, const lxp_content *c) {
+  XML_SetElementHandler(p, c->start, c->end);
+  XML_SetCharacterDataHandler(p, c->text);
+  XML_SetCommentHandler(p, c->comment);
+  XML_SetProcessingInstructionHandler(p, c->pi);
+  XML_SetCdataSectionHandler(p, c->startcdata, c->endcdata);
+}
+
+
+static int f_ExternaEntity (XML_Parser p, const char *context,
+                                          const char *base,
+                                          const char *systemId,
+                                          const char *publicId) {
+  lxp_userdata *xpu = (lxp_userdata *)XML_GetUserData(p);
+  lua_State *L = xpu->L;
+  lxp_userdata *child;
+  int status;
+  if (getHandle(xpu, XPEExternalEntity) == 0) return 1;  /* no handle */
+  child = createlxp(L);
+  child->mem = xpu->mem;
+  usememory(xpu);
+  child->parser = XML_ExternalEntityParserCreate(p, context, NULL);
+  if (!child->parser)
+    luaL_error(L, "XML_ParserCreate failed");
+  /* Expat gives the child our handlers and user data; it needs its own
+     state, as it is parsed with its own stack */
+  XML_SetUserData(child->parser, child);
+  child->bufferCharData = xpu->bufferCharData;
+  child->namecache = xpu->namecache;
+  child->splitnames = xpu->splitnames;
+  child->protectparse = xpu->protectparse;
+  child->sep = xpu->sep;
+  if (haslayers(xpu)) {  /* the layers are for the main document only */
+    lxp_content c;
+    basecontent(xpu, &c);
+    applycontent(child->parser, &c);
+  }
+  lua_getuservalue(L, 1);
+  lua_setuservalue(L, -2); /* child uses the same table of its father */
+  lua_pushstring(L, base);
+  lua_pushstring(L, systemId);
+  lua_pushstring(L, publicId);
+  docall(xpu, 4, 1);
+  status = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+  lxpclose(L, child);
+  return status;
+}
+
+
+static void f_StartNamespaceDecl (void *ud, const char *prefix,
+                                            const char *uri) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  lua_State *L = xpu->L;
+  if (xpu->haslimits && !checknamespace(xpu, prefix, uri)) return;
+  if (getHandle(xpu, XPEStartNamespaceDecl) == 0) return;  /* no handle */
+  if (xpu->splitnames) {  /* the URI and prefix as in element names */
+    if (prefix != NULL) pushpart(xpu, prefix, strlen(prefix));
+    else lua_pushnil(L);
+    if (uri != NULL) pushpart(xpu, uri, strlen(uri));
+    else lua_pushnil(L);
+  }
+  else {
+    lua_pushstring(L, prefix);
+    lua_pushstring(L, uri);
+  }
+  docall(xpu, 2, 0);
+}
+
+
+static void f_EndNamespaceDecl (void *ud, const char *prefix) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  if (getHandle(xpu, XPEEndNamespaceDecl) == 0) return;  /* no handle */
+  lua_pushstring(xpu->L, prefix);
+  docall(xpu, 1, 0);
+}
+
+
+static void f_NotationDecl (void *ud, const char *notationName,
+                                      const char *base,
+                                      const char *systemId,
+                                      const char *publicId) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  lua_State *L = xpu->L;
+  if (getHandle(xpu, XPENotationDecl) == 0) return;  /* no handle */
+  lua_pushstring(L, notationName);
+  lua_pushstring(L, base);
+  lua_pushstring(L, systemId);
+  lua_pushstring(L, publicId);
+  docall(xpu, 4, 0);
+}
+
+
+static int f_NotStandalone (void *ud) {
+  int status;
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  lua_State *L = xpu->L;
+  if (getHandle(xpu, XPENotStandalone) == 0) return 1;  /* no handle */
+  docall(xpu, 0, 1);
+  status = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+  return status;
+}
+
+
+static void f_ProcessingInstruction (void *ud, const char *target,
+                                               const char *data) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  lua_State *L = xpu->L;
+  if (xpu->haslimits && !checkpi(xpu, target, data)) return;
+  if (getHandle(xpu, XPEProcessingInstruction) == 0) {  /* no handle */
+    passdefault(xpu, XPHpi);
+    return;
+  }
+  lua_pushstring(L, target);
+  lua_pushstring(L, data);
+  docall(xpu, 2, 0);
+}
+
+
+static void f_UnparsedEntityDecl (void *ud, const char *entityName,
+                                            const char *base,
+                                            const char *systemId,
+                                            const char *publicId,
+                                            const char *notationName) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  lua_State *L = xpu->L;
+  if (getHandle(xpu, XPEUnparsedEntityDecl) == 0) return;  /* no handle */
+  lua_pushstring(L, entityName);
+  lua_pushstring(L, base);
+  lua_pushstring(L, systemId);
+  lua_pushstring(L, publicId);
+  lua_pushstring(L, notationName);
+  docall(xpu, 5, 0);
+}
+
+static void f_EntityDecl (void *ud, const char *entityName,
+                                    int is_parameter_entity,
+                                    const char *value,
+                                    int value_length,
+                                    const char *base,
+                                    const char *systemId,
+                                    const char *publicId,
+                                    const char *notationName) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  lua_State *L = xpu->L;
+  if (xpu->haslimits && !checkentitydecl(xpu, entityName, value, value_length,
+                                         systemId, publicId, notationName))
+    return;
+  if (getHandle(xpu, XPEEntityDecl) == 0) return;  /* no handle */
+  lua_pushstring(L, entityName);
+  lua_pushboolean(L, is_parameter_entity);
+  if (value == NULL) {
+    lua_pushnil(L);
+  } else {
+    lua_pushlstring(L, value, value_length);
+  }
+  lua_pushstring(L, base);
+  lua_pushstring(L, systemId);
+  lua_pushstring(L, publicId);
+  lua_pushstring(L, notationName);
+  docall(xpu, 7, 0);
+}
+
+static void PushElementDeclType(lua_State *L, XML_Content *model) {
+  switch(model->type) {
+    case XML_CTYPE_EMPTY:
+      lua_pushliteral(L, "EMPTY");
+      return;
+    case XML_CTYPE_ANY:
+      lua_pushliteral(L, "ANY");
+      return;
+    case XML_CTYPE_MIXED:
+      lua_pushliteral(L, "MIXED");
+      return;
+    case XML_CTYPE_NAME:
+      lua_pushliteral(L, "NAME");
+      return;
+    case XML_CTYPE_CHOICE:
+      lua_pushliteral(L, "CHOICE");
+      return;
+    case XML_CTYPE_SEQ:
+      lua_pushliteral(L, "SEQUENCE");
+      return;
+    default:
+      /* safe guard, should not happen */
+      lua_pushliteral(L, "unknown");
+      return;
+  }
+}
+
+static int PushElementDeclQuant(lua_State *L, XML_Content *model) {
+  switch(model->quant) {
+    case XML_CQUANT_NONE:
+      return 0;
+    case XML_CQUANT_OPT:
+      lua_pushliteral(L, "?");
+      return 1;
+    case XML_CQUANT_REP:
+      lua_pushliteral(L, "*");
+      return 1;
+    case XML_CQUANT_PLUS:
+      lua_pushliteral(L, "+");
+      return 1;
+    default:
+      /* safe guard, should not happen */
+      lua_pushliteral(L, "unknown");
+      return 1;
+  }
+}
+
+static void PushElementDeclChildren(lua_State *L, XML_Content *model) {
+  lua_checkstack(L, 4);
+  int i;
+  XML_Content *child;
+  for (i = 0; i < model->numchildren; i++) {
+    child = model->children+i;
+    lua_newtable(L);
+    PushElementDeclType(L, child);
+    lua_setfield(L, -2, "type");
+    if (PushElementDeclQuant(L, child) != 0) {
+      lua_setfield(L, -2, "quantifier");
+    }
+    if (child->name != NULL) {
+      lua_pushstring(L, child->name);
+      lua_setfield(L, -2, "name");
+    }
+    if (child->numchildren > 0 ) {
+      lua_newtable(L);
+      PushElementDeclChildren(L, child);
+      lua_setfield(L, -2, "children");
+    }
+
+    lua_rawseti(L, -2, i+1);
+  }
+}
+
+static void f_ElementDecl (void *ud, const char *name, XML_Content *model) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  lua_State *L = xpu->L;
+  if ((xpu->haslimits && !checkelementdecl(xpu, name, model)) ||
+      getHandle(xpu, XPEElementDecl) == 0) {   /* no handle */
+    XML_FreeContentModel(xpu->parser, model);
+    return;
+  }
+  lua_pushstring(L, name);
+  PushElementDeclType(L, model);
+  if (PushElementDeclQuant(L, model) == 0) {
+    lua_pushnil(L);
+  }
+  if (model->numchildren == 0) {
+    XML_FreeContentModel(xpu->parser, model);
+    docall(xpu, 3, 0);
+  } else {
+    lua_newtable(L);
+    PushElementDeclChildren(L, model);
+    XML_FreeContentModel(xpu->parser, model);
+    docall(xpu, 4, 0);
+  }
+}
+
+static void f_AttlistDecl (void *ud, const char *elName,
+                                     const char *attName,
+                                     const char *attType,
+                                     const char *dflt,
+                                     int isRequired) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  lua_State *L = xpu->L;
+  if (xpu->haslimits && !checkattlist(xpu, elName, attName, dflt)) return;
+  if (getHandle(xpu, XPEAttlistDecl) == 0) return;  /* no handle */
+  lua_pushstring(L, elName);
+  lua_pushstring(L, attName);
+  lua_pushstring(L, attType);
+  lua_pushstring(L, dflt);
+  lua_pushboolean(L, isRequired);
+  docall(xpu, 5, 0);
+}
+
+static void f_SkippedEntity (void *ud, const char *entityName,
+                                       int isParameter) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  lua_State *L = xpu->L;
+  if (getHandle(xpu, XPESkippedEntity) == 0) return;  /* no handle */
+  lua_pushstring(L, entityName);
+  lua_pushboolean(L, isParameter);
+  docall(xpu, 2, 0);
+}
+
+static void f_StartDoctypeDecl (void *ud, const XML_Char *doctypeName,
+                                          const XML_Char *sysid,
+                                          const XML_Char *pubid,
+                                          int has_internal_subset) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  if (xpu->haslimits && !xpu->allowDTD) {
+    if (ready(xpu)) breach(xpu, "DTD is not allowed");
+    return;
+  }
+  if (getHandle(xpu, XPEStartDoctypeDecl) == 0) return;  /* no handle */
+  lua_pushstring(xpu->L, doctypeName);
+  lua_pushstring(xpu->L, sysid);
+  lua_pushstring(xpu->L, pubid);
+  lua_pushboolean(xpu->L, has_internal_subset);
+  docall(xpu, 4, 0);
+}
+
+static void f_EndDoctypeDecl (void *ud) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  if (getHandle(xpu, XPEEndDoctypeDecl) == 0) return;  /* no handle */
+  docall(xpu, 0, 0);
+}
+
+static void f_XmlDecl (void *ud, const XML_Char *version,
+                                 const XML_Char *encoding,
+                                 int standalone) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  if (getHandle(xpu, XPEXmlDecl) == 0) return;  /* no handle */
+  lua_pushstring(xpu->L, version);
+  lua_pushstring(xpu->L, encoding);
+  if (standalone >= 0) {
+    lua_pushboolean(xpu->L, standalone);
+    docall(xpu, 3, 0);
+  } else {
+    docall(xpu, 2, 0);
+  }
+}
+/* }====================================================== */
+
+
+
+
+
+/*
+** {======================================================
+** Compact trees
+** With 'tree = "compact"' the tree is kept in C, in the arrays of a
+** document (a userdata at TREESTACK during a parse). Elements are
+** numbered in document order, so the descendants of an element follow
+** it; element 0 holds the top-level elements. Strings are kept in a
+** pool, where names are interned. Lua sees elements through proxies
+** (NodeType) made on first access and cached weakly by the document,
+** which read like LOM elements. With the 'index' option the elements of
+** each name are chained, and attribute values are kept in a hash table.
+** =======================================================
+*/
+
+typedef unsigned int lxp_ref;  /* index or pool offset in a document */
+
+#define DOM_MAX	((lxp_ref)0x7FFFFFFF)  /* bound for counts and offsets */
+
+typedef struct lxp_delem {
+  lxp_ref name;  /* pool offset of the interned name */
+  lxp_ref parent;
+  lxp_ref last;  /* last descendant (itself if none) */
+  lxp_ref children;  /* first child in 'children' */
+  lxp_ref nchildren;
+  lxp_ref attrs;  /* first name in 'attrs' */
+  lxp_ref nattrs;
+  lxp_ref nspec;  /* specified attributes, which come first */
+} lxp_delem;
+
+/* a child is an element or a text (pool offset), told by the low bit */
+#define elemchild(i)	((i) << 1)
+#define textchild(off)	(((off) << 1) | 1)
+#define istext(c)	((c) & 1)
+#define childref(c)	((c) >> 1)
+
+typedef struct lxp_dom {
+  char *pool;  /* strings: a 4-byte length, the bytes, and a '\0' */
+  size_t poollen;
+  size_t poolsize;
+  lxp_delem *elems;
+  lxp_ref nelems, elemsize;
+  lxp_ref *attrs;  /* pool offsets of the names and values */
+  lxp_ref nattrs, attrssize;
+  lxp_ref *children;
+  lxp_ref nchildren, childrensize;
+  lxp_ref *names;  /* hash table of the interned names (offset + 1) */
+  lxp_ref nnames, namessize;
+  lxp_ref *pending;  /* children of the open elements */
+  lxp_ref npending, pendingsize;
+  lxp_ref *open;  /* open elements: index and first pending child */
+  lxp_ref nopen, opensize;
+  int textopen;  /* whether the last pending child is a text still open */
+  lxp_ref *sametag;  /* next element with the same name (index) */
+  lxp_ref sametagsize;
+  lxp_ref *byattr;  /* hash table of attributes: element and position */
+  lxp_ref nbyattr, byattrsize;
+  enum XPIndex indexed;  /* for 'XPInames', see 'lxp_dname' */
+} lxp_dom;
+
+/* head of an interned name, right before it in the pool */
+typedef struct lxp_dname {
+  lxp_ref first;  /* first and last elements with the name (index) */
+  lxp_ref last;
+  lxp_ref indexed;  /* whether attributes with the name are indexed */
+} lxp_dname;
+
+#define dname(d, off)	((lxp_dname *)((d)->pool + (off)) - 1)
+
+/* a proxy; its uservalue is the one of its document */
+typedef struct lxp_node {
+  lxp_dom *dom;
+  lxp_ref index;
+} lxp_node;
+
+/* slots of the uservalue of a document */
+#define DOM_CACHE	1  /* proxies by element (weak) */
+#define DOM_SELF	2  /* the document, kept alive by its proxies */
+
+
+/*
+** Room for 'need' entries of 'esize' bytes in the array 'a' of 'size'
+*/
+static void *domreserve (lua_State *L, void *a, lxp_ref *size, lxp_ref need,
+                         size_t esize) {
+  lxp_ref n = *size;
+  void *na;
+  if (need <= n)
+    return a;
+  if (need > DOM_MAX)
+    luaL_error(L, "document too large for a compact tree");
+  while (n < need) n = (n > 0) ? n * 2 : 16;
+  if (n > DOM_MAX) n = DOM_MAX;
+  na = realloc(a, (size_t)n * esize);
+  if (na == NULL)
+    luaL_error(L, "not enough memory");
+  *size = n;
+  return na;
+}
+
+#define domgrow(L, d, f, n)	\
+  ((d)->f = (lxp_ref *)domreserve(L, (d)->f, &(d)->f##size, (n), sizeof(lxp_ref)))
+
+
+static void poolreserve (lua_State *L, lxp_dom *d, size_t n) {
+  if (n > (size_t)DOM_MAX - d->poollen)
+    luaL_error(L, "document too large for a compact tree");
+  if (n > d->poolsize - d->poollen) {
+    size_t size = d->poolsize ? d->poolsize : 4096;
+    char *pool;
+    while (size - d->poollen < n) size *= 2;
+    pool = (char *)realloc(d->pool, size);
+    if (pool == NULL)
+      luaL_error(L, "not enough memory");
+    d->pool = pool;
+    d->poolsize = size;
+  }
+}
+
+
+#define poolstr(d, off)	((d)->pool + (off) + 4)
+
+static size_t poolsize (lxp_dom *d, lxp_ref off) {
+  unsigned int n;
+  memcpy(&n, d->pool + off, 4);
+  return n;
+}
+
+
+static lxp_ref poolstring (lua_State *L, lxp_dom *d, const char *s,
+                           size_t len) {
+  lxp_ref off;
+  unsigned int n = (unsigned int)len;
+  poolreserve(L, d, len + 5);
+  off = (lxp_ref)d->poollen;
+  memcpy(d->pool + off, &n, 4);
+  memcpy(d->pool + off + 4, s, len);
+  d->pool[off + 4 + len] = '\0';
+  d->poollen += len + 5;
+  return off;
+}
+
+
+static void pushpooled (lua_State *L, lxp_dom *d, lxp_ref off) {
+  lua_pushlstring(L, poolstr(d, off), poolsize(d, off));
+}
+
+
+static unsigned int hashname (const char *name, size_t len) {
+  unsigned int h = 2166136261u;  /* FNV-1a, as the name cache */
+  while (len--)
+    h = (h ^ (unsigned char)*name++) * 16777619u;
+  return h;
+}
+
+
+static lxp_ref *findinterned (lxp_dom *d, const char *name, size_t len) {
+  lxp_ref mask = d->namessize - 1;
+  lxp_ref i = hashname(name, len) & mask;
+  while (d->names[i] != 0) {
+    lxp_ref off = d->names[i] - 1;
+    if (poolsize(d, off) == len && memcmp(poolstr(d, off), name, len) == 0)
+      break;
+    i = (i + 1) & mask;
+  }
+  return &d->names[i];
+}
+
+
+static void rehashnames (lua_State *L, lxp_dom *d) {
+  lxp_ref *old = d->names;
+  lxp_ref oldsize = d->namessize;
+  lxp_ref i;
+  d->names = (lxp_ref *)calloc((size_t)oldsize * 2, sizeof(lxp_ref));
+  if (d->names == NULL) {
+    d->names = old;
+    luaL_error(L, "not enough memory");
+  }
+  d->namessize = oldsize * 2;
+  for (i = 0; i < oldsize; i++) {
+    if (old[i] != 0) {
+      lxp_ref off = old[i] - 1;
+      *findinterned(d, poolstr(d, off), poolsize(d, off)) = old[i];
+    }
+  }
+  free(old);
+}
+
+
+/*
+** Interned names are aligned, after their head
+*/
+static lxp_ref intern (lua_State *L, lxp_dom *d, const char *name) {
+  size_t len = strlen(name);
+  lxp_ref *e = findinterned(d, name, len);
+  if (*e == 0) {
+    size_t pad = (sizeof(lxp_ref) - d->poollen % sizeof(lxp_ref)) %
+                 sizeof(lxp_ref);
+    if ((d->nnames + 1) * 4 >= d->namessize * 3) {
+      rehashnames(L, d);
+      e = findinterned(d, name, len);
+    }
+    poolreserve(L, d, pad + sizeof(lxp_dname));
+    d->poollen += pad;
+    memset(d->pool + d->poollen, 0, sizeof(lxp_dname));
+    d->poollen += sizeof(lxp_dname);
+    *e = poolstring(L, d, name, len) + 1;
+    d->nnames++;
+  }
+  return *e - 1;
+}
+
+
+static int dom_gc (lua_State *L) {
+  lxp_dom *d = (lxp_dom *)luaL_checkudata(L, 1, DocumentType);
+  free(d->pool);
+  free(d->elems);
+  free(d->attrs);
+  free(d->children);
+  free(d->names);
+  free(d->pending);
+  free(d->open);
+  free(d->sametag);
+  free(d->byattr);
+  memset(d, 0, sizeof(lxp_dom));
+  return 0;
+}
+
+
+/*
+** Hash table of the indexed attributes, by name and value; an entry is
+** an element (0 if free) and the position of the attribute in 'attrs'
+*/
+static lxp_ref *findattr (lxp_dom *d, lxp_ref name, const char *value,
+                          size_t len) {
+  lxp_ref mask = d->byattrsize - 1;
+  lxp_ref i = (hashname(value, len) ^ (name * 2654435761u)) & mask;
+  while (d->byattr[i * 2] != 0) {
+    lxp_ref pos = d->byattr[i * 2 + 1];
+    lxp_ref v = d->attrs[pos + 1];
+    if (d->attrs[pos] == name && poolsize(d, v) == len &&
+        memcmp(poolstr(d, v), value, len) == 0)
+      break;
+    i = (i + 1) & mask;
+  }
+  return &d->byattr[i * 2];
+}
+
+
+static void rehashattrs (lua_State *L, lxp_dom *d) {
+  lxp_ref *old = d->byattr;
+  lxp_ref oldsize = d->byattrsize;
+  lxp_ref size = oldsize ? oldsize * 2 : 64;
+  lxp_ref i;
+  if (size > DOM_MAX / 2)
+    luaL_error(L, "document too large for a compact tree");
+  d->byattr = (lxp_ref *)calloc((size_t)size * 2, sizeof(lxp_ref));
+  if (d->byattr == NULL) {
+    d->byattr = old;
+    luaL_error(L, "not enough memory");
+  }
+  d->byattrsize = size;
+  for (i = 0; i < oldsize; i++) {
+    if (old[i * 2] != 0) {
+      lxp_ref v = d->attrs[old[i * 2 + 1] + 1];
+      lxp_ref *e = findattr(d, d->attrs[old[i * 2 + 1]], poolstr(d, v),
+                            poolsize(d, v));
+      e[0] = old[i * 2];
+      e[1] = old[i * 2 + 1];
+    }
+  }
+  free(old);
+}
+
+
+/*
+** Index element 'i': chain it after the last element with its name, and
+** enter its indexed attributes, unless an earlier element has the same
+** value for them
+*/
+static void indexelem (lua_State *L, lxp_dom *d, lxp_ref i) {
+  lxp_delem *e = &d->elems[i];
+  lxp_dname *n = dname(d, e->name);
+  lxp_ref k;
+  domgrow(L, d, sametag, d->nelems);
+  d->sametag[i] = 0;
+  if (n->first == 0)
+    n->first = i;
+  else
+    d->sametag[n->last] = i;
+  n->last = i;
+  for (k = e->attrs; k < e->attrs + e->nattrs * 2; k += 2) {
+    lxp_ref v = d->attrs[k + 1];
+    lxp_ref *entry;
+    if (d->indexed == XPInames && !dname(d, d->attrs[k])->indexed)
+      continue;
+    if ((d->nbyattr + 1) * 4 >= d->byattrsize * 3)
+      rehashattrs(L, d);
+    entry = findattr(d, d->attrs[k], poolstr(d, v), poolsize(d, v));
+    if (entry[0] == 0) {
+      entry[0] = i;
+      entry[1] = k;
+      d->nbyattr++;
+    }
+  }
+}
+
+
+/*
+** Set up the index of a new document, marking the names of the indexed
+** attributes
+*/
+static void newdomindex (lua_State *L, lxp_dom *d, lxp_userdata *xpu) {
+  d->indexed = xpu->treeindex;
+  if (xpu->treeindex == XPInames) {
+    int i, n;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, xpu->indexref);
+    n = (int)lua_rawlen(L, -1);
+    for (i = 1; i <= n; i++) {
+      lxp_ref name;
+      lua_rawgeti(L, -1, i);
+      name = intern(L, d, lua_tostring(L, -1));  /* may move the pool */
+      dname(d, name)->indexed = 1;
+      lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+  }
+  rehashattrs(L, d);
+}
+
+
+/*
+** Push a new document, with its element 0 open
+*/
+static lxp_dom *newdom (lua_State *L, lxp_userdata *xpu) {
+  lxp_dom *d = (lxp_dom *)lua_newuserdata(L, sizeof(lxp_dom));
+  memset(d, 0, sizeof(lxp_dom));
+  luaL_getmetatable(L, DocumentType);
+  lua_setmetatable(L, -2);
+  lua_createtable(L, 2, 0);
+  lua_newtable(L);  /* proxy cache */
+  lua_createtable(L, 0, 1);
+  lua_pushliteral(L, "v");
+  lua_setfield(L, -2, "__mode");
+  lua_setmetatable(L, -2);
+  lua_rawseti(L, -2, DOM_CACHE);
+  lua_pushvalue(L, -2);
+  lua_rawseti(L, -2, DOM_SELF);
+  lua_setuservalue(L, -2);
+  d->names = (lxp_ref *)calloc(64, sizeof(lxp_ref));
+  if (d->names == NULL)
+    luaL_error(L, "not enough memory");
+  d->namessize = 64;
+  d->elems = (lxp_delem *)domreserve(L, d->elems, &d->elemsize, 1,
+                                     sizeof(lxp_delem));
+  memset(&d->elems[0], 0, sizeof(lxp_delem));
+  d->nelems = 1;
+  domgrow(L, d, open, 2);
+  d->open[0] = d->open[1] = 0;
+  d->nopen = 1;
+  if (xpu->treeindex != XPInone)
+    newdomindex(L, d, xpu);
+  return d;
+}
+
+
+#define todom(xpu)	((lxp_dom *)lua_touserdata((xpu)->L, TREESTACK))
+
+
+/*
+** Drop the last pending child if it is a whitespace-only text node
+** ('clean' option)
+*/
+static void dropblank (lxp_dom *d) {
+  lxp_ref mark = d->open[d->nopen * 2 - 1];
+  lxp_ref c, off;
+  const char *s;
+  size_t len;
+  if (d->npending == mark || !istext(c = d->pending[d->npending - 1]))
+    return;
+  off = childref(c);
+  s = poolstr(d, off);
+  for (len = poolsize(d, off); len > 0; len--, s++) {
+    switch (*s) {
+      case ' ': case '\t': case '\n': case '\r': case '\v': case '\f':
+        break;
+      default:
+        return;
+    }
+  }
+  d->npending--;
+  if (off + poolsize(d, off) + 5 == d->poollen)
+    d->poollen = off;  /* it was the last string */
+}
+
+
+static void compact_StartElement (void *ud, const char *name,
+                                            const char **attrs) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  lua_State *L = xpu->L;
+  lxp_dom *d;
+  lxp_delem *e;
+  lxp_ref i, nattrs;
+  if (!enterelement(xpu, name, attrs)) return;
+  if (xpu->stats != NULL) {
+    xpu->stats->count[XPEStartElement]++;
+    xpu->stats->bytes[XPEStartElement] += (unsigned long)strlen(name);
+  }
+  d = todom(xpu);
+  if (xpu->treeclean) dropblank(d);
+  d->textopen = 0;
+  for (nattrs = 0; attrs[nattrs * 2] != NULL; nattrs++) ;
+  d->elems = (lxp_delem *)domreserve(L, d->elems, &d->elemsize,
+                                     d->nelems + 1, sizeof(lxp_delem));
+  domgrow(L, d, attrs, d->nattrs + nattrs * 2);
+  domgrow(L, d, pending, d->npending + 1);
+  domgrow(L, d, open, d->nopen * 2 + 2);
+  i = d->nelems++;
+  e = &d->elems[i];
+  e->name = intern(L, d, name);
+  e->parent = d->open[d->nopen * 2 - 2];
+  e->last = i;
+  e->children = e->nchildren = 0;
+  e->attrs = d->nattrs;
+  e->nattrs = nattrs;
+  e->nspec = (lxp_ref)specifiedcount(xpu) / 2;
+  for (; *attrs; attrs += 2) {
+    d->attrs[d->nattrs++] = intern(L, d, attrs[0]);
+    d->attrs[d->nattrs++] = poolstring(L, d, attrs[1], strlen(attrs[1]));
+  }
+  if (d->indexed != XPInone)
+    indexelem(L, d, i);
+  d->pending[d->npending++] = elemchild(i);
+  d->open[d->nopen * 2] = i;
+  d->open[d->nopen * 2 + 1] = d->npending;
+  d->nopen++;
+}
+
+
+/*
+** Move the children of the closed element to their final place
+*/
+static void compact_EndElement (void *ud, const char *name) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  lxp_dom *d;
+  lxp_delem *e;
+  lxp_ref mark, n;
+  if (!ready(xpu)) return;
+  if (xpu->stats != NULL) {
+    xpu->stats->count[XPEEndElement]++;
+    xpu->stats->bytes[XPEEndElement] += (unsigned long)strlen(name);
+  }
+  d = todom(xpu);
+  if (xpu->treeclean) dropblank(d);
+  d->textopen = 0;
+  d->nopen--;
+  e = &d->elems[d->open[d->nopen * 2]];
+  mark = d->open[d->nopen * 2 + 1];
+  n = d->npending - mark;
+  domgrow(xpu->L, d, children, d->nchildren + n);
+  memcpy(d->children + d->nchildren, d->pending + mark, n * sizeof(lxp_ref));
+  e->children = d->nchildren;
+  e->nchildren = n;
+  e->last = d->nelems - 1;
+  d->nchildren += n;
+  d->npending = mark;
+  xpu->depth--;
+}
+
+
+/*
+** Text is added to the pool as it comes: the pieces of a text node are
+** contiguous, since other events which add strings close it
+*/
+static void compact_CharData (void *ud, const char *s, int len) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  lxp_dom *d;
+  if (xpu->haslimits && !checktext(xpu, len)) return;
+  if (xpu->state != XPSok) return;
+  if (xpu->stats != NULL) {
+    xpu->stats->count[XPECharData]++;
+    xpu->stats->bytes[XPECharData] += (unsigned long)len;
+  }
+  d = todom(xpu);
+  if (d->textopen) {  /* extend it, over its '\0' */
+    lxp_ref off = childref(d->pending[d->npending - 1]);
+    unsigned int n = (unsigned int)(poolsize(d, off) + (size_t)len);
+    poolreserve(xpu->L, d, (size_t)len);
+    memcpy(d->pool + d->poollen - 1, s, (size_t)len);
+    d->poollen += (size_t)len;
+    d->pool[d->poollen - 1] = '\0';
+    memcpy(d->pool + off, &n, 4);
+  }
+  else {
+    domgrow(xpu->L, d, pending, d->npending + 1);
+    d->pending[d->npending++] = textchild(poolstring(xpu->L, d, s, (size_t)len));
+    d->textopen = 1;
+  }
+}
+
+
+/*
+** Push the proxy of element 'i' of the document whose uservalue is at
+** 'uv'
+*/
+static void pushnode (lua_State *L, int uv, lxp_dom *d, lxp_ref i) {
+  lua_rawgeti(L, uv, DOM_CACHE);
+  lua_rawgeti(L, -1, (int)i);
+  if (lua_isnil(L, -1)) {
+    lxp_node *n;
+    lua_pop(L, 1);
+    n = (lxp_node *)lua_newuserdata(L, sizeof(lxp_node));
+    n->dom = d;
+    n->index = i;
+    luaL_getmetatable(L, NodeType);
+    lua_setmetatable(L, -2);
+    lua_pushvalue(L, uv);
+    lua_setuservalue(L, -2);
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, -3, (int)i);
+  }
+  lua_remove(L, -2);  /* cache */
+}
+
+
+/*
+** Shrink an array to 'n' entries (keeping it if that fails)
+*/
+static void *domtrim (void *a, lxp_ref *size, lxp_ref n, size_t esize) {
+  void *na;
+  if (n == 0 || n == *size)
+    return a;
+  na = realloc(a, (size_t)n * esize);
+  if (na == NULL)
+    return a;
+  *size = n;
+  return na;
+}
+
+
+/*
+** Give back the room left by the doubling of the arrays, once the
+** document is finished
+*/
+static void trimdom (lxp_dom *d) {
+  if (d->poollen > 0 && d->poollen < d->poolsize) {
+    char *pool = (char *)realloc(d->pool, d->poollen);
+    if (pool != NULL) {
+      d->pool = pool;
+      d->poolsize = d->poollen;
+    }
+  }
+  d->elems = (lxp_delem *)domtrim(d->elems, &d->elemsize, d->nelems,
+                                  sizeof(lxp_delem));
+  d->attrs = (lxp_ref *)domtrim(d->attrs, &d->attrssize, d->nattrs,
+                                sizeof(lxp_ref));
+  d->children = (lxp_ref *)domtrim(d->children, &d->childrensize,
+                                   d->nchildren, sizeof(lxp_ref));
+  d->pending = (lxp_ref *)domtrim(d->pending, &d->pendingsize,
+                                  d->npending, sizeof(lxp_ref));
+  if (d->indexed != XPInone)
+    d->sametag = (lxp_ref *)domtrim(d->sametag, &d->sametagsize, d->nelems,
+                                    sizeof(lxp_ref));
+}
+
+
+/*
+** Push the first top-level element of the document on top of the
+** stack (replacing it), or nil
+*/
+static void pushdomroot (lua_State *L) {
+  lxp_dom *d = (lxp_dom *)lua_touserdata(L, -1);
+  lxp_ref mark = d->open[1];  /* children of element 0 are pending */
+  if (d->npending > mark && !istext(d->pending[mark])) {
+    lua_getuservalue(L, -1);
+    pushnode(L, lua_gettop(L), d, childref(d->pending[mark]));
+    lua_replace(L, -3);
+    lua_pop(L, 1);
+  }
+  else {
+    lua_pop(L, 1);
+    lua_pushnil(L);
+  }
+}
+
+
+/*
+** The proxy at 'idx', or NULL if it is not one
+*/
+static lxp_node *tonode (lua_State *L, int idx) {
+  lxp_node *n = NULL;
+  if (lua_getmetatable(L, idx)) {
+    luaL_getmetatable(L, NodeType);
+    if (lua_rawequal(L, -1, -2))
+      n = (lxp_node *)lua_touserdata(L, idx);
+    lua_pop(L, 2);
+  }
+  return n;
+}
+
+
+static lxp_node *checknode (lua_State *L, int idx) {
+  lxp_node *n = (lxp_node *)luaL_checkudata(L, idx, NodeType);
+  luaL_argcheck(L, n->dom->elems != NULL, idx, "document was collected");
+  return n;
+}
+
+
+/*
+** Push the attributes of an element, in a new table as LOM's
+*/
+static void pushdomattrs (lua_State *L, lxp_dom *d, lxp_delem *e) {
+  lxp_ref i;
+  lua_createtable(L, (int)e->nspec, (int)e->nattrs);
+  for (i = 0; i < e->nattrs; i++) {
+    pushpooled(L, d, d->attrs[e->attrs + i * 2]);
+    if (i < e->nspec) {
+      lua_pushvalue(L, -1);
+      lua_rawseti(L, -3, (int)i + 1);
+    }
+    pushpooled(L, d, d->attrs[e->attrs + i * 2 + 1]);
+    lua_rawset(L, -3);
+  }
+}
+
+
+static void pushchild (lua_State *L, int node, lxp_dom *d, lxp_ref c) {
+  if (istext(c))
+    pushpooled(L, d, childref(c));
+  else {
+    lua_getuservalue(L, node);
+    pushnode(L, lua_gettop(L), d, childref(c));
+    lua_remove(L, -2);
+  }
+}
+
+
+static int node_index (lua_State *L) {
+  lxp_node *n = checknode(L, 1);
+  lxp_dom *d = n->dom;
+  lxp_delem *e = &d->elems[n->index];
+  if (lua_type(L, 2) == LUA_TNUMBER) {
+    lua_Number k = lua_tonumber(L, 2);
+    if (k >= 1 && k <= (lua_Number)e->nchildren && k == (lxp_ref)k) {
+      pushchild(L, 1, d, d->children[e->children + (lxp_ref)k - 1]);
+      return 1;
+    }
+  }
+  else if (lua_type(L, 2) == LUA_TSTRING) {
+    const char *key = lua_tostring(L, 2);
+    if (strcmp(key, "tag") == 0) {
+      pushpooled(L, d, e->name);
+      return 1;
+    }
+    if (strcmp(key, "attr") == 0) {
+      pushdomattrs(L, d, e);
+      return 1;
+    }
+  }
+  lua_pushnil(L);
+  return 1;
+}
+
+
+static int node_newindex (lua_State *L) {
+  return luaL_error(L, "compact trees are read-only");
+}
+
+
+static int node_len (lua_State *L) {
+  lxp_node *n = checknode(L, 1);
+  lua_pushinteger(L, (lua_Integer)n->dom->elems[n->index].nchildren);
+  return 1;
+}
+
+
+static int node_tostring (lua_State *L) {
+  lxp_node *n = checknode(L, 1);
+  lua_pushfstring(L, "%s (%p)", NodeType, (void *)n);
+  return 1;
+}
+
+
+/*
+** Pool offset of the interned name at 'idx', or -1 if the document does
+** not have it
+*/
+static long findtag (lua_State *L, lxp_dom *d, int idx) {
+  size_t len;
+  const char *tag = luaL_checklstring(L, idx, &len);
+  lxp_ref *e = findinterned(d, tag, len);
+  return (*e == 0) ? -1 : (long)(*e - 1);
+}
+
+
+/*
+** lom.find_elem: the first element named 'tag', among the element and
+** its descendants, which follow it
+*/
+static int node_find (lua_State *L) {
+  lxp_node *n = checknode(L, 1);
+  lxp_dom *d = n->dom;
+  long tag = findtag(L, d, 2);
+  lxp_ref i;
+  if (tag >= 0) {
+    for (i = n->index; i <= d->elems[n->index].last; i++) {
+      if (d->elems[i].name == (lxp_ref)tag) {
+        lua_getuservalue(L, 1);
+        pushnode(L, lua_gettop(L), d, i);
+        return 1;
+      }
+    }
+  }
+  lua_pushnil(L);
+  return 1;
+}
+
+
+static int children_next (lua_State *L) {
+  lxp_node *n = checknode(L, lua_upvalueindex(1));
+  lxp_dom *d = n->dom;
+  lxp_delem *e = &d->elems[n->index];
+  long tag = (long)lua_tointeger(L, lua_upvalueindex(2));
+  lxp_ref i = (lxp_ref)lua_tointeger(L, lua_upvalueindex(3));
+  for (; i < e->nchildren; i++) {
+    lxp_ref c = d->children[e->children + i];
+    if (!istext(c) &&
+        (tag == -2 || d->elems[childref(c)].name == (lxp_ref)tag)) {
+      lua_pushinteger(L, (lua_Integer)i + 1);
+      lua_replace(L, lua_upvalueindex(3));
+      pushchild(L, lua_upvalueindex(1), d, c);
+      return 1;
+    }
+  }
+  lua_pushinteger(L, (lua_Integer)i);
+  lua_replace(L, lua_upvalueindex(3));
+  return 0;
+}
+
+
+/*
+** lom.list_children: an iterator over the child elements, named 'tag'
+** if it is given
+*/
+static int node_children (lua_State *L) {
+  lxp_node *n = checknode(L, 1);
+  long tag = lua_isnoneornil(L, 2) ? -2 : findtag(L, n->dom, 2);
+  lua_settop(L, 1);
+  lua_pushinteger(L, (lua_Integer)tag);
+  lua_pushinteger(L, 0);
+  lua_pushcclosure(L, children_next, 3);
+  return 1;
+}
+
+
+/*
+** lom.find_all: an array with the element and its descendants named
+** 'tag', in document order; with an index, only these are visited
+*/
+static int node_findall (lua_State *L) {
+  lxp_node *n = checknode(L, 1);
+  lxp_dom *d = n->dom;
+  long tag = findtag(L, d, 2);
+  lxp_ref last = d->elems[n->index].last;
+  lxp_ref i;
+  int k = 0;
+  lua_settop(L, 2);
+  lua_newtable(L);
+  lua_getuservalue(L, 1);
+  if (tag >= 0 && d->indexed != XPInone) {
+    for (i = dname(d, (lxp_ref)tag)->first; i != 0 && i <= last;
+         i = d->sametag[i]) {
+      if (i >= n->index) {
+        pushnode(L, 4, d, i);
+        lua_rawseti(L, 3, ++k);
+      }
+    }
+  }
+  else if (tag >= 0) {
+    for (i = n->index; i <= last; i++) {
+      if (d->elems[i].name == (lxp_ref)tag) {
+        pushnode(L, 4, d, i);
+        lua_rawseti(L, 3, ++k);
+      }
+    }
+  }
+  lua_pop(L, 1);
+  return 1;
+}
+
+
+/*
+** Whether element 'i' has the attribute 'name' (a pool offset) with the
+** given value
+*/
+static int hasattr (lxp_dom *d, lxp_ref i, lxp_ref name, const char *value,
+                    size_t len) {
+  lxp_delem *e = &d->elems[i];
+  lxp_ref k;
+  for (k = e->attrs; k < e->attrs + e->nattrs * 2; k += 2) {
+    if (d->attrs[k] == name) {
+      lxp_ref v = d->attrs[k + 1];
+      return poolsize(d, v) == len && memcmp(poolstr(d, v), value, len) == 0;
+    }
+  }
+  return 0;
+}
+
+
+/*
+** lom.by_attr: the first element, among the element and its
+** descendants, whose attribute 'name' is 'value'. The index keeps the
+** first one in the document, otherwise (or if that one is not in the
+** subtree) the subtree is scanned
+*/
+static int node_byattr (lua_State *L) {
+  lxp_node *n = checknode(L, 1);
+  lxp_dom *d = n->dom;
+  long name = findtag(L, d, 2);
+  size_t len;
+  const char *value = luaL_checklstring(L, 3, &len);
+  lxp_ref last = d->elems[n->index].last;
+  lxp_ref i;
+  if (name >= 0) {
+    if (d->indexed == XPIall ||
+        (d->indexed == XPInames && dname(d, (lxp_ref)name)->indexed)) {
+      i = findattr(d, (lxp_ref)name, value, len)[0];
+      if (i == 0)
+        return 0;
+      if (i >= n->index && i <= last) {
+        lua_getuservalue(L, 1);
+        pushnode(L, lua_gettop(L), d, i);
+        return 1;
+      }
+    }
+    for (i = n->index; i <= last; i++) {
+      if (hasattr(d, i, (lxp_ref)name, value, len)) {
+        lua_getuservalue(L, 1);
+        pushnode(L, lua_gettop(L), d, i);
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+
+/*
+** lom.parent: the parent element (nil for a top-level element)
+*/
+static int node_parent (lua_State *L) {
+  lxp_node *n = checknode(L, 1);
+  lxp_ref parent = n->dom->elems[n->index].parent;
+  if (parent == 0)
+    return 0;
+  lua_getuservalue(L, 1);
+  pushnode(L, lua_gettop(L), n->dom, parent);
+  return 1;
+}
+
+
+static void compactcontent (lxp_content *c) {
+  c->start = compact_StartElement;
+  c->end = compact_EndElement;
+  c->text = compact_CharData;
+}
+
+
+/*
+** The proxies index their elements; 'find_elem', 'list_children',
+** 'find_all', 'by_attr' and 'parent' are reached by 'lxp.lom' through the
+** metatable
+*/
+static const struct luaL_Reg node_meths[] = {
+  {"__index", node_index},
+  {"__newindex", node_newindex},
+  {"__len", node_len},
+  {"__tostring", node_tostring},
+  {"find_elem", node_find},
+  {"list_children", node_children},
+  {"find_all", node_findall},
+  {"by_attr", node_byattr},
+  {"parent", node_parent},
+  {NULL, NULL}
+};
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Tree builders
+** The stack of open elements lives at index TREESTACK during a parse;
+** its first entry is a container whose only child will be the root.
+** The compact builder keeps its document there instead. With the
+** 'index' option, the field "index" of the stack is the index of the
+** tree, at TREEINDEX during a parse: 'tags' gives the elements of each
+** name in document order, 'attrs' the first element with each value of
+** each indexed attribute, and 'parent' the parent of each element but
+** the top-level ones. Its tables hold the elements weakly, so that the
+** index can be kept in a weak table keyed by the tree. The registry
+** table IndexesKey gives the index of each element ('lxp.indexof').
+** =======================================================
+*/
+
+
+/*
+** Append the string on top of the stack to the current element, joining
+** it with a preceding text node (pending text is flushed at the end of
+** every parse call, so a text node can be split over several chunks)
+*/
+static void addtreetext (lxp_userdata *xpu) {
+  lua_State *L = xpu->L;
+  int n;
+  if (xpu->stats != NULL) {
+    xpu->stats->count[XPECharData]++;
+    statbytes(xpu, XPECharData, 1);
+  }
+  lua_rawgeti(L, TREESTACK, xpu->depth);
+  lua_insert(L, -2);  /* put element below text */
+  n = (int)lua_rawlen(L, -2);
+  if (n > 0) {
+    lua_rawgeti(L, -2, n);
+    if (lua_type(L, -1) == LUA_TSTRING) {
+      lua_insert(L, -2);  /* put previous text below new text */
+      lua_concat(L, 2);
+      lua_rawseti(L, -2, n);
+      lua_pop(L, 1);  /* element */
+      return;
+    }
+    lua_pop(L, 1);
+  }
+  lua_rawseti(L, -2, n + 1);
+  lua_pop(L, 1);  /* element */
+}
+
+
+/*
+** Whether the string at index 'idx' is whitespace-only (Lua's '%s')
+*/
+static int isblanktext (lua_State *L, int idx) {
+  size_t len;
+  const char *s = lua_tolstring(L, idx, &len);
+  while (len--) {
+    switch (*s++) {
+      case ' ': case '\t': case '\n': case '\r': case '\v': case '\f':
+        break;
+      default:
+        return 0;
+    }
+  }
+  return 1;
+}
+
+
+/*
+** Drop the last child of the element on top of the stack if it is a
+** whitespace-only text node. Text nodes are complete once an element
+** starts or ends, so this is the only place where they must be checked.
+*/
+static void cleantext (lua_State *L) {
+  int n = (int)lua_rawlen(L, -1);
+  if (n == 0) return;
+  lua_rawgeti(L, -1, n);
+  if (lua_type(L, -1) == LUA_TSTRING && isblanktext(L, -1)) {
+    lua_pushnil(L);
+    lua_rawseti(L, -3, n);
+  }
+  lua_pop(L, 1);
+}
+
+
+/*
+** Push a new element: '{tag = name, attr = attributes}' for LOM, and
+** '{[0] = name, attrname = value, ...}' (specified attributes only)
+** for totable
+*/
+static void pushelement (lxp_userdata *xpu, const char *name,
+                                            const char **attrs) {
+  lua_State *L = xpu->L;
+  if (xpu->tree == XPTlom) {
+    lua_createtable(L, 0, 2);
+    pushname(xpu, name);
+    lua_setfield(L, -2, "tag");
+    pushattributes(xpu, attrs);
+    lua_setfield(L, -2, "attr");
+  }
+  else {
+    int nspec = specifiedcount(xpu);
+    int i;
+    lua_createtable(L, 0, nspec / 2);
+    pushname(xpu, name);
+    lua_rawseti(L, -2, 0);
+    for (i = 0; i < nspec; i += 2) {
+      pushname(xpu, attrs[i]);
+      lua_pushstring(L, attrs[i + 1]);
+      lua_rawset(L, -3);
+    }
+  }
+}
+
+
+static void pushweak (lua_State *L, const char *mode) {
+  lua_newtable(L);
+  lua_createtable(L, 0, 1);
+  lua_pushstring(L, mode);
+  lua_setfield(L, -2, "__mode");
+  lua_setmetatable(L, -2);
+}
+
+
+/*
+** Enter the element on top of the stack in the index
+*/
+static void indextree (lxp_userdata *xpu, const char *name,
+                                          const char **attrs) {
+  lua_State *L = xpu->L;
+  lua_getfield(L, TREEINDEX, "tags");
+  pushname(xpu, name);
+  lua_rawget(L, -2);
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    pushweak(L, "v");
+    pushname(xpu, name);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, -4);
+  }
+  lua_pushvalue(L, -3);
+  lua_rawseti(L, -2, (int)lua_rawlen(L, -2) + 1);
+  lua_pop(L, 2);  /* list, tags */
+  lua_getfield(L, TREEINDEX, "attrs");
+  for (; *attrs; attrs += 2) {
+    pushname(xpu, attrs[0]);
+    lua_rawget(L, -2);
+    if (lua_isnil(L, -1)) {
+      lua_pop(L, 1);
+      if (xpu->treeindex != XPIall)
+        continue;
+      pushweak(L, "v");
+      pushname(xpu, attrs[0]);
+      lua_pushvalue(L, -2);
+      lua_rawset(L, -4);
+    }
+    lua_pushstring(L, attrs[1]);
+    lua_pushvalue(L, -1);
+    lua_rawget(L, -3);
+    if (lua_isnil(L, -1)) {  /* the first element keeps the value */
+      lua_pop(L, 1);
+      lua_pushvalue(L, -4);
+      lua_rawset(L, -3);
+    }
+    else
+      lua_pop(L, 2);
+    lua_pop(L, 1);  /* values */
+  }
+  lua_pop(L, 1);  /* attrs */
+  lua_getfield(L, LUA_REGISTRYINDEX, IndexesKey);
+  lua_pushvalue(L, -2);
+  lua_pushvalue(L, TREEINDEX);
+  lua_rawset(L, -3);
+  lua_pop(L, 1);
+  if (xpu->depth > 2) {  /* not a top-level element? */
+    lua_getfield(L, TREEINDEX, "parent");
+    lua_pushvalue(L, -2);
+    lua_rawgeti(L, TREESTACK, xpu->depth - 1);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+  }
+}
+
+
+static void tree_StartElement (void *ud, const char *name,
+                                         const char **attrs) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  lua_State *L = xpu->L;
+  if (!enterelement(xpu, name, attrs)) return;
+  if (xpu->stats != NULL) {
+    xpu->stats->count[XPEStartElement]++;
+    xpu->stats->bytes[XPEStartElement] += (unsigned long)strlen(name);
+  }
+  if (xpu->treeclean) {
+    lua_rawgeti(L, TREESTACK, xpu->depth - 1);
+    cleantext(L);
+    lua_pop(L, 1);
+  }
+  pushelement(xpu, name, attrs);
+  if (xpu->treeindex != XPInone)
+    indextree(xpu, name, attrs);
+  lua_rawseti(L, TREESTACK, xpu->depth);
+}
+
+
+/*
+** Move the closed element into its parent. With 'torecord' an element
+** holding a single text node becomes a 'tag = text' field of its parent,
+** unless that field is already taken (the root is never converted). As
+** in 'totable.torecord', an element is not converted if any of its own
+** children were (it had more than that single text node).
+*/
+static void tree_EndElement (void *ud, const char *name) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  lua_State *L = xpu->L;
+  if (!ready(xpu)) return;
+  if (xpu->stats != NULL) {
+    xpu->stats->count[XPEEndElement]++;
+    xpu->stats->bytes[XPEEndElement] += (unsigned long)strlen(name);
+  }
+  lua_rawgeti(L, TREESTACK, xpu->depth - 1);  /* parent */
+  lua_rawgeti(L, TREESTACK, xpu->depth);  /* element */
+  if (xpu->treeclean)
+    cleantext(L);
+  if (xpu->treerecord && xpu->depth > 2 && !xpu->levels[xpu->depth].recorded &&
+      lua_rawlen(L, -1) == 1) {
+    lua_rawgeti(L, -1, 1);
+    if (lua_type(L, -1) == LUA_TSTRING) {
+      lua_rawgeti(L, -2, 0);  /* tag */
+      lua_pushvalue(L, -1);
+      lua_rawget(L, -5);
+      if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        lua_insert(L, -2);  /* put tag below text */
+        lua_rawset(L, -4);  /* parent[tag] = text */
+        lua_pop(L, 2);  /* element, parent */
+        xpu->levels[xpu->depth - 1].recorded = 1;
+        goto closed;
+      }
+      lua_pop(L, 2);
+    }
+    lua_pop(L, 1);
+  }
+  lua_rawseti(L, -2, (int)lua_rawlen(L, -2) + 1);
+  lua_pop(L, 1);
+ closed:
+  lua_pushnil(L);
+  lua_rawseti(L, TREESTACK, xpu->depth--);
+  if (xpu->pull && xpu->depth == 1 && !suspended(xpu))
+    XML_StopParser(xpu->parser, XML_TRUE);  /* 'parser:trees' hands it out */
+}
+
+
+static void tree_CharData (void *ud, const char *s, int len) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  if (xpu->haslimits && !checktext(xpu, len)) return;
+  if (xpu->state == XPSok) {
+    xpu->state = XPSstring;
+    luaL_buffinit(xpu->L, xpu->b);
+  }
+  if (xpu->state == XPSstring)
+    luaL_addlstring(xpu->b, s, len);
+}
+
+
+static void newtreeindex (lua_State *L, lxp_userdata *xpu) {
+  lua_createtable(L, 0, 3);
+  lua_newtable(L);
+  lua_setfield(L, -2, "tags");
+  lua_newtable(L);
+  if (xpu->treeindex == XPInames) {
+    int i, n;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, xpu->indexref);
+    n = (int)lua_rawlen(L, -1);
+    for (i = 1; i <= n; i++) {
+      lua_rawgeti(L, -1, i);
+      pushweak(L, "v");
+      lua_rawset(L, -4);
+    }
+    lua_pop(L, 1);
+  }
+  lua_setfield(L, -2, "attrs");
+  pushweak(L, "kv");
+  lua_setfield(L, -2, "parent");
+  lua_setfield(L, -2, "index");
+}
+
+
+/*
+** lxp.indexof(element): the index of the tree of an element, for a table
+** tree built with the 'index' option (nil otherwise)
+*/
+static int lxp_indexof (lua_State *L) {
+  luaL_checkany(L, 1);
+  lua_getfield(L, LUA_REGISTRYINDEX, IndexesKey);
+  lua_pushvalue(L, 1);
+  lua_rawget(L, -2);
+  return 1;
+}
+
+
+static void newtree (lua_State *L, lxp_userdata *xpu) {
+  luaL_unref(L, LUA_REGISTRYINDEX, xpu->treeref);
+  if (xpu->tree == XPTcompact)
+    newdom(L, xpu);
+  else {
+    lua_createtable(L, 8, 0);  /* stack of open elements */
+    lua_newtable(L);  /* container for the root element */
+    lua_rawseti(L, -2, 1);
+    if (xpu->treeindex != XPInone)
+      newtreeindex(L, xpu);
+  }
+  xpu->treeref = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+
+static void treecontent (lxp_userdata *xpu, lxp_content *c) {
+  if (xpu->tree == XPTcompact) {
+    compactcontent(c);
+    return;
+  }
+  c->start = tree_StartElement;
+  c->end = tree_EndElement;
+  c->text = tree_CharData;
+}
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Batch mode
+** Element, text, comment, and processing instruction events are stored
+** as triples in the BATCH table and handed to the 'Batch' callback once
+** 'batch' of them are pending (and at the end of each parse call). Any
+** other callback first flushes the pending events.
+** In pull mode ('parser:events') a full batch suspends the parser
+** instead, and the iterator hands out the events before resuming it.
+** =======================================================
+*/
+
+
+static void flushbatch (lxp_userdata *xpu) {
+  lua_State *L = xpu->L;
+  int n = xpu->batchn;
+  if (xpu->pull) {  /* stop after this handler; keep the events */
+    if (!suspended(xpu))
+      XML_StopParser(xpu->parser, XML_TRUE);
+    return;
+  }
+  xpu->batchn = 0;
+  if (xpu->stats != NULL) {
+    xpu->stats->count[XPEBatch]++;
+    xpu->stats->ev = XPEBatch;
+  }
+  lua_rawgeti(L, DISPATCH, XPEBatch);
+  if (!lua_isfunction(L, -1))
+    luaL_error(L, "lxp '%s' callback is not a function", BatchKey);
+  lua_pushvalue(L, 1);  /* self */
+  lua_pushvalue(L, BATCH);
+  lua_pushinteger(L, n);
+  docall(xpu, 2, 0);
+}
+
+
+/*
+** Store the type of a new event and the two values on top of the stack
+*/
+static void addevent (lxp_userdata *xpu, enum XPEvent ev) {
+  lua_State *L = xpu->L;
+  int i = xpu->batchn * 3;
+  if (xpu->stats != NULL) {
+    xpu->stats->count[ev]++;
+    statbytes(xpu, ev, 2);
+  }
+  lua_rawseti(L, BATCH, i + 3);
+  lua_rawseti(L, BATCH, i + 2);
+  pushname(xpu, eventkeys[ev]);
+  lua_rawseti(L, BATCH, i + 1);
+  if (++xpu->batchn >= xpu->batch)
+    flushbatch(xpu);
+}
+
+
+static void addbatchtext (lxp_userdata *xpu) {
+  lua_pushboolean(xpu->L, 0);
+  addevent(xpu, XPECharData);
+}
+
+
+static void batch_StartElement (void *ud, const char *name,
+                                          const char **attrs) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  if (xpu->levels ? !enterelement(xpu, name, attrs) : !ready(xpu)) return;
+  pushname(xpu, name);
+  pushattributes(xpu, attrs);
+  addevent(xpu, XPEStartElement);
+}
+
+
+static void batch_EndElement (void *ud, const char *name) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  if (!ready(xpu)) return;
+  if (xpu->levels) xpu->depth--;
+  pushname(xpu, name);
+  lua_pushboolean(xpu->L, 0);
+  addevent(xpu, XPEEndElement);
+}
+
+
+static void batch_Comment (void *ud, const char *data) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  if (xpu->haslimits ? !checkcomment(xpu, data) : !ready(xpu)) return;
+  lua_pushstring(xpu->L, data);
+  lua_pushboolean(xpu->L, 0);
+  addevent(xpu, XPEComment);
+}
+
+
+static void batch_ProcessingInstruction (void *ud, const char *target,
+                                                   const char *data) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  if (xpu->haslimits ? !checkpi(xpu, target, data) : !ready(xpu)) return;
+  lua_pushstring(xpu->L, target);
+  lua_pushstring(xpu->L, data);
+  addevent(xpu, XPEProcessingInstruction);
+}
+
+
+static void newbatch (lua_State *L, lxp_userdata *xpu) {
+  luaL_unref(L, LUA_REGISTRYINDEX, xpu->batchref);
+  lua_createtable(L, xpu->batch * 3, 0);
+  xpu->batchref = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+
+static void batchcontent (lxp_content *c) {
+  c->start = batch_StartElement;
+  c->end = batch_EndElement;
+  c->text = tree_CharData;
+  c->comment = batch_Comment;
+  c->pi = batch_ProcessingInstruction;
+}
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Event blocks
+** With 'parser:blocks' the element, text, comment, and processing
+** instruction events are written to a block in C: an array of
+** 'lxp_event' whose strings are offsets and lengths in a byte arena.
+** 'lxp.pull' reads the blocks through the LuaJIT FFI, with no Lua C API
+** call per event. A full block suspends the parser, as with
+** 'parser:events'.
+** =======================================================
+*/
+
+
+/*
+** Memory ran out: the events are lost, and the parse fails
+*/
+static void blockfail (lxp_userdata *xpu) {
+  if (xpu->state == XPSok) {
+    lua_pushliteral(xpu->L, "not enough memory");
+    xpu->state = XPSerror;
+    xpu->errorref = luaL_ref(xpu->L, LUA_REGISTRYINDEX);
+  }
+}
+
+
+/*
+** Add an event of kind 'type' to the block, or NULL if memory ran out
+*/
+static lxp_event *blockevent (lxp_userdata *xpu, int type) {
+  lxp_evblock *bk = xpu->block;
+  lxp_event *e;
+  if (bk->n == bk->size) {
+    int size = bk->size * 2;
+    lxp_event *events = (lxp_event *)realloc(bk->events,
+                                             size * sizeof(lxp_event));
+    if (events == NULL) {
+      blockfail(xpu);
+      return NULL;
+    }
+    bk->events = events;
+    bk->size = size;
+  }
+  e = &bk->events[bk->n++];
+  e->type = type;
+  e->n = 0;
+  e->s = e->len = e->v = e->vlen = 0;
+  return e;
+}
+
+
+/*
+** Copy 'len' bytes to the end of the arena, at offset 'off' (returns 0 if
+** memory ran out)
+*/
+static int blockbytes (lxp_userdata *xpu, const char *s, size_t len,
+                                                     size_t *off) {
+  lxp_evblock *bk = xpu->block;
+  if (len > bk->arenasize - bk->len) {
+    size_t size = bk->arenasize;
+    char *arena;
+    while (len > size - bk->len) size *= 2;
+    arena = (char *)realloc(bk->arena, size);
+    if (arena == NULL) {
+      blockfail(xpu);
+      return 0;
+    }
+    bk->arena = arena;
+    bk->arenasize = size;
+  }
+  *off = bk->len;
+  memcpy(bk->arena + bk->len, s, len);
+  bk->len += len;
+  return 1;
+}
+
+
+static int blockstring (lxp_userdata *xpu, const char *s, size_t *off,
+                                                     size_t *len) {
+  *len = strlen(s);
+  return blockbytes(xpu, s, *len, off);
+}
+
+
+/* a full block suspends the parser until the iterator is called again */
+static void blockdone (lxp_userdata *xpu, enum XPEvent ev) {
+  if (xpu->stats != NULL)
+    xpu->stats->count[ev]++;
+  if (xpu->block->n >= xpu->block->max && !suspended(xpu))
+    XML_StopParser(xpu->parser, XML_TRUE);
+}
+
+
+static void block_StartElement (void *ud, const char *name,
+                                          const char **attrs) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  lxp_event *e;
+  int i, start;
+  if (xpu->levels ? !enterelement(xpu, name, attrs) : !ready(xpu)) return;
+  if ((e = blockevent(xpu, XPBstart)) == NULL ||
+      !blockstring(xpu, name, &e->s, &e->len))
+    return;
+  start = xpu->block->n - 1;  /* 'e' moves if the block grows */
+  for (i = 0; attrs[i]; i += 2) {
+    if ((e = blockevent(xpu, XPBattr)) == NULL ||
+        !blockstring(xpu, attrs[i], &e->s, &e->len) ||
+        !blockstring(xpu, attrs[i + 1], &e->v, &e->vlen))
+      return;
+    xpu->block->events[start].n++;
+  }
+  blockdone(xpu, XPEStartElement);
+}
+
+
+static void block_EndElement (void *ud, const char *name) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  lxp_event *e;
+  if (!ready(xpu)) return;
+  if (xpu->levels) xpu->depth--;
+  if ((e = blockevent(xpu, XPBend)) == NULL ||
+      !blockstring(xpu, name, &e->s, &e->len))
+    return;
+  blockdone(xpu, XPEEndElement);
+}
+
+
+/*
+** Pieces of text are joined into the text event ending the block; as
+** with 'parser:events', a text node does not suspend the parser, so that
+** it is not split
+*/
+static void block_CharData (void *ud, const char *s, int len) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  lxp_evblock *bk = xpu->block;
+  lxp_event *e;
+  size_t off;
+  if (xpu->haslimits && !checktext(xpu, len)) return;
+  if (stopped(xpu)) return;
+  e = (bk->n > 0) ? &bk->events[bk->n - 1] : NULL;
+  if (e != NULL && e->type == XPBtext && e->s + e->len == bk->len) {
+    if (blockbytes(xpu, s, (size_t)len, &off))
+      e->len += (size_t)len;
+    return;
+  }
+  if (!blockbytes(xpu, s, (size_t)len, &off) ||
+      (e = blockevent(xpu, XPBtext)) == NULL)
+    return;
+  e->s = off;
+  e->len = (size_t)len;
+  if (xpu->stats != NULL)
+    xpu->stats->count[XPECharData]++;
+}
+
+
+static void block_Comment (void *ud, const char *data) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  lxp_event *e;
+  if (xpu->haslimits ? !checkcomment(xpu, data) : !ready(xpu)) return;
+  if ((e = blockevent(xpu, XPBcomment)) == NULL ||
+      !blockstring(xpu, data, &e->s, &e->len))
+    return;
+  blockdone(xpu, XPEComment);
+}
+
+
+static void block_ProcessingInstruction (void *ud, const char *target,
+                                                   const char *data) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  lxp_event *e;
+  if (xpu->haslimits ? !checkpi(xpu, target, data) : !ready(xpu)) return;
+  if ((e = blockevent(xpu, XPBpi)) == NULL ||
+      !blockstring(xpu, target, &e->s, &e->len) ||
+      !blockstring(xpu, data, &e->v, &e->vlen))
+    return;
+  blockdone(xpu, XPEProcessingInstruction);
+}
+
+
+static void newblock (lua_State *L, lxp_userdata *xpu, int max) {
+  lxp_evblock *bk = (lxp_evblock *)calloc(1, sizeof(lxp_evblock));
+  if (bk == NULL)
+    luaL_error(L, "not enough memory");
+  xpu->block = bk;  /* freed with the parser from now on */
+  bk->max = max;
+  bk->size = max + 16;
+  bk->arenasize = 4096;
+  bk->events = (lxp_event *)malloc(bk->size * sizeof(lxp_event));
+  bk->arena = (char *)malloc(bk->arenasize);
+  if (bk->events == NULL || bk->arena == NULL)
+    luaL_error(L, "not enough memory");
+}
+
+
+static void blockcontent (lxp_content *c) {
+  c->start = block_StartElement;
+  c->end = block_EndElement;
+  c->text = block_CharData;
+  c->comment = block_Comment;
+  c->pi = block_ProcessingInstruction;
+}
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Path filter
+** With the 'filter' option only the elements matching one of a set of
+** paths ('/feed/entry', '//item/@id') reach the content handlers, with
+** their content; for a path ending in an attribute, only the start and
+** end of the element, with that attribute. Everything else is dropped
+** before any Lua value is created. Each path is matched as a small NFA:
+** for every open element a bit mask tells which of its steps have been
+** matched so far. The limits are checked here on the whole document, as
+** what is dropped never reaches the handlers which check them.
+** =======================================================
+*/
+
+
+static void badpath (lua_State *L, const char *path) {
+  luaL_error(L, "invalid path '%s'", path);
+}
+
+
+/*
+** Parse a path of '/name' and '//name' steps (a name may be '*'), ending
+** with an optional '/@name' (or '/@*'); names point into 's'
+*/
+static void compilepath (lua_State *L, lxp_path *path, const char *s) {
+  const char *src = s;
+  if (*s != '/')
+    badpath(L, src);
+  while (*s == '/') {
+    lxp_step *st;
+    int descendant = (s[1] == '/');
+    s += descendant ? 2 : 1;
+    if (path->isattr)
+      badpath(L, src);  /* attribute must be the last step */
+    if (*s == '@') {
+      if (descendant || path->nsteps == 0)
+        badpath(L, src);
+      st = &path->attr;
+      path->isattr = 1;
+      s++;
+    }
+    else {
+      if (path->nsteps == FILTER_MAXSTEPS)
+        luaL_error(L, "too many steps in path '%s'", src);
+      st = &path->steps[path->nsteps++];
+    }
+    st->descendant = descendant;
+    st->name = s;
+    while (*s != '\0' && *s != '/') s++;
+    st->len = (size_t)(s - st->name);
+    if (st->len == 0)
+      badpath(L, src);
+    if (st->len == 1 && *st->name == '*')
+      st->name = NULL;
+  }
+}
+
+
+static void growfilter (lxp_userdata *xpu) {
+  lxp_filter *f = xpu->filter;
+  int size = f->size ? f->size * 2 : 16;
+  unsigned long *masks;
+  unsigned char *states;
+  lxp_level *levels;
+  masks = (unsigned long *)realloc(f->masks,
+                                   size * f->npaths * sizeof(unsigned long));
+  if (masks != NULL)
+    f->masks = masks;
+  states = (unsigned char *)realloc(f->states, size);
+  if (states != NULL)
+    f->states = states;
+  levels = (lxp_level *)realloc(f->levels, size * sizeof(lxp_level));
+  if (levels != NULL)
+    f->levels = levels;
+  if (masks == NULL || states == NULL || levels == NULL)
+    luaL_error(xpu->L, "not enough memory");
+  f->size = size;
+}
+
+
+static void resetfilter (lxp_filter *f) {
+  int i;
+  f->depth = 0;
+  f->inside = 0;
+  f->nspec = -1;
+  f->levels[0].children = 0;
+  f->levels[0].text = -1;
+  for (i = 0; i < f->npaths; i++)
+    f->masks[i] = 1;  /* at the document, no step is matched yet */
+}
+
+
+/*
+** Read the 'filter' option on top of the stack: a path or a list of paths
+*/
+static void checkfilter (lua_State *L, lxp_userdata *xpu) {
+  lxp_filter *f;
+  size_t total = 0;
+  char *buff;
+  int i, n;
+  if (lua_type(L, -1) == LUA_TSTRING) {
+    lua_createtable(L, 1, 0);
+    lua_pushvalue(L, -2);
+    lua_rawseti(L, -2, 1);
+    lua_replace(L, -2);
+  }
+  luaL_checktype(L, -1, LUA_TTABLE);
+  n = (int)lua_rawlen(L, -1);
+  if (n == 0)
+    luaL_error(L, "option 'filter' must have at least one path");
+  for (i = 1; i <= n; i++) {
+    lua_rawgeti(L, -1, i);
+    if (lua_type(L, -1) != LUA_TSTRING)
+      luaL_error(L, "invalid path (a string expected)");
+    total += lua_rawlen(L, -1) + 1;
+    lua_pop(L, 1);
+  }
+  f = xpu->filter = (lxp_filter *)calloc(1, sizeof(lxp_filter));
+  if (f == NULL)
+    luaL_error(L, "not enough memory");
+  f->paths = (lxp_path *)calloc(n, sizeof(lxp_path));
+  f->strings = buff = (char *)malloc(total);
+  if (f->paths == NULL || buff == NULL)
+    luaL_error(L, "not enough memory");
+  f->npaths = n;
+  for (i = 1; i <= n; i++) {
+    size_t len;
+    const char *path;
+    lua_rawgeti(L, -1, i);
+    path = lua_tolstring(L, -1, &len);
+    memcpy(buff, path, len + 1);
+    compilepath(L, &f->paths[i - 1], buff);
+    buff += len + 1;
+    lua_pop(L, 1);
+  }
+  growfilter(xpu);
+  resetfilter(f);
+}
+
+
+/*
+** Whether a step matches a name; with namespaces, a step without the
+** separator also matches the local name of 'uri<sep>localname'
+*/
+static int stepmatch (lxp_userdata *xpu, const lxp_step *st,
+                                         const char *name) {
+  const char *local;
+  if (st->name == NULL)
+    return 1;
+  if (strncmp(name, st->name, st->len) == 0 && name[st->len] == '\0')
+    return 1;
+  if (xpu->sep == '\0' || (local = strchr(name, xpu->sep)) == NULL)
+    return 0;
+  local++;
+  return strncmp(local, st->name, st->len) == 0 &&
+         (local[st->len] == '\0' || local[st->len] == xpu->sep);
+}
+
+
+/*
+** Keep the attributes selected by the attribute paths matched by the
+** current element (specified ones come first, as from Expat)
+*/
+static void selectattrs (lxp_userdata *xpu, const char **attrs) {
+  lxp_filter *f = xpu->filter;
+  const unsigned long *masks = f->masks + f->depth * f->npaths;
+  int nspec = XML_GetSpecifiedAttributeCount(xpu->parser);
+  int i, j, n = 0;
+  while (attrs[n]) n++;
+  if (n + 1 > f->nattrs) {
+    const char **a = (const char **)realloc((void *)f->attrs,
+                                            (n + 1) * sizeof(const char *));
+    if (a == NULL)
+      luaL_error(xpu->L, "not enough memory");
+    f->attrs = a;
+    f->nattrs = n + 1;
+  }
+  f->nspec = 0;
+  n = 0;
+  for (i = 0; attrs[i]; i += 2) {
+    for (j = 0; j < f->npaths; j++) {
+      const lxp_path *path = &f->paths[j];
+      if (path->isattr && (masks[j] & (1UL << path->nsteps)) &&
+          stepmatch(xpu, &path->attr, attrs[i])) {
+        f->attrs[n++] = attrs[i];
+        f->attrs[n++] = attrs[i + 1];
+        if (i < nspec) f->nspec++;
+        break;
+      }
+    }
+  }
+  f->attrs[n] = NULL;
+}
+
+
+/*
+** Match a new element against the paths, from the steps matched by its
+** parent: a step matched by an ancestor stays matched ('//') and a step
+** matching the element advances
+*/
+static enum XPFilter matchelement (lxp_userdata *xpu, const char *name) {
+  lxp_filter *f = xpu->filter;
+  const unsigned long *parent = f->masks + (f->depth - 1) * f->npaths;
+  unsigned long *masks = f->masks + f->depth * f->npaths;
+  enum XPFilter state = XPFdrop;
+  int i, j;
+  for (i = 0; i < f->npaths; i++) {
+    const lxp_path *path = &f->paths[i];
+    unsigned long m = parent[i];
+    unsigned long nm = 0;
+    for (j = 0; j < path->nsteps && (m >> j) != 0; j++) {
+      if (m & (1UL << j)) {
+        if (path->steps[j].descendant)
+          nm |= 1UL << j;
+        if (stepmatch(xpu, &path->steps[j], name))
+          nm |= 1UL << (j + 1);
+      }
+    }
+    masks[i] = nm;
+    if (nm & (1UL << path->nsteps)) {
+      if (!path->isattr)
+        state = XPFall;
+      else if (state == XPFdrop)
+        state = XPFattrs;
+    }
+  }
+  return state;
+}
+
+
+/*
+** Check the limits for a new element at depth 'f->depth', whether it is
+** dropped or not
+*/
+static int filterlimits (lxp_userdata *xpu, const char *name,
+                                            const char **attrs) {
+  lxp_filter *f = xpu->filter;
+  lxp_level *lv = &f->levels[f->depth];
+  if (!countchild(xpu, lv - 1))
+    return 0;
+  if (overlimit(xpu, XPLdepth, f->depth))
+    return breach(xpu, "structure is too deep");
+  if (!checknames(xpu, name, attrs))
+    return 0;
+  lv->children = 0;
+  lv->text = -1;
+  return 1;
+}
+
+
+static void filter_StartElement (void *ud, const char *name,
+                                           const char **attrs) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  lxp_filter *f = xpu->filter;
+  enum XPFilter state;
+  if (stopped(xpu)) return;
+  if (f->depth + 1 >= f->size)
+    growfilter(xpu);
+  f->states[++f->depth] = XPFdrop;
+  if (xpu->haslimits && !filterlimits(xpu, name, attrs))
+    return;
+  if (f->inside)
+    state = XPFall;
+  else if ((state = matchelement(xpu, name)) == XPFall)
+    f->inside = f->depth;
+  f->states[f->depth] = (unsigned char)state;
+  if (state == XPFdrop || f->h.start == NULL)
+    return;
+  if (state == XPFattrs) {
+    selectattrs(xpu, attrs);
+    f->h.start(ud, name, f->attrs);
+    f->nspec = -1;
+  }
+  else
+    f->h.start(ud, name, attrs);
+}
+
+
+static void filter_EndElement (void *ud, const char *name) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  lxp_filter *f = xpu->filter;
+  int state;
+  if (stopped(xpu)) return;
+  state = f->states[f->depth];
+  if (f->inside == f->depth)
+    f->inside = 0;
+  f->depth--;
+  if (state != XPFdrop && f->h.end != NULL)
+    f->h.end(ud, name);
+}
+
+
+static void filter_CharData (void *ud, const char *s, int len) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  lxp_filter *f = xpu->filter;
+  if (xpu->haslimits &&
+      (stopped(xpu) || !counttext(xpu, &f->levels[f->depth], len)))
+    return;
+  if (f->inside)
+    f->h.text(ud, s, len);
+}
+
+
+static void filter_Comment (void *ud, const char *data) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  lxp_filter *f = xpu->filter;
+  if (xpu->haslimits &&
+      (stopped(xpu) || !countcomment(xpu, &f->levels[f->depth], data)))
+    return;
+  if (f->inside)
+    f->h.comment(ud, data);
+}
+
+
+static void filter_ProcessingInstruction (void *ud, const char *target,
+                                                    const char *data) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  lxp_filter *f = xpu->filter;
+  if (xpu->haslimits &&
+      (stopped(xpu) || !countpi(xpu, &f->levels[f->depth], target, data)))
+    return;
+  if (f->inside)
+    f->h.pi(ud, target, data);
+}
+
+
+static void filter_StartCdata (void *ud) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  if (xpu->filter->inside)
+    xpu->filter->h.startcdata(ud);
+}
+
+
+static void filter_EndCdata (void *ud) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  if (xpu->filter->inside)
+    xpu->filter->h.endcdata(ud);
+}
+
+
+/*
+** Put the filter handlers in front of the content handlers 'c'
+*/
+static void filtercontent (lxp_userdata *xpu, lxp_content *c) {
+  lxp_filter *f = xpu->filter;
+  f->h = *c;
+  c->start = filter_StartElement;  /* always, to follow the paths */
+  c->end = filter_EndElement;
+  if (c->text) c->text = filter_CharData;
+  if (c->comment) c->comment = filter_Comment;
+  if (c->pi) c->pi = filter_ProcessingInstruction;
+  if (c->startcdata) {
+    c->startcdata = filter_StartCdata;
+    c->endcdata = filter_EndCdata;
+  }
+}
+/* }====================================================== */
+
+/*
+** {======================================================
+** Text nodes
+** With the 'whitespace', 'mergecdata', or 'maxtext' options the pieces
+** of text given by Expat are gathered in C until the event which ends
+** the text node, and only then handed to the content handler, trimmed
+** and capped; text which is dropped never becomes a Lua string.
+** =======================================================
+*/
+
+#define isxmlspace(c)	((c) == ' ' || (c) == '\n' || (c) == '\t' || (c) == '\r')
+
+
+static void resettext (lxp_text *t) {
+  t->len = t->raw = 0;
+  t->blank = 1;
+  t->capped = 0;
+}
+
+
+/*
+** Read the 'whitespace', 'mergecdata', and 'maxtext' options (at 3)
+*/
+static void checktextoptions (lua_State *L, lxp_userdata *xpu) {
+  static const char *const spaces[] = {"keep", "skip", "trim", NULL};
+  enum XPSpace space = XPWkeep;
+  lua_Integer max = 0;
+  int merge;
+  lua_getfield(L, 3, "whitespace");
+  if (!lua_isnil(L, -1)) {
+    const char *name = luaL_checkstring(L, -1);
+    int i;
+    for (i = 0; spaces[i] && strcmp(spaces[i], name) != 0; i++) ;
+    if (spaces[i] == NULL)
+      luaL_error(L, "invalid whitespace mode '%s'", name);
+    space = (enum XPSpace)i;
+  }
+  lua_getfield(L, 3, "mergecdata");
+  merge = lua_toboolean(L, -1);
+  lua_getfield(L, 3, "maxtext");
+  if (!lua_isnil(L, -1)) {
+    max = luaL_checkinteger(L, -1);
+    if (max < 1)
+      luaL_error(L, "option 'maxtext' must be a positive number");
+  }
+  lua_pop(L, 3);
+  if (space == XPWkeep && !merge && max == 0)
+    return;
+  xpu->text = (lxp_text *)calloc(1, sizeof(lxp_text));
+  if (xpu->text == NULL)
+    luaL_error(L, "not enough memory");
+  xpu->text->space = space;
+  xpu->text->mergecdata = merge;
+  xpu->text->max = (size_t)max;
+  resettext(xpu->text);
+}
+
+
+/*
+** Hand the text node gathered to the content handler, unless it is
+** dropped, and deliver it at once: it must not be joined with the next
+** one, even when no other event comes in between
+*/
+static void flushtext (lxp_userdata *xpu) {
+  lxp_text *t = xpu->text;
+  size_t len = t->len;
+  int blank = t->blank;
+  resettext(t);
+  if (t->space == XPWtrim) {  /* leading whitespace was not kept */
+    while (len > 0 && isxmlspace(t->buf[len - 1]))
+      len--;
+  }
+  else if (t->space == XPWskip && blank)
+    return;
+  if (len > 0 && !stopped(xpu)) {
+    t->h.text(xpu, t->buf, (int)len);
+    if (xpu->state == XPSstring) dischargestring(xpu);
+  }
+}
+
+
+static void text_CharData (void *ud, const char *s, int len) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  lxp_text *t = xpu->text;
+  size_t n = (size_t)len;
+  if (stopped(xpu)) return;
+  t->raw += n;
+  if (xpu->haslimits && overlimit(xpu, XPLtext, (long)t->raw)) {
+    breach(xpu, "text/CDATA node(s) too long");
+    return;
+  }
+  if (t->capped) return;
+  if (t->len == 0 && t->space == XPWtrim) {
+    while (n > 0 && isxmlspace(*s)) {
+      s++; n--;
+    }
+  }
+  if (t->max > 0 && n > t->max - t->len) {
+    n = t->max - t->len;
+    while (n > 0 && ((unsigned char)s[n] & 0xC0) == 0x80)
+      n--;  /* do not split a UTF-8 sequence */
+    t->capped = 1;
+  }
+  if (t->blank && t->space == XPWskip) {
+    size_t i;
+    for (i = 0; i < n && isxmlspace(s[i]); i++) ;
+    t->blank = (i == n);
+  }
+  if (n > t->size - t->len) {
+    size_t size = t->size ? t->size : 256;
+    char *buf;
+    while (size - t->len < n) size *= 2;
+    buf = (char *)realloc(t->buf, size);
+    if (buf == NULL) {
+      lua_pushliteral(xpu->L, "not enough memory");
+      xpu->state = XPSerror;
+      xpu->errorref = luaL_ref(xpu->L, LUA_REGISTRYINDEX);
+      return;
+    }
+    t->buf = buf;
+    t->size = size;
+  }
+  memcpy(t->buf + t->len, s, n);
+  t->len += n;
+}
+
+
+static void text_StartElement (void *ud, const char *name,
+                                         const char **attrs) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  endtext(xpu);
+  if (xpu->text->h.start != NULL)
+    xpu->text->h.start(ud, name, attrs);
+  else
+    XML_DefaultCurrent(xpu->parser);
+}
+
+
+static void text_EndElement (void *ud, const char *name) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  endtext(xpu);
+  if (xpu->text->h.end != NULL)
+    xpu->text->h.end(ud, name);
+  else
+    XML_DefaultCurrent(xpu->parser);
+}
+
+
+static void text_Comment (void *ud, const char *data) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  endtext(xpu);
+  xpu->text->h.comment(ud, data);
+}
+
+
+static void text_ProcessingInstruction (void *ud, const char *target,
+                                                  const char *data) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  endtext(xpu);
+  xpu->text->h.pi(ud, target, data);
+}
+
+
+static void text_StartCdata (void *ud) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  endtext(xpu);
+  xpu->text->h.startcdata(ud);
+}
+
+
+static void text_EndCdata (void *ud) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  endtext(xpu);
+  xpu->text->h.endcdata(ud);
+}
+
+
+/*
+** Put the text handlers in front of the content handlers 'c'. Text
+** nodes end at element boundaries and at the events which have a
+** handler, as when Expat's pieces are merged into a Lua string.
+*/
+static void textcontent (lxp_userdata *xpu, lxp_content *c) {
+  lxp_text *t = xpu->text;
+  t->h = *c;
+  if (c->text == NULL)
+    return;  /* no text is delivered */
+  c->start = text_StartElement;
+  c->end = text_EndElement;
+  c->text = text_CharData;
+  if (c->comment) c->comment = text_Comment;
+  if (c->pi) c->pi = text_ProcessingInstruction;
+  if (t->mergecdata)
+    c->startcdata = c->endcdata = NULL;
+  else if (c->startcdata) {
+    c->startcdata = text_StartCdata;
+    c->endcdata = text_EndCdata;
+  }
+}
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Budgets
+** 'parser:parse' and 'parser:resume' may be given a number of events
+** and a time to spend. The budget handlers count the content events in
+** front of the other handlers and, once the budget is spent, suspend
+** Expat (a resumable XML_StopParser); the rest of the input stays in
+** Expat's buffer until 'parser:resume'.
+** =======================================================
+*/
+
+static void spend (lxp_userdata *xpu) {
+  lxp_budget *bg = &xpu->budget;
+  XML_ParsingStatus ps;
+  if (bg->spent || stopped(xpu))
+    return;
+  if (bg->events == 0 || --bg->events > 0) {  /* events left? */
+    if (bg->deadline == 0 || --bg->tick > 0)
+      return;
+    bg->tick = BUDGET_TICK;
+    if (clocktime() < bg->deadline)
+      return;  /* time left */
+  }
+  XML_GetParsingStatus(xpu->parser, &ps);
+  if (ps.parsing != XML_PARSING)
+    return;  /* already stopped or suspended */
+  bg->spent = 1;
+  XML_StopParser(xpu->parser, XML_TRUE);
+}
+
+
+static void budget_StartElement (void *ud, const char *name,
+                                           const char **attrs) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  if (xpu->budget.h.start != NULL)
+    xpu->budget.h.start(ud, name, attrs);
+  else
+    XML_DefaultCurrent(xpu->parser);
+  spend(xpu);
+}
+
+
+static void budget_EndElement (void *ud, const char *name) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  if (xpu->budget.h.end != NULL)
+    xpu->budget.h.end(ud, name);
+  else
+    XML_DefaultCurrent(xpu->parser);
+  spend(xpu);
+}
+
+
+static void budget_CharData (void *ud, const char *s, int len) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  if (xpu->budget.h.text != NULL)
+    xpu->budget.h.text(ud, s, len);
+  else
+    XML_DefaultCurrent(xpu->parser);
+  spend(xpu);
+}
+
+
+static void budget_Comment (void *ud, const char *data) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  if (xpu->budget.h.comment != NULL)
+    xpu->budget.h.comment(ud, data);
+  else
+    XML_DefaultCurrent(xpu->parser);
+  spend(xpu);
+}
+
+
+static void budget_ProcessingInstruction (void *ud, const char *target,
+                                                    const char *data) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  if (xpu->budget.h.pi != NULL)
+    xpu->budget.h.pi(ud, target, data);
+  else
+    XML_DefaultCurrent(xpu->parser);
+  spend(xpu);
+}
+
+
+static void budget_StartCdata (void *ud) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  if (xpu->budget.h.startcdata != NULL)
+    xpu->budget.h.startcdata(ud);
+  else
+    XML_DefaultCurrent(xpu->parser);
+  spend(xpu);
+}
+
+
+static void budget_EndCdata (void *ud) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  if (xpu->budget.h.endcdata != NULL)
+    xpu->budget.h.endcdata(ud);
+  else
+    XML_DefaultCurrent(xpu->parser);
+  spend(xpu);
+}
+
+
+/*
+** Put the budget handlers in front of the content handlers 'c'. Elements
+** are always counted, even without handlers, so that a budget bounds
+** any parse call.
+*/
+static void budgetcontent (lxp_userdata *xpu, lxp_content *c) {
+  xpu->budget.h = *c;
+  c->start = budget_StartElement;
+  c->end = budget_EndElement;
+  if (c->text) c->text = budget_CharData;
+  if (c->comment) c->comment = budget_Comment;
+  if (c->pi) c->pi = budget_ProcessingInstruction;
+  if (c->startcdata) {
+    c->startcdata = budget_StartCdata;
+    c->endcdata = budget_EndCdata;
+  }
+}
+
+
+/*
+** Read the budget table at index 'idx' ({max_events = n,
+** max_time_us = n}, either or both) for the next parse call
+*/
+static void setbudget (lua_State *L, lxp_userdata *xpu, int idx) {
+  lxp_budget *bg = &xpu->budget;
+  bg->events = 0;
+  bg->deadline = 0;
+  if (lua_isnoneornil(L, idx))
+    return;
+  luaL_checktype(L, idx, LUA_TTABLE);
+  lua_getfield(L, idx, "max_events");
+  if (!lua_isnil(L, -1)) {
+    lua_Integer n = lua_tointeger(L, -1);
+    if (!lua_isnumber(L, -1) || n < 1)
+      luaL_error(L, "budget 'max_events' must be a positive number");
+    bg->events = (long)n;
+  }
+  lua_getfield(L, idx, "max_time_us");
+  if (!lua_isnil(L, -1)) {
+    lua_Number n = lua_tonumber(L, -1);
+    if (!lua_isnumber(L, -1) || n <= 0)
+      luaL_error(L, "budget 'max_time_us' must be a positive number");
+    bg->deadline = clocktime() + n * 1e-6;
+    bg->tick = 1;  /* the first event reads the clock */
+  }
+  lua_pop(L, 2);
+}
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Recording
+** After 'parser:record', handlers in front of the content handlers
+** write the events delivered to a recording, which 'lxp.replay' turns
+** back into callback calls without parsing. A recording has a header
+** (RECORD_MAGIC, RECORD_VERSION, and the namespace separator or '\0')
+** followed by events, each one a code ('XPRecord') and its fields:
+**   XPRstart: name, specified count, attribute count, names/values
+**   XPRendelement: name; XPRtext: text; XPRcomment: text
+**   XPRpi: target name, data; XPRstartcdata, XPRendcdata: none
+** and ends with XPRend. Numbers are varints (LEB128), strings a varint
+** length and the bytes. A name is a varint id: 0 for a new name, which
+** follows as a string and takes the next id. Character data is
+** recorded merged.
+** =======================================================
+*/
+
+
+static size_t varintsize (size_t v) {
+  size_t n = 1;
+  while (v >= 0x80) {
+    v >>= 7;
+    n++;
+  }
+  return n;
+}
+
+
+static char *putvarint (char *p, size_t v) {
+  while (v >= 0x80) {
+    *p++ = (char)((v & 0x7F) | 0x80);
+    v >>= 7;
+  }
+  *p++ = (char)v;
+  return p;
+}
+
+
+static char *putstring (char *p, const char *s, size_t len) {
+  p = putvarint(p, len);
+  memcpy(p, s, len);
+  return p + len;
+}
+
+
+/*
+** Memory ran out: the recording is lost, and the parse fails
+*/
+static void recordfail (lxp_userdata *xpu) {
+  xpu->record->failed = 1;
+  if (xpu->state == XPSok || xpu->state == XPSstring) {
+    lua_pushliteral(xpu->L, "not enough memory");
+    xpu->state = XPSerror;
+    xpu->errorref = luaL_ref(xpu->L, LUA_REGISTRYINDEX);
+  }
+}
+
+
+/*
+** Room for 'n' more bytes in the recording, NULL if it failed
+*/
+static char *recordspace (lxp_userdata *xpu, size_t n) {
+  lxp_recorder *r = xpu->record;
+  if (r->failed)
+    return NULL;
+  if (n > r->size - r->len) {
+    size_t size = r->size;
+    char *buf;
+    while (size - r->len < n) size *= 2;
+    buf = (char *)realloc(r->buf, size);
+    if (buf == NULL) {
+      recordfail(xpu);
+      return NULL;
+    }
+    r->buf = buf;
+    r->size = size;
+  }
+  return r->buf + r->len;
+}
+
+
+static void reccode (lxp_userdata *xpu, enum XPRecord code) {
+  char *p = recordspace(xpu, 1);
+  if (p == NULL) return;
+  *p = (char)code;
+  xpu->record->len++;
+}
+
+
+static void recnumber (lxp_userdata *xpu, size_t v) {
+  char *p = recordspace(xpu, varintsize(v));
+  if (p == NULL) return;
+  xpu->record->len = (size_t)(putvarint(p, v) - xpu->record->buf);
+}
+
+
+static void recstring (lxp_userdata *xpu, const char *s, size_t len) {
+  char *p = recordspace(xpu, varintsize(len) + len);
+  if (p == NULL) return;
+  xpu->record->len = (size_t)(putstring(p, s, len) - xpu->record->buf);
+}
+
+
+static void recname (lxp_userdata *xpu, const char *name) {
+  lxp_recorder *r = xpu->record;
+  unsigned int h = 2166136261u;  /* FNV-1a, as the name cache */
+  size_t len;
+  lxp_name *e;
+  for (len = 0; name[len] != '\0'; len++)
+    h = (h ^ (unsigned char)name[len]) * 16777619u;
+  e = findname(r->names, r->namessize, h, name, len);
+  if (e->slot != 0) {
+    recnumber(xpu, (size_t)e->slot);
+    return;
+  }
+  if ((r->nnames + 1) * 4 >= r->namessize * 3 &&
+      !grownames(&r->names, &r->namessize)) {
+    recordfail(xpu);
+    return;
+  }
+  e = findname(r->names, r->namessize, h, name, len);
+  if ((e->str = (char *)malloc(len + 1)) == NULL) {
+    recordfail(xpu);
+    return;
+  }
+  memcpy(e->str, name, len + 1);
+  e->hash = h;
+  e->len = len;
+  e->slot = ++r->nnames;
+  recnumber(xpu, 0);
+  recstring(xpu, name, len);
+}
+
+
+/*
+** Record the character data gathered, before any other event
+*/
+static void recordtext (lxp_userdata *xpu) {
+  lxp_recorder *r = xpu->record;
+  if (r->textlen > 0) {
+    reccode(xpu, XPRtext);
+    recstring(xpu, r->text, r->textlen);
+    r->textlen = 0;
+  }
+}
+
+
+static void resetrecord (lxp_recorder *r) {
+  clearnames(r->names, r->namessize);
+  r->nnames = 0;
+  r->len = RECORD_HEADER;
+  r->textlen = 0;
+  r->failed = r->ended = 0;
+}
+
+
+static void newrecord (lua_State *L, lxp_userdata *xpu) {
+  lxp_recorder *r = (lxp_recorder *)calloc(1, sizeof(lxp_recorder));
+  if (r == NULL)
+    luaL_error(L, "not enough memory");
+  xpu->record = r;  /* freed with the parser from now on */
+  r->size = 4096;
+  r->namessize = 64;
+  r->buf = (char *)malloc(r->size);
+  r->names = (lxp_name *)calloc(r->namessize, sizeof(lxp_name));
+  if (r->buf == NULL || r->names == NULL)
+    luaL_error(L, "not enough memory");
+  memcpy(r->buf, RECORD_MAGIC, 4);
+  r->buf[4] = RECORD_VERSION;
+  r->buf[5] = xpu->sep;
+  resetrecord(r);
+}
+
+
+static void record_StartElement (void *ud, const char *name,
+                                           const char **attrs) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  lxp_recorder *r = xpu->record;
+  int nattrs, i;
+  if (!stopped(xpu)) {
+    recordtext(xpu);
+    for (nattrs = 0; attrs[nattrs * 2] != NULL; nattrs++) ;
+    reccode(xpu, XPRstart);
+    recname(xpu, name);
+    recnumber(xpu, (size_t)(specifiedcount(xpu) / 2));
+    recnumber(xpu, (size_t)nattrs);
+    for (i = 0; i < nattrs * 2; i += 2) {
+      recname(xpu, attrs[i]);
+      recstring(xpu, attrs[i + 1], strlen(attrs[i + 1]));
+    }
+  }
+  if (r->h.start != NULL)
+    r->h.start(ud, name, attrs);
+  else
+    XML_DefaultCurrent(xpu->parser);
+}
+
+
+static void record_EndElement (void *ud, const char *name) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  if (!stopped(xpu)) {
+    recordtext(xpu);
+    reccode(xpu, XPRendelement);
+    recname(xpu, name);
+  }
+  if (xpu->record->h.end != NULL)
+    xpu->record->h.end(ud, name);
+  else
+    XML_DefaultCurrent(xpu->parser);
+}
+
+
+static void record_CharData (void *ud, const char *s, int len) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  lxp_recorder *r = xpu->record;
+  size_t n = (size_t)len;
+  if (n > r->textsize - r->textlen && !r->failed && !stopped(xpu)) {
+    size_t size = r->textsize ? r->textsize : 256;
+    char *text;
+    while (size - r->textlen < n) size *= 2;
+    text = (char *)realloc(r->text, size);
+    if (text == NULL)
+      recordfail(xpu);
+    else {
+      r->text = text;
+      r->textsize = size;
+    }
+  }
+  if (!r->failed && !stopped(xpu)) {
+    memcpy(r->text + r->textlen, s, n);
+    r->textlen += n;
+  }
+  if (r->h.text != NULL)
+    r->h.text(ud, s, len);
+  else
+    XML_DefaultCurrent(xpu->parser);
+}
+
+
+static void record_Comment (void *ud, const char *data) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  if (!stopped(xpu)) {
+    recordtext(xpu);
+    reccode(xpu, XPRcomment);
+    recstring(xpu, data, strlen(data));
+  }
+  if (xpu->record->h.comment != NULL)
+    xpu->record->h.comment(ud, data);
+  else
+    XML_DefaultCurrent(xpu->parser);
+}
+
+
+static void record_ProcessingInstruction (void *ud, const char *target,
+                                                    const char *data) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  if (!stopped(xpu)) {
+    recordtext(xpu);
+    reccode(xpu, XPRpi);
+    recname(xpu, target);
+    recstring(xpu, data, strlen(data));
+  }
+  if (xpu->record->h.pi != NULL)
+    xpu->record->h.pi(ud, target, data);
+  else
+    XML_DefaultCurrent(xpu->parser);
+}
+
+
+static void record_StartCdata (void *ud) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  if (!stopped(xpu)) {
+    recordtext(xpu);
+    reccode(xpu, XPRstartcdata);
+  }
+  if (xpu->record->h.startcdata != NULL)
+    xpu->record->h.startcdata(ud);
+  else
+    XML_DefaultCurrent(xpu->parser);
+}
+
+
+static void record_EndCdata (void *ud) {
+  lxp_userdata *xpu = (lxp_userdata *)ud;
+  if (!stopped(xpu)) {
+    recordtext(xpu);
+    reccode(xpu, XPRendcdata);
+  }
+  if (xpu->record->h.endcdata != NULL)
+    xpu->record->h.endcdata(ud);
+  else
+    XML_DefaultCurrent(xpu->parser);
+}
+
+
+/*
+** Put the recording handlers in front of the content handlers 'c'.
+** Every content event is recorded, with or without a handler, except
+** CDATA sections: they only split the text when they have handlers.
+*/
+static void recordcontent (lxp_userdata *xpu, lxp_content *c) {
+  xpu->record->h = *c;
+  c->start = record_StartElement;
+  c->end = record_EndElement;
+  c->text = record_CharData;
+  c->comment = record_Comment;
+  c->pi = record_ProcessingInstruction;
+  if (c->startcdata != NULL || c->endcdata != NULL) {
+    c->startcdata = record_StartCdata;
+    c->endcdata = record_EndCdata;
+  }
+}
+/* }====================================================== */
+
+
+
+
+static int hasfield (lua_State *L, const char *fname) {
+  int res;
+  lua_pushstring(L, fname);
+  lua_gettable(L, 1);
+  res = !lua_isnil(L, -1);
+  lua_pop(L, 1);
+  return res;
+}
+
+
+/*
+** Callbacks are checked for typos, besides the 'threat' entry that
+** 'lxp.threat' leaves in the table it gives to a parser with limits
+*/
+static void checkcallbacks (lua_State *L, int haslimits) {
+  static const char *const validkeys[] = {
+    "StartCdataSection", "EndCdataSection", "CharacterData", "Comment",
+    "Default", "DefaultExpand", "StartElement", "EndElement",
+    "ExternalEntityRef", "StartNamespaceDecl", "EndNamespaceDecl",
+    "NotationDecl", "NotStandalone", "ProcessingInstruction",
+    "UnparsedEntityDecl", "EntityDecl", "StartDoctypeDecl", "EndDoctypeDecl",
+    "XmlDecl", "AttlistDecl", "SkippedEntity", "ElementDecl", "Batch", NULL};
+  if (hasfield(L, "_nonstrict")) return;
+  lua_pushnil(L);
+  while (lua_next(L, 1)) {
+    lua_pop(L, 1);  /* remove value */
+    if (haslimits && lua_type(L, -1) == LUA_TSTRING &&
+        strcmp(lua_tostring(L, -1), "threat") == 0)
+      continue;
+#if ! defined (LUA_VERSION_NUM) || LUA_VERSION_NUM < 501
+    if (lua_type(L, -1) != LUA_TSTRING ||
+        luaL_findstring(lua_tostring(L, -1), validkeys) < 0)
+      luaL_error(L, "invalid key `%s' in callback table", lua_tostring(L, -1));
+#else
+    luaL_checkoption(L, -1, NULL, validkeys);
+#endif
+  }
+}
+
+
+/*
+** Read the limits table on top of the stack; sizes are given as numbers,
+** an absent (or false) limit is not checked. The table is read again on
+** each parse call, so limits can be changed between chunks.
+*/
+static void checklimits (lua_State *L, lxp_userdata *xpu) {
+  int i;
+  for (i = 0; i < XPLn; i++) {
+    lua_getfield(L, -1, limitnames[i]);
+    if (lua_type(L, -1) == LUA_TNUMBER)
+      xpu->limits[i] = (long)lua_tointeger(L, -1);
+    else if (lua_toboolean(L, -1))
+      luaL_error(L, "invalid limit '%s' (a number expected)", limitnames[i]);
+    else
+      xpu->limits[i] = -1;
+    lua_pop(L, 1);
+  }
+  lua_getfield(L, -1, "allowDTD");
+  xpu->allowDTD = lua_isnil(L, -1) || lua_toboolean(L, -1);
+  lua_pop(L, 1);
+  xpu->haslimits = 1;
+}
+
+
+/*
+** The 'index' option (on top) is true, to index every attribute, or a
+** list of the names of the attributes to index
+*/
+static void checkindex (lua_State *L, lxp_userdata *xpu) {
+  if (xpu->tree == XPTnone)
+    luaL_error(L, "option 'index' requires a tree builder");
+  if (xpu->treerecord)
+    luaL_error(L, "option 'index' cannot be used with 'torecord'");
+  if (lua_type(L, -1) == LUA_TTABLE) {
+    int i, n = (int)lua_rawlen(L, -1);
+    lua_createtable(L, n, 0);  /* a copy, read again by each new tree */
+    for (i = 1; i <= n; i++) {
+      lua_rawgeti(L, -2, i);
+      if (lua_type(L, -1) != LUA_TSTRING)
+        luaL_error(L, "option 'index' must list attribute names");
+      lua_rawseti(L, -2, i);
+    }
+    xpu->indexref = luaL_ref(L, LUA_REGISTRYINDEX);
+    xpu->treeindex = XPInames;
+  }
+  else if (lua_type(L, -1) == LUA_TBOOLEAN)
+    xpu->treeindex = XPIall;
+  else
+    luaL_error(L, "option 'index' must be a boolean or a list of names");
+}
+
+
+/*
+** The third argument of 'lxp.new' is either the 'merge_character_data'
+** boolean or a table of parser options
+*/
+static void checkoptions (lua_State *L, lxp_userdata *xpu) {
+  static const char *const trees[] = {"none", "lom", "totable",
+                                        "compact", NULL};
+  static const char *const protects[] = {"event", "parse", NULL};
+  if (lua_type(L, 3) != LUA_TTABLE) {
+    xpu->bufferCharData = (lua_type(L, 3) != LUA_TBOOLEAN) || (lua_toboolean(L, 3) != 0);
+    xpu->namecache = 1;
+    return;
+  }
+  lua_getfield(L, 3, "merge_character_data");
+  xpu->bufferCharData = lua_isnil(L, -1) || lua_toboolean(L, -1);
+  lua_getfield(L, 3, "tree");
+  if (!lua_isnil(L, -1)) {
+    int i;
+    const char *name = luaL_checkstring(L, -1);
+    for (i = 0; trees[i] && strcmp(trees[i], name) != 0; i++) ;
+    if (trees[i] == NULL)
+      luaL_error(L, "invalid tree builder '%s'", name);
+    xpu->tree = (enum XPTree)i;
+  }
+  lua_getfield(L, 3, "clean");
+  xpu->treeclean = lua_toboolean(L, -1);
+  lua_getfield(L, 3, "torecord");
+  xpu->treerecord = lua_toboolean(L, -1);
+  if (xpu->treerecord && xpu->tree != XPTtotable)
+    luaL_error(L, "option 'torecord' requires the 'totable' tree builder");
+  lua_getfield(L, 3, "index");
+  if (lua_toboolean(L, -1))
+    checkindex(L, xpu);
+  lua_getfield(L, 3, "limits");
+  if (!lua_isnil(L, -1)) {
+    luaL_checktype(L, -1, LUA_TTABLE);
+    checklimits(L, xpu);
+    lua_pushvalue(L, -1);
+    xpu->limitsref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  lua_getfield(L, 3, "namecache");
+  xpu->namecache = lua_isnil(L, -1) || lua_toboolean(L, -1);
+  lua_getfield(L, 3, "batch");
+  if (!lua_isnil(L, -1)) {
+    xpu->batch = (int)luaL_checkinteger(L, -1);
+    if (xpu->batch < 1)
+      luaL_error(L, "option 'batch' must be a positive number");
+    if (xpu->tree != XPTnone)
+      luaL_error(L, "option 'batch' cannot be used with a tree builder");
+  }
+  lua_getfield(L, 3, "attributes");
+  if (!lua_isnil(L, -1)) {
+    const char *mode = luaL_checkstring(L, -1);
+    if (strcmp(mode, "proxy") == 0)
+      createproxy(L, xpu);
+    else if (strcmp(mode, "table") != 0)
+      luaL_error(L, "invalid attributes mode '%s'", mode);
+  }
+  lua_getfield(L, 3, "memlimit");
+  if (!lua_isnil(L, -1)) {
+    lua_Integer limit = luaL_checkinteger(L, -1);
+    if (limit < 1)
+      luaL_error(L, "option 'memlimit' must be a positive number");
+    xpu->memory.limit = (size_t)limit;
+  }
+  lua_getfield(L, 3, "allocator");
+  if (!lua_isnil(L, -1)) {
+    const char *name = luaL_checkstring(L, -1);
+    if (strcmp(name, "lua") == 0)
+      xpu->memory.allocf = lua_getallocf(L, &xpu->memory.ud);
+    else if (strcmp(name, "arena") == 0)
+      xpu->memory.arena = 1;
+    else if (strcmp(name, "malloc") != 0)
+      luaL_error(L, "invalid allocator '%s'", name);
+  }
+  lua_getfield(L, 3, "stats");
+  if (lua_toboolean(L, -1)) {
+    xpu->stats = (lxp_stats *)calloc(1, sizeof(lxp_stats));
+    if (xpu->stats == NULL)
+      luaL_error(L, "not enough memory");
+  }
+  lua_getfield(L, 3, "filter");
+  if (!lua_isnil(L, -1))
+    checkfilter(L, xpu);
+  lua_getfield(L, 3, "splitnames");
+  xpu->splitnames = lua_toboolean(L, -1);
+  if (xpu->splitnames && xpu->sep == '\0')
+    luaL_error(L, "option 'splitnames' requires a namespace separator");
+  if (xpu->splitnames && (xpu->tree != XPTnone || xpu->batch))
+    luaL_error(L, "option 'splitnames' cannot be used with a tree builder "
+                  "or batches");
+  lua_getfield(L, 3, "protect");
+  if (!lua_isnil(L, -1)) {
+    int i;
+    const char *mode = luaL_checkstring(L, -1);
+    for (i = 0; protects[i] && strcmp(protects[i], mode) != 0; i++) ;
+    if (protects[i] == NULL)
+      luaL_error(L, "invalid protect mode '%s'", mode);
+    xpu->protectparse = i;
+  }
+  lua_pop(L, 15);
+  checktextoptions(L, xpu);
+}
+
+
+/*
+** Add a handler to 'handlers' if there is a callback for it, or if the
+** limits need it ('forlimits')
+*/
+static void needhandler (lua_State *L, lxp_userdata *xpu, int handler,
+                         int forlimits, const char *key1, const char *key2) {
+  if (hasfield(L, key1) || (key2 && hasfield(L, key2)))
+    xpu->handlers |= handler;
+  else if (forlimits && xpu->haslimits) {
+    xpu->handlers |= handler;
+    xpu->passdefault |= handler;
+  }
+}
+
+
+/*
+** Put the layers tested by 'haslayers' in front of the handlers 'c' of
+** the callbacks: tree builder or blocks or batches (in place of them),
+** recording, text nodes, filter, budget
+*/
+static void addlayers (lxp_userdata *xpu, lxp_content *c) {
+  if (xpu->tree != XPTnone)
+    treecontent(xpu, c);
+  else if (xpu->block != NULL)
+    blockcontent(c);
+  else if (xpu->batch)
+    batchcontent(c);
+  if (xpu->record != NULL)
+    recordcontent(xpu, c);
+  if (xpu->text != NULL)
+    textcontent(xpu, c);
+  if (xpu->filter != NULL)
+    filtercontent(xpu, c);
+  if (xpu->budget.on)
+    budgetcontent(xpu, c);
+}
+
+
+/*
+** Set the content handlers
+*/
+static void setcontent (lxp_userdata *xpu) {
+  lxp_content c;
+  basecontent(xpu, &c);
+  xpu->budget.on = budgeted(xpu);
+  if (haslayers(xpu))
+    addlayers(xpu, &c);
+  applycontent(xpu->parser, &c);
+}
+
+
+/*
+** Register the Expat handlers of the parser (again after a reset, which
+** clears them)
+*/
+static void sethandlers (lxp_userdata *xpu) {
+  XML_Parser p = xpu->parser;
+  int h = xpu->handlers;
+  XML_SetUserData(p, xpu);
+  setcontent(xpu);
+  if (h & XPHdefault)
+    XML_SetDefaultHandler(p, f_Default);
+  if (h & XPHdefaultexp)
+    XML_SetDefaultHandlerExpand(p, f_DefaultExpand);
+  if (h & XPHexternal)
+    XML_SetExternalEntityRefHandler(p, f_ExternaEntity);
+  if (h & XPHnamespace)
+    XML_SetNamespaceDeclHandler(p, f_StartNamespaceDecl, f_EndNamespaceDecl);
+  if (h & XPHnotation)
+    XML_SetNotationDeclHandler(p, f_NotationDecl);
+  if (h & XPHstandalone)
+    XML_SetNotStandaloneHandler(p, f_NotStandalone);
+  if (h & XPHunparsed)
+    XML_SetUnparsedEntityDeclHandler(p, f_UnparsedEntityDecl);
+  if (h & XPHentity)
+    XML_SetEntityDeclHandler(p, f_EntityDecl);
+  if (h & XPHattlist)
+    XML_SetAttlistDeclHandler(p, f_AttlistDecl);
+  if (h & XPHskipped)
+    XML_SetSkippedEntityHandler(p, f_SkippedEntity);
+  if (h & XPHstartdoctype)
+    XML_SetStartDoctypeDeclHandler(p, f_StartDoctypeDecl);
+  if (h & XPHenddoctype)
+    XML_SetEndDoctypeDeclHandler(p, f_EndDoctypeDecl);
+  if (h & XPHxmldecl)
+    XML_SetXmlDeclHandler(p, f_XmlDecl);
+  if (h & XPHelementdecl)
+    XML_SetElementDeclHandler(p, f_ElementDecl);
+}
+
+
+/*
+** Create the Expat parser of 'xpu', which allocates through 'memsuite'
+*/
+static XML_Parser newexpat (lxp_userdata *xpu, const char *encoding) {
+  XML_Char nssep[2];
+  nssep[0] = xpu->sep;
+  nssep[1] = '\0';
+  usememory(xpu);
+  return XML_ParserCreate_MM(encoding, &memsuite,
+                             (xpu->sep == '\0') ? NULL : nssep);
+}
+
+
+static int lxp_make_parser (lua_State *L) {
+  XML_Parser p;
+  char sep = *luaL_optstring(L, 2, "");
+  lxp_userdata *xpu = createlxp(L);
+  xpu->sep = sep;
+  checkoptions(L, xpu);
+  p = xpu->parser = newexpat(xpu, NULL);
+  if (!p)
+    luaL_error(L, xpu->memory.exceeded ? "memory limit exceeded"
+                                       : "XML_ParserCreate failed");
+  luaL_checktype(L, 1, LUA_TTABLE);
+  checkcallbacks(L, xpu->haslimits);
+  lua_pushvalue(L, 1);
+  lua_setuservalue(L, -2);
+  needhandler(L, xpu, XPHcdata, 0, StartCdataKey, EndCdataKey);
+  needhandler(L, xpu, XPHchardata, 1, CharDataKey, NULL);
+  needhandler(L, xpu, XPHcomment, 1, CommentKey, NULL);
+  needhandler(L, xpu, XPHdefault, 0, DefaultKey, NULL);
+  needhandler(L, xpu, XPHdefaultexp, 0, DefaultExpandKey, NULL);
+  needhandler(L, xpu, XPHelement, 1, StartElementKey, EndElementKey);
+  needhandler(L, xpu, XPHexternal, 0, ExternalEntityKey, NULL);
+  needhandler(L, xpu, XPHnamespace, 1, StartNamespaceDeclKey,
+                                       EndNamespaceDeclKey);
+  needhandler(L, xpu, XPHnotation, 0, NotationDeclKey, NULL);
+  needhandler(L, xpu, XPHstandalone, 0, NotStandaloneKey, NULL);
+  needhandler(L, xpu, XPHpi, 1, ProcessingInstructionKey, NULL);
+  needhandler(L, xpu, XPHunparsed, 0, UnparsedEntityDeclKey, NULL);
+  needhandler(L, xpu, XPHentity, 1, EntityDeclKey, NULL);
+  needhandler(L, xpu, XPHattlist, 1, AttlistDeclKey, NULL);
+  needhandler(L, xpu, XPHskipped, 0, SkippedEntityKey, NULL);
+  needhandler(L, xpu, XPHstartdoctype, 1, StartDoctypeDeclKey, NULL);
+  needhandler(L, xpu, XPHenddoctype, 0, EndDoctypeDeclKey, NULL);
+  needhandler(L, xpu, XPHxmldecl, 0, XmlDeclKey, NULL);
+  needhandler(L, xpu, XPHelementdecl, 1, ElementDeclKey, NULL);
+  if (xpu->tree != XPTnone || xpu->haslimits)
+    initlevels(L, xpu);
+  if (xpu->tree != XPTnone) {
+    xpu->bufferCharData = 1;
+    newtree(L, xpu);
+  }
+  else if (xpu->batch) {
+    if (!hasfield(L, BatchKey))
+      luaL_error(L, "option 'batch' requires a '%s' callback", BatchKey);
+    xpu->bufferCharData = 1;
+    newbatch(L, xpu);
+  }
+  sethandlers(xpu);
+  return 1;
+}
+
+
+static lxp_userdata *checkparser (lua_State *L, int idx) {
+  lxp_userdata *xpu = (lxp_userdata *)luaL_checkudata(L, idx, ParserType);
+  luaL_argcheck(L, xpu, idx, "expat parser expected");
+  luaL_argcheck(L, xpu->parser, idx, "parser is closed");
+  return xpu;
+}
+
+
+static int parser_gc (lua_State *L) {
+  lxp_userdata *xpu = (lxp_userdata *)luaL_checkudata(L, 1, ParserType);
+  luaL_argcheck(L, xpu, 1, "expat parser expected");
+  lxpclose(L, xpu);
+  return 0;
+}
+
+
+static int setbase (lua_State *L) {
+  lxp_userdata *xpu = checkparser(L, 1);
+  usememory(xpu);
+  if (XML_SetBase(xpu->parser, luaL_checkstring(L, 2)) == 0)
+    luaL_error(L, "no memory to store base");
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+static int getbase (lua_State *L) {
+  lxp_userdata *xpu = checkparser(L, 1);
+  lua_pushstring(L, XML_GetBase(xpu->parser));
+  return 1;
+}
+
+
+static int getcallbacks (lua_State *L) {
+  checkparser(L, 1);
+  lua_getuservalue(L, 1);
+  return 1;
+}
+
+
+/*
+** Push the dispatch table of the parser at index 1, after looking up
+** each callback once in its callbacks table (so events index an array
+** instead of hashing the callback name)
+*/
+static void pushdispatch (lua_State *L, lxp_userdata *xpu) {
+  int ev;
+  if (xpu->dispatchref == LUA_REFNIL) {
+    lua_createtable(L, XPEn - 1, 0);
+    lua_pushvalue(L, -1);
+    xpu->dispatchref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  else
+    lua_rawgeti(L, LUA_REGISTRYINDEX, xpu->dispatchref);
+  lua_getuservalue(L, 1);
+  for (ev = 1; ev < XPEn; ev++) {
+    lua_pushstring(L, eventkeys[ev]);
+    lua_gettable(L, -2);
+    lua_rawseti(L, -3, ev);
+  }
+  lua_pop(L, 1);
+}
+
+
+/*
+** Return the hits and misses of the name cache, and the number of
+** cached names
+*/
+static int lxp_namecache (lua_State *L) {
+  lxp_userdata *xpu = checkparser(L, 1);
+  lua_pushnumber(L, (lua_Number)xpu->namehits);
+  lua_pushnumber(L, (lua_Number)xpu->namemisses);
+  lua_pushinteger(L, xpu->nnames);
+  return 3;
+}
+
+
+/*
+** Callbacks are looked up at the start of each parse call; changes made
+** to the callbacks table during a parse (by a callback) only take effect
+** after calling this method
+*/
+static int lxp_refreshcallbacks (lua_State *L) {
+  lxp_userdata *xpu = checkparser(L, 1);
+  pushdispatch(L, xpu);
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+/*
+** Return the root element built by a tree builder (nil if the root has
+** not been started yet)
+*/
+static int lxp_gettree (lua_State *L) {
+  lxp_userdata *xpu = checkparser(L, 1);
+  luaL_argcheck(L, xpu->tree != XPTnone, 1, "parser has no tree builder");
+  lua_rawgeti(L, LUA_REGISTRYINDEX, xpu->treeref);
+  if (xpu->tree == XPTcompact) {
+    if (xpu->state == XPSfinished)
+      trimdom((lxp_dom *)lua_touserdata(L, -1));
+    pushdomroot(L);
+    return 1;
+  }
+  lua_rawgeti(L, -1, 1);
+  lua_rawgeti(L, -1, 1);
+  if (lua_isnil(L, -1) && xpu->depth > 1) {  /* root still open */
+    lua_pop(L, 1);
+    lua_rawgeti(L, -2, 2);
+  }
+  return 1;
+}
+
+
+/*
+** Return the index of a table tree built with the 'index' option (nil
+** without it, and for compact trees, which are indexed through their
+** nodes)
+*/
+static int lxp_getindex (lua_State *L) {
+  lxp_userdata *xpu = checkparser(L, 1);
+  luaL_argcheck(L, xpu->tree != XPTnone, 1, "parser has no tree builder");
+  if (xpu->treeindex == XPInone || xpu->tree == XPTcompact)
+    return 0;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, xpu->treeref);
+  lua_getfield(L, -1, "index");
+  return 1;
+}
+
+
+/* how 'parse_aux' feeds the parser */
+enum XPFeed {
+  XPFstring,  /* 's' and 'len' ('s' NULL for the end of the document) */
+  XPFbuffer,  /* 'len' bytes read into XML_GetBuffer (0 for the end) */
+  XPFresume   /* resume a suspended parser */
+};
+
+
+/* a call to Expat by 'parse_aux' */
+typedef struct lxp_feeding {
+  const char *s;
+  size_t len;
+  enum XPFeed feed;
+  int final;
+  int status;  /* result of the call */
+} lxp_feeding;
+
+
+/*
+** Call Expat, and then deliver the text and the batch still pending
+*/
+static void feedexpat (lxp_userdata *xpu, lxp_feeding *f) {
+  switch (f->feed) {
+    case XPFstring:
+      f->status = XML_Parse(xpu->parser, f->s, (int)f->len, f->final);
+      break;
+    case XPFbuffer:
+      f->status = XML_ParseBuffer(xpu->parser, (int)f->len, f->final);
+      break;
+    default:
+      f->status = XML_ResumeParser(xpu->parser);
+      break;
+  }
+  if (xpu->state == XPSstring) dischargestring(xpu);
+  if (xpu->batchn > 0 && xpu->state == XPSok && !xpu->pull) flushbatch(xpu);
+}
+
+
+/*
+** 'feedexpat' as the protected region of a parse call: it gets the stack
+** of 'parse_aux' (parser, string, callbacks, DISPATCH...) as arguments,
+** so the handlers find it at the same indices
+*/
+static int protectedfeed (lua_State *L) {
+  lxp_userdata *xpu = (lxp_userdata *)lua_touserdata(L, 1);
+  feedexpat(xpu, xpu->feeding);
+  return 0;
+}
+
+
+/*
+** Feed Expat in a single protected call. An error raised by a handler
+** leaves Expat in the middle of the input; the parser is stopped and
+** finished, then the error is raised again, as for an error in a
+** callback.
+*/
+static void feedprotected (lua_State *L, lxp_userdata *xpu,
+                                         lxp_feeding *f) {
+  int top = lua_gettop(L);
+  int i;
+  lua_pushcfunction(L, protectedfeed);
+  for (i = 1; i <= top; i++)
+    lua_pushvalue(L, i);
+  xpu->feeding = f;
+  if (lua_pcall(L, top, 0, 0) != 0) {
+    usememory(xpu);
+    xpu->feeding = NULL;
+    XML_StopParser(xpu->parser, XML_FALSE);
+    xpu->state = XPSfinished;
+    lua_error(L);
+  }
+  xpu->feeding = NULL;
+}
+
+
+static int parse_aux (lua_State *L, lxp_userdata *xpu, const char *s,
+                      size_t len, enum XPFeed feed) {
+  luaL_Buffer b;
+  lxp_feeding f;
+  int status, finished;
+  int final = (feed == XPFbuffer) ? (len == 0) : (s == NULL);
+  xpu->L = L;
+  if (xpu->state == XPSlimit)  /* a limit was breached before? */
+    return reportlimit(xpu);
+  if (xpu->haslimits) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, xpu->limitsref);
+    checklimits(L, xpu);
+    lua_pop(L, 1);
+    xpu->bytes += (long)len;
+    if (overlimit(xpu, XPLdocument, xpu->bytes)) {
+      lua_pushnil(L);
+      lua_pushliteral(L, "document too large");
+      return 2;
+    }
+  }
+  xpu->state = XPSok;
+  xpu->b = &b;
+  lua_settop(L, 2);
+  getcallbacks(L);
+  if (feed == XPFresume)  /* same callbacks as when it was suspended */
+    lua_rawgeti(L, LUA_REGISTRYINDEX, xpu->dispatchref);  /* at DISPATCH */
+  else
+    pushdispatch(L, xpu);  /* at DISPATCH */
+  if (xpu->namecache && xpu->names == NULL)
+    initnames(L, xpu);
+  if (xpu->names != NULL)
+    lua_rawgeti(L, LUA_REGISTRYINDEX, xpu->namesref);  /* at NAMES */
+  else
+    lua_pushnil(L);
+  if (xpu->tree != XPTnone) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, xpu->treeref);  /* at TREESTACK */
+    if (xpu->treeindex != XPInone && xpu->tree != XPTcompact)
+      lua_getfield(L, TREESTACK, "index");  /* at TREEINDEX */
+  }
+  else if (xpu->batch)
+    lua_rawgeti(L, LUA_REGISTRYINDEX, xpu->batchref);  /* at BATCH */
+  if (xpu->budget.on != budgeted(xpu))  /* budget given or gone? */
+    setcontent(xpu);
+  xpu->budget.spent = 0;
+  usememory(xpu);
+  f.s = s;
+  f.len = len;
+  f.feed = feed;
+  f.final = final;
+  if (xpu->stats != NULL) {
+    double t = clocktime();
+    if (xpu->protectparse)
+      feedprotected(L, xpu, &f);
+    else
+      feedexpat(xpu, &f);
+    xpu->stats->parsetime += clocktime() - t;
+    xpu->stats->input += (double)len;
+  }
+  else if (xpu->protectparse)
+    feedprotected(L, xpu, &f);
+  else
+    feedexpat(xpu, &f);
+  status = f.status;
+  xpu->budget.events = 0;  /* a budget lasts a single call */
+  xpu->budget.deadline = 0;
+  if (xpu->state == XPSerror) {  /* callback error? */
+    lua_rawgeti(L, LUA_REGISTRYINDEX, xpu->errorref);  /* get original msg. */
+    lua_error(L);
+  }
+  if (xpu->state == XPSlimit)
+    return reportlimit(xpu);
+  if (status == XML_STATUS_SUSPENDED) {
+    lua_pushvalue(L, 1);
+    if (!xpu->budget.spent)
+      return 1;  /* suspended by an iterator */
+    lua_pushliteral(L, "suspended");
+    return 2;
+  }
+  if (feed == XPFresume) {
+    XML_ParsingStatus ps;
+    XML_GetParsingStatus(xpu->parser, &ps);
+    finished = ps.finalBuffer;
+  }
+  else
+    finished = final;
+  if (finished) xpu->state = XPSfinished;
+  if (xpu->haslimits && overlimit(xpu, XPLbuffer,
+                 xpu->bytes - (long)(XML_GetCurrentByteIndex(xpu->parser) + 1))) {
+    lua_pushnil(L);
+    lua_pushliteral(L, "unparsed buffer too large");
+    return 2;
+  }
+  if (status) {
+    lua_pushvalue(L, 1);  /* return parser userdata on success */
+    return 1;
+  }
+  else { /* error */
+    return reporterror(xpu);
+  }
+}
+
+
+static int lxp_parse (lua_State *L) {
+  lxp_userdata *xpu = checkparser(L, 1);
+  size_t len;
+  const char *s = luaL_optlstring(L, 2, NULL, &len);
+  if (xpu->state == XPSfinished) {
+    if (s != NULL) {
+      lua_pushnil(L);
+      lua_pushliteral(L, "cannot parse - document is finished");
+      return 2;
+    } else {
+      lua_settop(L, 1);
+      return 1;
+    }
+  }
+  if (xpu->budget.spent && suspended(xpu)) {
+    lua_pushnil(L);
+    lua_pushliteral(L, "cannot parse - parser is suspended");
+    return 2;
+  }
+  setbudget(L, xpu, 3);
+  return parse_aux(L, xpu, s, len, XPFstring);
+}
+
+
+/*
+** Continue a parse call suspended by its budget, from where it stopped
+*/
+static int lxp_resume (lua_State *L) {
+  lxp_userdata *xpu = checkparser(L, 1);
+  if (!xpu->budget.spent || xpu->state == XPSfinished || !suspended(xpu)) {
+    lua_pushnil(L);
+    lua_pushliteral(L, "cannot resume - parser is not suspended");
+    return 2;
+  }
+  setbudget(L, xpu, 2);
+  return parse_aux(L, xpu, NULL, 0, XPFresume);
+}
+
+
+/*
+** Close a file opened by 'parser:parsefile', also when an error is raised
+*/
+static int file_gc (lua_State *L) {
+  FILE **pf = (FILE **)luaL_checkudata(L, 1, FileType);
+  if (*pf != NULL) {
+    fclose(*pf);
+    *pf = NULL;
+  }
+  return 0;
+}
+
+
+/*
+** The FILE of the Lua file handle at 'idx', which must be open
+*/
+static FILE *tofile (lua_State *L, int idx) {
+#if (LUA_VERSION_NUM >= 502)
+  luaL_Stream *p = (luaL_Stream *)luaL_checkudata(L, idx, LUA_FILEHANDLE);
+  luaL_argcheck(L, p->closef != NULL, idx, "attempt to use a closed file");
+  return p->f;
+#else
+  FILE *f = *(FILE **)luaL_checkudata(L, idx, LUA_FILEHANDLE);
+  luaL_argcheck(L, f != NULL, idx, "attempt to use a closed file");
+  return f;
+#endif
+}
+
+
+/*
+** Parse a whole document from a file name, a Lua file, or a file
+** descriptor, reading it straight into Expat's buffer
+*/
+static int lxp_parsefile (lua_State *L) {
+  lxp_userdata *xpu = checkparser(L, 1);
+  int chunksize = (int)luaL_optinteger(L, 3, PARSEFILE_CHUNK);
+  FILE **pf = NULL;
+  FILE *f = NULL;
+  int fd = -1;
+  int n;
+  luaL_argcheck(L, chunksize > 0, 3, "chunk size must be positive");
+  if (xpu->state == XPSfinished) {
+    lua_pushnil(L);
+    lua_pushliteral(L, "cannot parse - document is finished");
+    return 2;
+  }
+  if (lua_type(L, 2) == LUA_TSTRING) {
+    const char *path = lua_tostring(L, 2);
+    pf = (FILE **)lua_newuserdata(L, sizeof(FILE *));
+    *pf = NULL;
+    luaL_getmetatable(L, FileType);
+    lua_setmetatable(L, -2);
+    *pf = f = fopen(path, "rb");
+    if (f == NULL) {
+      lua_pushnil(L);
+      lua_pushfstring(L, "%s: %s", path, strerror(errno));
+      return 2;
+    }
+    lua_replace(L, 2);  /* keep it while parsing */
+  }
+  else if (lua_type(L, 2) == LUA_TNUMBER)
+    fd = (int)lua_tointeger(L, 2);
+  else
+    f = tofile(L, 2);
+  xpu->L = L;
+  do {
+    void *buff;
+    long len;
+    usememory(xpu);
+    buff = XML_GetBuffer(xpu->parser, chunksize);
+    if (buff == NULL) {
+      n = reporterror(xpu);
+      break;
+    }
+    if (f != NULL) {
+      len = (long)fread(buff, 1, (size_t)chunksize, f);
+      if (len < chunksize && ferror(f)) len = -1;
+    }
+    else
+      len = (long)lxp_read(fd, buff, chunksize);
+    if (len < 0) {
+      lua_pushnil(L);
+      lua_pushstring(L, strerror(errno));
+      n = 2;
+      break;
+    }
+    lua_settop(L, 2);
+    n = parse_aux(L, xpu, NULL, (size_t)len, XPFbuffer);
+  } while (n == 1 && xpu->state != XPSfinished);
+  if (pf != NULL) {
+    fclose(*pf);
+    *pf = NULL;
+  }
+  return n;
+}
+
+
+/*
+** Get the next chunk from the source of 'parser:events' (upvalue 1), and
+** keep it as upvalue 2 while the parser may be suspended on it
+*/
+static const char *nextchunk (lua_State *L, size_t *len) {
+  const char *s;
+  lua_pushvalue(L, lua_upvalueindex(1));
+  if (lua_isfunction(L, -1)) {
+    lua_call(L, 0, 1);
+    if (!lua_isnil(L, -1) && lua_type(L, -1) != LUA_TSTRING)
+      luaL_error(L, "source function must return a string or nil");
+  }
+  else {  /* a string source is a single chunk */
+    lua_pushnil(L);
+    lua_replace(L, lua_upvalueindex(1));
+  }
+  lua_pushvalue(L, -1);
+  lua_replace(L, lua_upvalueindex(2));
+  s = lua_tolstring(L, -1, len);
+  lua_replace(L, 2);
+  return s;
+}
+
+
+/*
+** Let the parser of an iterator go on: resume it, or parse the next chunk
+** of the source. Returns 0 once the document is finished; errors are
+** raised
+*/
+static int pullmore (lua_State *L, lxp_userdata *xpu) {
+  int n;
+  if (xpu->state == XPSfinished)
+    return 0;
+  lua_settop(L, 2);
+  if (suspended(xpu))
+    n = parse_aux(L, xpu, NULL, 0, XPFresume);
+  else {
+    XML_ParsingStatus ps;
+    size_t len;
+    const char *s;
+    XML_GetParsingStatus(xpu->parser, &ps);
+    if (ps.parsing == XML_FINISHED) {  /* stopped by 'parser:stop' */
+      xpu->state = XPSfinished;
+      return 0;
+    }
+    s = nextchunk(L, &len);
+    n = parse_aux(L, xpu, s, len, XPFstring);
+  }
+  if (n > 1) {  /* error */
+    if (n == 5)
+      luaL_error(L, "%s (line %d, column %d, position %d)",
+                 lua_tostring(L, -4), (int)lua_tointeger(L, -3),
+                 (int)lua_tointeger(L, -2), (int)lua_tointeger(L, -1));
+    luaL_error(L, "%s", lua_tostring(L, -1));
+  }
+  return 1;
+}
+
+
+static int events_next (lua_State *L) {
+  lxp_userdata *xpu = checkparser(L, 1);
+  for (;;) {
+    if (xpu->pullpos < xpu->batchn) {
+      int i = xpu->pullpos++ * 3;
+      lua_rawgeti(L, LUA_REGISTRYINDEX, xpu->batchref);
+      lua_rawgeti(L, -1, i + 1);
+      lua_rawgeti(L, -2, i + 2);
+      lua_rawgeti(L, -3, i + 3);
+      return 3;
+    }
+    xpu->pullpos = xpu->batchn = 0;
+    if (!pullmore(L, xpu))
+      return 0;
+  }
+}
+
+
+/*
+** Hand out the first top-level element closed, dropping it from the tree
+*/
+static int trees_next (lua_State *L) {
+  lxp_userdata *xpu = checkparser(L, 1);
+  for (;;) {
+    int i, n;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, xpu->treeref);
+    lua_rawgeti(L, -1, 1);  /* container of the top-level elements */
+    n = (int)lua_rawlen(L, -1);
+    if (n > 0) {
+      lua_rawgeti(L, -1, 1);
+      for (i = 1; i < n; i++) {  /* usually none, the parser was suspended */
+        lua_rawgeti(L, -2, i + 1);
+        lua_rawseti(L, -3, i);
+      }
+      lua_pushnil(L);
+      lua_rawseti(L, -3, n);
+      return 1;
+    }
+    lua_pop(L, 2);
+    if (!pullmore(L, xpu))
+      return 0;
+  }
+}
+
+
+/*
+** Return an iterator over the events of the document read from 'source'
+** (a string, or a function returning the next chunk or nil at the end).
+** Expat is suspended after every 'group' events
+*/
+static int lxp_events (lua_State *L) {
+  lxp_userdata *xpu = checkparser(L, 1);
+  int group = (int)luaL_optinteger(L, 3, 1);
+  luaL_argcheck(L, lua_type(L, 2) == LUA_TSTRING || lua_isfunction(L, 2), 2,
+                "string or function expected");
+  luaL_argcheck(L, group >= 1, 3, "group size must be positive");
+  if (xpu->state != XPSpre || xpu->pull)
+    luaL_error(L, "cannot iterate - parser has already started");
+  if (xpu->tree != XPTnone || xpu->batch)
+    luaL_error(L, "cannot iterate - parser has a tree builder or batches");
+  if (xpu->splitnames)
+    luaL_error(L, "cannot iterate - parser splits names");
+  xpu->pull = 1;
+  xpu->batch = group;
+  newbatch(L, xpu);
+  sethandlers(xpu);
+  lua_settop(L, 2);
+  lua_pushnil(L);  /* current chunk */
+  lua_pushcclosure(L, events_next, 2);
+  lua_pushvalue(L, 1);
+  return 2;
+}
+
+
+/*
+** Hand out the next block: the events array, their number, and the arena,
+** as light userdata valid until the next call
+*/
+static int blocks_next (lua_State *L) {
+  lxp_userdata *xpu = checkparser(L, 1);
+  lxp_evblock *bk = xpu->block;
+  bk->n = 0;  /* the last block was read */
+  bk->len = 0;
+  do {
+    if (!pullmore(L, xpu))
+      return 0;
+  } while (bk->n == 0);
+  lua_pushlightuserdata(L, bk->events);
+  lua_pushinteger(L, bk->n);
+  lua_pushlightuserdata(L, bk->arena);
+  return 3;
+}
+
+
+/*
+** Return an iterator over the blocks of events of the document read from
+** 'source' (see 'parser:events'), of about 'size' events each
+*/
+static int lxp_blocks (lua_State *L) {
+  lxp_userdata *xpu = checkparser(L, 1);
+  int size = (int)luaL_optinteger(L, 3, 256);
+  luaL_argcheck(L, lua_type(L, 2) == LUA_TSTRING || lua_isfunction(L, 2), 2,
+                "string or function expected");
+  luaL_argcheck(L, size >= 1, 3, "block size must be positive");
+  if (xpu->state != XPSpre || xpu->pull)
+    luaL_error(L, "cannot iterate - parser has already started");
+  if (xpu->tree != XPTnone || xpu->batch)
+    luaL_error(L, "cannot iterate - parser has a tree builder or batches");
+  if (xpu->splitnames)
+    luaL_error(L, "cannot iterate - parser splits names");
+  newblock(L, xpu, size);
+  xpu->pull = 1;
+  sethandlers(xpu);
+  lua_settop(L, 2);
+  lua_pushnil(L);  /* current chunk */
+  lua_pushcclosure(L, blocks_next, 2);
+  lua_pushvalue(L, 1);
+  return 2;
+}
+
+
+/*
+** Return an iterator over the top-level elements built by the tree builder
+** from the document read from 'source' (see 'parser:events'): the root,
+** or with a filter each element matching its paths. Expat is suspended
+** after each one, so only one is kept at a time
+*/
+static int lxp_trees (lua_State *L) {
+  lxp_userdata *xpu = checkparser(L, 1);
+  luaL_argcheck(L, lua_type(L, 2) == LUA_TSTRING || lua_isfunction(L, 2), 2,
+                "string or function expected");
+  if (xpu->state != XPSpre || xpu->pull)
+    luaL_error(L, "cannot iterate - parser has already started");
+  if (xpu->tree == XPTnone)
+    luaL_error(L, "cannot iterate - parser has no tree builder");
+  if (xpu->tree == XPTcompact)
+    luaL_error(L, "cannot iterate - parser has a compact tree builder");
+  xpu->pull = 1;
+  lua_settop(L, 2);
+  lua_pushnil(L);  /* current chunk */
+  lua_pushcclosure(L, trees_next, 2);
+  lua_pushvalue(L, 1);
+  return 2;
+}
+
+
+/*
+** Record the events delivered from now on (see 'Recording')
+*/
+static int lxp_record (lua_State *L) {
+  lxp_userdata *xpu = checkparser(L, 1);
+  if (xpu->state != XPSpre || xpu->pull)
+    luaL_error(L, "cannot record - parser has already started");
+  if (xpu->record == NULL) {
+    newrecord(L, xpu);
+    sethandlers(xpu);
+  }
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+/*
+** Return the recording of a document parsed to its end
+*/
+static int lxp_gettape (lua_State *L) {
+  lxp_userdata *xpu = checkparser(L, 1);
+  lxp_recorder *r = xpu->record;
+  luaL_argcheck(L, r != NULL, 1, "parser is not recording");
+  if (xpu->state != XPSfinished ||
+      XML_GetErrorCode(xpu->parser) != XML_ERROR_NONE)
+    luaL_error(L, "cannot get tape - document is not finished");
+  if (!r->ended) {
+    recordtext(xpu);
+    reccode(xpu, XPRend);
+    r->ended = 1;
+  }
+  if (r->failed)
+    luaL_error(L, "not enough memory");
+  lua_pushlstring(L, r->buf, r->len);
+  return 1;
+}
+
+
+static int lxp_close (lua_State *L) {
+  int status = 1;
+  lxp_userdata *xpu = (lxp_userdata *)luaL_checkudata(L, 1, ParserType);
+  luaL_argcheck(L, xpu, 1, "expat parser expected");
+  if (xpu->state != XPSfinished) {
+    if (xpu->parser && suspended(xpu))  /* iteration left early? */
+      xpu->state = XPSfinished;
+    else
+      status = parse_aux(L, xpu, NULL, 0, XPFstring);
+  }
+  lxpclose(L, xpu);
+  if (status > 1) luaL_error(L, "error closing parser: %s",
+                                lua_tostring(L, -status+1));
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+/*
+** Make the parser ready for a new document (XML_ParserReset), keeping its
+** callbacks, options, and name cache. With an arena, the Expat parser is
+** freed with all of its memory at once and created again
+*/
+static int lxp_reset (lua_State *L) {
+  lxp_userdata *xpu = checkparser(L, 1);
+  const char *encoding = luaL_optstring(L, 2, NULL);
+  if (xpu->mem->arena) {
+    XML_ParserFree(xpu->parser);
+    freearena(xpu->mem);
+    xpu->parser = newexpat(xpu, encoding);
+    if (xpu->parser == NULL)
+      luaL_error(L, "cannot reset parser");
+  }
+  else {
+    usememory(xpu);
+    if (!XML_ParserReset(xpu->parser, encoding))
+      luaL_error(L, "cannot reset parser");
+  }
+  xpu->mem->exceeded = 0;
+  xpu->state = XPSpre;
+  luaL_unref(L, LUA_REGISTRYINDEX, xpu->errorref);
+  xpu->errorref = LUA_REFNIL;
+  if (xpu->pull) {  /* back to callbacks */
+    xpu->pull = 0;
+    xpu->batch = 0;
+    freeblock(xpu);
+  }
+  xpu->batchn = xpu->pullpos = 0;
+  if (xpu->levels != NULL)
+    resetlevels(xpu);
+  if (xpu->tree != XPTnone)
+    newtree(L, xpu);
+  if (xpu->filter != NULL)
+    resetfilter(xpu->filter);
+  if (xpu->text != NULL)
+    resettext(xpu->text);
+  if (xpu->record != NULL)
+    resetrecord(xpu->record);
+  xpu->bytes = 0;
+  xpu->limiterr = NULL;
+  xpu->budget.spent = 0;
+  sethandlers(xpu);
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+/*
+** Return the counters of a parser created with the 'stats' option (nil
+** otherwise), and clear them if 'clear' is true
+*/
+static int lxp_getstats (lua_State *L) {
+  lxp_userdata *xpu = checkparser(L, 1);
+  lxp_stats *st = xpu->stats;
+  int ev;
+  if (st == NULL) {
+    lua_pushnil(L);
+    return 1;
+  }
+  lua_createtable(L, 0, 6);
+  lua_newtable(L);
+  for (ev = 1; ev < XPEn; ev++) {
+    if (st->count[ev] == 0) continue;
+    lua_createtable(L, 0, 2);
+    lua_pushnumber(L, (lua_Number)st->count[ev]);
+    lua_setfield(L, -2, "count");
+    lua_pushnumber(L, (lua_Number)st->bytes[ev]);
+    lua_setfield(L, -2, "bytes");
+    lua_setfield(L, -2, eventkeys[ev]);
+  }
+  lua_setfield(L, -2, "events");
+  lua_pushnumber(L, (lua_Number)st->calls);
+  lua_setfield(L, -2, "calls");
+  lua_pushnumber(L, (lua_Number)st->flushes);
+  lua_setfield(L, -2, "flushes");
+  lua_pushnumber(L, (lua_Number)st->input);
+  lua_setfield(L, -2, "input");
+  lua_pushnumber(L, (lua_Number)st->parsetime);
+  lua_setfield(L, -2, "parse_time");
+  lua_pushnumber(L, (lua_Number)st->calltime);
+  lua_setfield(L, -2, "callback_time");
+  if (lua_toboolean(L, 2))
+    memset(st, 0, sizeof(lxp_stats));
+  return 1;
+}
+
+
+/*
+** Return the bytes currently allocated by Expat for the parser, and
+** their peak
+*/
+static int lxp_getmemory (lua_State *L) {
+  lxp_userdata *xpu = checkparser(L, 1);
+  lua_pushnumber(L, (lua_Number)xpu->mem->current);
+  lua_pushnumber(L, (lua_Number)xpu->mem->peak);
+  return 2;
+}
+
+
+static int lxp_pos (lua_State *L) {
+  lxp_userdata *xpu = checkparser(L, 1);
+  XML_Parser p = xpu->parser;
+  lua_pushinteger(L, XML_GetCurrentLineNumber(p));
+  lua_pushinteger(L, XML_GetCurrentColumnNumber(p) + 1);
+  lua_pushinteger(L, XML_GetCurrentByteIndex(p) + 1);
+  return 3;
+}
+
+
+static int lxp_setreturnnstriplet (lua_State *L) {
+  lxp_userdata *xpu = checkparser(L, 1);
+  luaL_argcheck(L, xpu->state == XPSpre, 1, "invalid parser state");
+  XML_SetReturnNSTriplet(xpu->parser, lua_toboolean(L, 2));
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+static int lxp_setencoding (lua_State *L) {
+  lxp_userdata *xpu = checkparser(L, 1);
+  const char *encoding = luaL_checkstring(L, 2);
+  luaL_argcheck(L, xpu->state == XPSpre, 1, "invalid parser state");
+  usememory(xpu);
+  XML_SetEncoding(xpu->parser, encoding);
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+static int lxp_stop (lua_State *L) {
+  lxp_userdata *xpu = checkparser(L, 1);
+  lua_pushboolean(L, XML_StopParser(xpu->parser, XML_FALSE) == XML_STATUS_OK);
+  return 1;
+}
+
+
+/* Billion Laughs Attack mitigation from Expat 2.4.0+ */
+#ifdef XML_DTD
+static int lxp_bla_maximum_amplification (lua_State *L) {
+  lxp_userdata *xpu = checkparser(L, 1);
+  if (! XML_SetBillionLaughsAttackProtectionMaximumAmplification(xpu->parser, luaL_checknumber(L, 2))) {
+    lua_pushnil(L);
+    lua_pushliteral(L, "failed to set BLA maximum amplification");
+    return 2;
+  }
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+static int lxp_bla_activation_threshold (lua_State *L) {
+  lxp_userdata *xpu = checkparser(L, 1);
+  if (! XML_SetBillionLaughsAttackProtectionActivationThreshold(xpu->parser, luaL_checkinteger(L, 2))) {
+    lua_pushnil(L);
+    lua_pushliteral(L, "failed to set BLA activation threshold");
+    return 2;
+  }
+  lua_settop(L, 1);
+  return 1;
+}
+#endif
+
+
+/*
+** {======================================================
+** Writer
+** Serializes trees in the LOM ('tag', 'attr', children) and in the
+** totable ([0], string keys, children) formats. The output is built in
+** a userdata kept on the stack, so it is collected if an error is
+** raised midway; when writing to a file, it is flushed whenever it
+** fills up. Text is scanned a word at a time for the characters which
+** must be escaped, and the clean runs are copied in bulk.
+** =======================================================
+*/
+
+#define WRITER_CHUNK	16384  /* initial (and, for files, fixed) buffer size */
+#define WRITER_MAXDEPTH	10000
+
+typedef struct lxp_writer {
+  lua_State *L;
+  char *buf;
+  size_t len;
+  size_t size;
+  int bufidx;  /* stack index of the userdata holding 'buf' */
+  FILE *f;  /* NULL when building a string */
+  const char *indent;  /* NULL when not indenting */
+  size_t indentlen;
+  int depth;
+} lxp_writer;
+
+
+static void wflush (lxp_writer *w, const char *s, size_t n) {
+  if (n > 0 && fwrite(s, 1, n, w->f) != n)
+    luaL_error(w->L, "cannot write: %s", strerror(errno));
+}
+
+
+static void wadd (lxp_writer *w, const char *s, size_t n) {
+  if (w->size - w->len < n) {
+    if (w->f != NULL) {
+      wflush(w, w->buf, w->len);
+      w->len = 0;
+      if (n > w->size) {  /* too large to be staged: write it through */
+        wflush(w, s, n);
+        return;
+      }
+    }
+    else {
+      size_t size = w->size;
+      char *buf;
+      while (size - w->len < n) size *= 2;
+      buf = (char *)lua_newuserdata(w->L, size);
+      memcpy(buf, w->buf, w->len);
+      lua_replace(w->L, w->bufidx);
+      w->buf = buf;
+      w->size = size;
+    }
+  }
+  memcpy(w->buf + w->len, s, n);
+  w->len += n;
+}
+
+#define waddliteral(w, s)	wadd(w, "" s, sizeof(s) - 1)
+
+
+/*
+** Word-at-a-time scan: 'haszero' is non zero iff some byte of 'v' is
+** zero, so 'hasbyte' tells whether some byte of 'v' is 'c'.
+*/
+typedef size_t lxp_word;
+#define WONES		((lxp_word)-1 / 0xFF)
+#define WHIGHS		(WONES * 0x80)
+#define haszero(v)	(((v) - WONES) & ~(v) & WHIGHS)
+#define hasbyte(v, c)	haszero((v) ^ (WONES * (lxp_word)(unsigned char)(c)))
+
+
+static int cleanword (lxp_word v, int inattr) {
+  lxp_word m = hasbyte(v, '&') | hasbyte(v, '<') | hasbyte(v, '>') |
+               hasbyte(v, '\r');
+  if (inattr)  /* also quotes and the whitespace normalized in values */
+    m |= hasbyte(v, '"') | hasbyte(v, '\t') | hasbyte(v, '\n');
+  return m == 0;
+}
+
+
+static const char *entityof (unsigned char c, int inattr) {
+  switch (c) {
+    case '&': return "&amp;";
+    case '<': return "&lt;";
+    case '>': return "&gt;";
+    case '\r': return "&#13;";
+    case '"': return inattr ? "&quot;" : NULL;
+    case '\t': return inattr ? "&#9;" : NULL;
+    case '\n': return inattr ? "&#10;" : NULL;
+    default: return NULL;
+  }
+}
+
+
+static void wescape (lxp_writer *w, const char *s, size_t len, int inattr) {
+  const char *end = s + len;
+  const char *run = s;  /* start of the pending clean run */
+  while (s < end) {
+    size_t n = (size_t)(end - s);
+    if (n >= sizeof(lxp_word)) {
+      lxp_word v;
+      memcpy(&v, s, sizeof(v));
+      if (cleanword(v, inattr)) {
+        s += sizeof(v);
+        continue;
+      }
+      n = sizeof(v);
+    }
+    for (; n > 0; n--, s++) {
+      const char *e = entityof((unsigned char)*s, inattr);
+      if (e != NULL) {
+        wadd(w, run, (size_t)(s - run));
+        wadd(w, e, strlen(e));
+        run = s + 1;
+      }
+    }
+  }
+  wadd(w, run, (size_t)(end - run));
+}
+
+
+static void wnewline (lxp_writer *w, int depth) {
+  waddliteral(w, "\n");
+  for (; depth > 0; depth--)
+    wadd(w, w->indent, w->indentlen);
+}
+
+
+/*
+** Writes the attribute named 'name' whose value is on the top.
+*/
+static void writeattr (lxp_writer *w, const char *name, size_t len) {
+  size_t vlen;
+  const char *value;
+  int t = lua_type(w->L, -1);
+  if (t != LUA_TSTRING && t != LUA_TNUMBER)
+    luaL_error(w->L, "invalid value for attribute '%s' (a %s)", name,
+               lua_typename(w->L, t));
+  value = lua_tolstring(w->L, -1, &vlen);
+  waddliteral(w, " ");
+  wadd(w, name, len);
+  waddliteral(w, "=\"");
+  wescape(w, value, vlen, 1);
+  waddliteral(w, "\"");
+}
+
+
+/*
+** Tells whether the key on the top is one of 't[1..n]'.
+*/
+static int listedkey (lua_State *L, int t, int n) {
+  int i;
+  for (i = 1; i <= n; i++) {
+    int eq;
+    lua_rawgeti(L, t, i);
+    eq = lua_rawequal(L, -1, -2);
+    lua_pop(L, 1);
+    if (eq) return 1;
+  }
+  return 0;
+}
+
+
+static int cmpnames (const void *a, const void *b) {
+  return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+
+/*
+** Writes the string keys of table 't' which are not listed in 't[1..n]',
+** sorted by name, so that the output does not depend on the table layout.
+*/
+static void writesortedattrs (lxp_writer *w, int t, int n) {
+  lua_State *L = w->L;
+  const char **names;
+  int size = 0, count = 0, i;
+  lua_pushnil(L);
+  while (lua_next(L, t)) {
+    lua_pop(L, 1);
+    if (lua_type(L, -1) == LUA_TSTRING && !listedkey(L, t, n))
+      size++;
+  }
+  if (size == 0) return;
+  names = (const char **)lua_newuserdata(L, size * sizeof(const char *));
+  lua_pushnil(L);
+  while (lua_next(L, t)) {
+    lua_pop(L, 1);
+    if (lua_type(L, -1) == LUA_TSTRING && !listedkey(L, t, n))
+      names[count++] = lua_tostring(L, -1);  /* anchored in 't' */
+  }
+  qsort(names, (size_t)count, sizeof(const char *), cmpnames);
+  for (i = 0; i < count; i++) {
+    lua_getfield(L, t, names[i]);
+    writeattr(w, names[i], strlen(names[i]));
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);  /* names */
+}
+
+
+/*
+** LOM attributes: first those listed in the array part of 'attr', in that
+** order, then any other ones.
+*/
+static void writelomattrs (lxp_writer *w, int attr) {
+  lua_State *L = w->L;
+  int n = (int)lua_rawlen(L, attr);
+  int i;
+  for (i = 1; i <= n; i++) {
+    lua_rawgeti(L, attr, i);
+    if (lua_type(L, -1) == LUA_TSTRING) {
+      size_t len;
+      const char *name = lua_tolstring(L, -1, &len);
+      lua_pushvalue(L, -1);
+      lua_rawget(L, attr);
+      if (!lua_isnil(L, -1))
+        writeattr(w, name, len);
+      lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+  }
+  writesortedattrs(w, attr, n);
+}
+
+
+static void writenode (lxp_writer *w, int idx);
+
+static void writeelement (lxp_writer *w, int idx) {
+  lua_State *L = w->L;
+  size_t taglen;
+  const char *tag;
+  int n, i;
+  int indent = (w->indent != NULL);
+  if (++w->depth > WRITER_MAXDEPTH)
+    luaL_error(L, "tree too deep (or cyclic)");
+  luaL_checkstack(L, 8, "tree too deep (or cyclic)");
+  lua_rawgeti(L, idx, 0);
+  if (lua_type(L, -1) == LUA_TSTRING) {  /* totable element */
+    tag = lua_tolstring(L, -1, &taglen);
+    waddliteral(w, "<");
+    wadd(w, tag, taglen);
+    writesortedattrs(w, idx, 0);
+  }
+  else {  /* LOM element */
+    lua_pop(L, 1);
+    lua_getfield(L, idx, "tag");
+    if (lua_type(L, -1) != LUA_TSTRING)
+      luaL_error(L, "invalid element (tag is a %s)",
+                 luaL_typename(L, -1));
+    tag = lua_tolstring(L, -1, &taglen);
+    waddliteral(w, "<");
+    wadd(w, tag, taglen);
+    lua_getfield(L, idx, "attr");
+    if (lua_type(L, -1) == LUA_TTABLE)
+      writelomattrs(w, lua_gettop(L));
+    lua_pop(L, 1);
+  }
+  n = (int)lua_rawlen(L, idx);
+  if (n == 0)
+    waddliteral(w, "/>");
+  else {
+    waddliteral(w, ">");
+    for (i = 1; indent && i <= n; i++) {  /* only indent element content */
+      lua_rawgeti(L, idx, i);
+      indent = (lua_type(L, -1) == LUA_TTABLE);
+      lua_pop(L, 1);
+    }
+    for (i = 1; i <= n; i++) {
+      if (indent) wnewline(w, w->depth);
+      lua_rawgeti(L, idx, i);
+      writenode(w, lua_gettop(L));
+      lua_pop(L, 1);
+    }
+    if (indent) wnewline(w, w->depth - 1);
+    waddliteral(w, "</");
+    wadd(w, tag, taglen);
+    waddliteral(w, ">");
+  }
+  lua_pop(L, 1);  /* tag */
+  w->depth--;
+}
+
+
+/*
+** A compact tree element, read straight from its document; attributes
+** are written in the order Expat reported them
+*/
+static void writedomelement (lxp_writer *w, lxp_dom *d, lxp_ref i) {
+  lxp_delem *e = &d->elems[i];
+  lxp_ref k;
+  int indent = (w->indent != NULL);
+  if (++w->depth > WRITER_MAXDEPTH)
+    luaL_error(w->L, "tree too deep (or cyclic)");
+  waddliteral(w, "<");
+  wadd(w, poolstr(d, e->name), poolsize(d, e->name));
+  for (k = 0; k < e->nattrs; k++) {
+    lxp_ref name = d->attrs[e->attrs + k * 2];
+    lxp_ref value = d->attrs[e->attrs + k * 2 + 1];
+    waddliteral(w, " ");
+    wadd(w, poolstr(d, name), poolsize(d, name));
+    waddliteral(w, "=\"");
+    wescape(w, poolstr(d, value), poolsize(d, value), 1);
+    waddliteral(w, "\"");
+  }
+  if (e->nchildren == 0)
+    waddliteral(w, "/>");
+  else {
+    waddliteral(w, ">");
+    for (k = 0; indent && k < e->nchildren; k++)  /* only element content */
+      indent = !istext(d->children[e->children + k]);
+    for (k = 0; k < e->nchildren; k++) {
+      lxp_ref c = d->children[e->children + k];
+      if (indent) wnewline(w, w->depth);
+      if (istext(c))
+        wescape(w, poolstr(d, childref(c)), poolsize(d, childref(c)), 0);
+      else
+        writedomelement(w, d, childref(c));
+    }
+    if (indent) wnewline(w, w->depth - 1);
+    waddliteral(w, "</");
+    wadd(w, poolstr(d, e->name), poolsize(d, e->name));
+    waddliteral(w, ">");
+  }
+  w->depth--;
+}
+
+
+static void writenode (lxp_writer *w, int idx) {
+  lua_State *L = w->L;
+  lxp_node *n;
+  switch (lua_type(L, idx)) {
+    case LUA_TSTRING:
+    case LUA_TNUMBER: {
+      size_t len;
+      const char *s = lua_tolstring(L, idx, &len);
+      wescape(w, s, len, 0);
+      break;
+    }
+    case LUA_TTABLE:
+      writeelement(w, idx);
+      break;
+    case LUA_TUSERDATA:
+      if ((n = tonode(L, idx)) != NULL) {
+        writedomelement(w, checknode(L, idx)->dom, n->index);
+        break;
+      }
+      /* FALLTHROUGH */
+    default:
+      luaL_error(L, "invalid node (a %s)", luaL_typename(L, idx));
+  }
+}
+
+
+/*
+** Common part of 'lxp.tostring' and 'lxp.write': the node is at 'node' and
+** the options (if any) right after it. Leaves the output in 'w->buf'.
+*/
+static void writetree (lua_State *L, lxp_writer *w, int node, FILE *f) {
+  int opts = node + 1;
+  luaL_checkany(L, node);
+  lua_settop(L, opts);
+  w->L = L;
+  w->f = f;
+  w->indent = NULL;
+  w->indentlen = 0;
+  w->depth = 0;
+  if (!lua_isnil(L, opts)) {
+    luaL_checktype(L, opts, LUA_TTABLE);
+    lua_getfield(L, opts, "indent");
+    if (lua_type(L, -1) == LUA_TNUMBER) {
+      luaL_Buffer b;
+      int i = (int)lua_tointeger(L, -1);
+      luaL_argcheck(L, i >= 0, opts, "indent must not be negative");
+      luaL_buffinit(L, &b);
+      for (; i > 0; i--) luaL_addchar(&b, ' ');
+      luaL_pushresult(&b);
+      lua_replace(L, -2);
+    }
+    if (!lua_isnil(L, -1)) {
+      luaL_argcheck(L, lua_type(L, -1) == LUA_TSTRING, opts,
+                    "indent must be a string or a number");
+      w->indent = lua_tolstring(L, -1, &w->indentlen);  /* kept below */
+    }
+    lua_getfield(L, opts, "declaration");
+  }
+  else {
+    lua_pushnil(L);  /* indent */
+    lua_pushnil(L);  /* declaration */
+  }
+  w->buf = (char *)lua_newuserdata(L, WRITER_CHUNK);
+  w->bufidx = lua_gettop(L);
+  w->size = WRITER_CHUNK;
+  w->len = 0;
+  if (lua_toboolean(L, -2)) {
+    waddliteral(w, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>");
+    if (w->indent != NULL) waddliteral(w, "\n");
+  }
+  writenode(w, node);
+}
+
+
+static int lxp_tostring (lua_State *L) {
+  lxp_writer w;
+  writetree(L, &w, 1, NULL);
+  lua_pushlstring(L, w.buf, w.len);
+  return 1;
+}
+
+
+static int lxp_write (lua_State *L) {
+  lxp_writer w;
+  FILE *f = tofile(L, 1);
+  writetree(L, &w, 2, f);
+  wflush(&w, w.buf, w.len);
+  lua_settop(L, 1);
+  return 1;
+}
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Tapes
+** 'lxp.tokenize' runs Expat on a native thread, which writes the content
+** events of a document to a tape while Lua reads the earlier ones. A tape
+** is a list of blocks; an event is its code (an 'XPEvent') followed by
+** its strings, each one a varint length and the bytes:
+**   StartElement: name, specified count, attribute count, names/values
+**   EndElement: name; CharacterData: text; Comment: text
+**   ProcessingInstruction: target, data
+** Blocks are published once full and never change afterwards. A tape
+** read in a single pass frees the blocks read, and its worker waits when
+** TAPE_QUEUE blocks are pending, unless 'tape:status' waits for it; the
+** tapes of 'lxp.tokenizeall' keep their blocks and can be read many
+** times. Without threads, documents are tokenized on the calling thread.
+** =======================================================
+*/
+
+#define TAPE_BLOCK	65536  /* usual block size */
+#define TAPE_QUEUE	16  /* most blocks pending in a single pass */
+#define TAPE_SLICE	(1 << 20)  /* input given to Expat at a time */
+
+typedef struct lxp_block {
+  struct lxp_block *next;
+  size_t len;  /* bytes used */
+  size_t size;
+} lxp_block;
+
+#define blockdata(b)	((char *)((b) + 1))
+
+typedef struct lxp_tape {
+  const char *doc;  /* input, anchored in the uservalue of the tape */
+  size_t doclen;
+  char sep;  /* namespace separator, '\0' if none */
+  int keep;  /* whether blocks are kept once read */
+  int iterated;  /* whether a single pass has started */
+  lxp_block *first;  /* published blocks */
+  lxp_block *last;
+  int queued;  /* published blocks not yet freed */
+  int done;  /* whether the worker has finished */
+  int cancel;  /* whether the worker must stop */
+  int awaited;  /* whether 'tape:status' waits for the worker */
+  int closed;
+  const char *errmsg;  /* NULL if the document is well formed */
+  long errpos[3];  /* line, column, and position of the error */
+  /* used by the worker only */
+  XML_Parser parser;
+  lxp_block *cur;  /* block being written */
+  char *text;  /* pending text */
+  size_t textlen;
+  size_t textsize;
+#ifdef LXP_THREADS
+  int threaded;  /* whether the tape has a thread of its own */
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;  /* signals a block published, read, or 'done' */
+#endif
+} lxp_tape;
+
+#ifdef LXP_THREADS
+#define tapelock(t)	pthread_mutex_lock(&(t)->lock)
+#define tapeunlock(t)	pthread_mutex_unlock(&(t)->lock)
+#define tapesignal(t)	pthread_cond_broadcast(&(t)->cond)
+#define tapewait(t)	pthread_cond_wait(&(t)->cond, &(t)->lock)
+#define threaded(t)	((t)->threaded)
+#else
+#define tapelock(t)	((void)0)
+#define tapeunlock(t)	((void)0)
+#define tapesignal(t)	((void)0)
+#define tapewait(t)	((void)0)
+#define threaded(t)	0
+#endif
+
+
+static size_t getvarint (const char **pp) {
+  const unsigned char *p = (const unsigned char *)*pp;
+  size_t v = 0;
+  int shift = 0;
+  while (*p & 0x80) {
+    v |= (size_t)(*p++ & 0x7F) << shift;
+    shift += 7;
+  }
+  v |= (size_t)*p++ << shift;
+  *pp = (const char *)p;
+  return v;
+}
+
+
+static void tapeerror (lxp_tape *t, const char *msg) {
+  XML_Parser p = t->parser;
+  if (t->errmsg != NULL) return;
+  t->errmsg = msg;
+  if (p != NULL) {
+    t->errpos[0] = (long)XML_GetCurrentLineNumber(p);
+    t->errpos[1] = (long)XML_GetCurrentColumnNumber(p) + 1;
+    t->errpos[2] = (long)XML_GetCurrentByteIndex(p) + 1;
+    XML_StopParser(p, XML_FALSE);
+  }
+}
+
+
+/*
+** Append the block being written to the tape (worker)
+*/
+static void publish (lxp_tape *t) {
+  lxp_block *b = t->cur;
+  t->cur = NULL;
+  if (b == NULL || b->len == 0) {
+    free(b);
+    return;
+  }
+  tapelock(t);
+  if (t->last != NULL)
+    t->last->next = b;
+  else
+    t->first = b;
+  t->last = b;
+  t->queued++;
+  tapesignal(t);
+  while (threaded(t) && !t->keep && t->queued >= TAPE_QUEUE && !t->cancel &&
+         !t->awaited)
+    tapewait(t);
+  if (t->cancel && t->parser != NULL)
+    XML_StopParser(t->parser, XML_FALSE);
+  tapeunlock(t);
+}
+
+
+/*
+** Room for 'n' more bytes in the block being written (worker)
+*/
+static char *tapespace (lxp_tape *t, size_t n) {
+  lxp_block *b = t->cur;
+  size_t size;
+  if (b != NULL && b->size - b->len >= n)
+    return blockdata(b) + b->len;
+  publish(t);
+  size = (n > TAPE_BLOCK) ? n : TAPE_BLOCK;
+  b = (lxp_block *)malloc(sizeof(lxp_block) + size);
+  if (b == NULL) {
+    tapeerror(t, "not enough memory");
+    return NULL;
+  }
+  b->next = NULL;
+  b->len = 0;
+  b->size = size;
+  t->cur = b;
+  return blockdata(b);
+}
+
+
+#define commit(t, p)	((t)->cur->len = (size_t)((p) - blockdata((t)->cur)))
+
+
+/*
+** Write an event with 'n' (up to 2) strings
+*/
+static void tapeevent (lxp_tape *t, enum XPEvent ev, int n,
+                       const char *s1, size_t l1, const char *s2, size_t l2) {
+  size_t size = 1 + varintsize(l1) + l1;
+  char *p;
+  if (n > 1) size += varintsize(l2) + l2;
+  p = tapespace(t, size);
+  if (p == NULL) return;
+  *p++ = (char)ev;
+  p = putstring(p, s1, l1);
+  if (n > 1) p = putstring(p, s2, l2);
+  commit(t, p);
 }
 
 
-static int f_ExternaEntity (XML_Parser p, const char *context,
-                                          const char *base,
-                                          const char *systemId,
-                                          const char *publicId) {
-  lxp_userdata *xpu = (lxp_userdata *)XML_GetUserData(p);
-  lua_State *L = xpu->L;
-  lxp_userdata *child;
-  int status;
-  if (getHandle(xpu, ExternalEntityKey) == 0) return 1;  /* no handle */
-  child = createlxp(L);
-  child->parser = XML_ExternalEntityParserCreate(p, context, NULL);
-  if (!child->parser)
-    luaL_error(L, "XML_ParserCreate failed");
-  lua_getuservalue(L, 1);
-  lua_setuservalue(L, -2); /* child uses the same table of its father */
-  lua_pushstring(L, base);
-  lua_pushstring(L, systemId);
-  lua_pushstring(L, publicId);
-  docall(xpu, 4, 1);
-  status = lua_toboolean(L, -1);
-  lua_pop(L, 1);
-  lxpclose(L, child);
-  return status;
+static void tapetext (lxp_tape *t) {
+  if (t->textlen > 0) {
+    size_t len = t->textlen;
+    t->textlen = 0;
+    tapeevent(t, XPECharData, 1, t->text, len, NULL, 0);
+  }
 }
 
 
-static void f_StartNamespaceDecl (void *ud, const char *prefix,
-                                            const char *uri) {
-  lxp_userdata *xpu = (lxp_userdata *)ud;
-  lua_State *L = xpu->L;
-  if (getHandle(xpu, StartNamespaceDeclKey) == 0) return;  /* no handle */
-  lua_pushstring(L, prefix);
-  lua_pushstring(L, uri);
-  docall(xpu, 2, 0);
+static void tape_StartElement (void *ud, const char *name,
+                                         const char **attrs) {
+  lxp_tape *t = (lxp_tape *)ud;
+  size_t len = strlen(name);
+  size_t size = 1 + varintsize(len) + len;
+  int nspec = XML_GetSpecifiedAttributeCount(t->parser) / 2;
+  int nattrs, i;
+  char *p;
+  tapetext(t);
+  for (nattrs = 0; attrs[nattrs * 2] != NULL; nattrs++) {
+    size_t l = strlen(attrs[nattrs * 2]);
+    size_t v = strlen(attrs[nattrs * 2 + 1]);
+    size += varintsize(l) + l + varintsize(v) + v;
+  }
+  size += varintsize((size_t)nspec) + varintsize((size_t)nattrs);
+  p = tapespace(t, size);
+  if (p == NULL) return;
+  *p++ = (char)XPEStartElement;
+  p = putstring(p, name, len);
+  p = putvarint(p, (size_t)nspec);
+  p = putvarint(p, (size_t)nattrs);
+  for (i = 0; i < nattrs * 2; i++)
+    p = putstring(p, attrs[i], strlen(attrs[i]));
+  commit(t, p);
 }
 
 
-static void f_EndNamespaceDecl (void *ud, const char *prefix) {
-  lxp_userdata *xpu = (lxp_userdata *)ud;
-  if (getHandle(xpu, EndNamespaceDeclKey) == 0) return;  /* no handle */
-  lua_pushstring(xpu->L, prefix);
-  docall(xpu, 1, 0);
+static void tape_EndElement (void *ud, const char *name) {
+  lxp_tape *t = (lxp_tape *)ud;
+  tapetext(t);
+  tapeevent(t, XPEEndElement, 1, name, strlen(name), NULL, 0);
 }
 
 
-static void f_NotationDecl (void *ud, const char *notationName,
-                                      const char *base,
-                                      const char *systemId,
-                                      const char *publicId) {
-  lxp_userdata *xpu = (lxp_userdata *)ud;
-  lua_State *L = xpu->L;
-  if (getHandle(xpu, NotationDeclKey) == 0) return;  /* no handle */
-  lua_pushstring(L, notationName);
-  lua_pushstring(L, base);
-  lua_pushstring(L, systemId);
-  lua_pushstring(L, publicId);
-  docall(xpu, 4, 0);
+static void tape_CharData (void *ud, const char *s, int len) {
+  lxp_tape *t = (lxp_tape *)ud;
+  size_t n = (size_t)len;
+  if (n > t->textsize - t->textlen) {
+    size_t size = t->textsize ? t->textsize : 256;
+    char *text;
+    while (size - t->textlen < n) size *= 2;
+    text = (char *)realloc(t->text, size);
+    if (text == NULL) {
+      tapeerror(t, "not enough memory");
+      return;
+    }
+    t->text = text;
+    t->textsize = size;
+  }
+  memcpy(t->text + t->textlen, s, n);
+  t->textlen += n;
 }
 
 
-static int f_NotStandalone (void *ud) {
-  int status;
-  lxp_userdata *xpu = (lxp_userdata *)ud;
-  lua_State *L = xpu->L;
-  if (getHandle(xpu, NotStandaloneKey) == 0) return 1;  /* no handle */
-  docall(xpu, 0, 1);
-  status = lua_toboolean(L, -1);
-  lua_pop(L, 1);
-  return status;
+static void tape_Comment (void *ud, const char *data) {
+  lxp_tape *t = (lxp_tape *)ud;
+  tapetext(t);
+  tapeevent(t, XPEComment, 1, data, strlen(data), NULL, 0);
 }
 
 
-static void f_ProcessingInstruction (void *ud, const char *target,
-                                               const char *data) {
-  lxp_userdata *xpu = (lxp_userdata *)ud;
-  lua_State *L = xpu->L;
-  if (getHandle(xpu, ProcessingInstructionKey) == 0) return;  /* no handle */
-  lua_pushstring(L, target);
-  lua_pushstring(L, data);
-  docall(xpu, 2, 0);
+static void tape_ProcessingInstruction (void *ud, const char *target,
+                                                  const char *data) {
+  lxp_tape *t = (lxp_tape *)ud;
+  tapetext(t);
+  tapeevent(t, XPEProcessingInstruction, 2, target, strlen(target),
+                                            data, strlen(data));
 }
 
 
-static void f_UnparsedEntityDecl (void *ud, const char *entityName,
-                                            const char *base,
-                                            const char *systemId,
-                                            const char *publicId,
-                                            const char *notationName) {
-  lxp_userdata *xpu = (lxp_userdata *)ud;
-  lua_State *L = xpu->L;
-  if (getHandle(xpu, UnparsedEntityDeclKey) == 0) return;  /* no handle */
-  lua_pushstring(L, entityName);
-  lua_pushstring(L, base);
-  lua_pushstring(L, systemId);
-  lua_pushstring(L, publicId);
-  lua_pushstring(L, notationName);
-  docall(xpu, 5, 0);
+static int cancelled (lxp_tape *t) {
+  int cancel;
+  tapelock(t);
+  cancel = t->cancel;
+  tapeunlock(t);
+  return cancel;
 }
 
-static void f_EntityDecl (void *ud, const char *entityName,
-                                    int is_parameter_entity,
-                                    const char *value,
-                                    int value_length,
-                                    const char *base,
-                                    const char *systemId,
-                                    const char *publicId,
-                                    const char *notationName) {
-  lxp_userdata *xpu = (lxp_userdata *)ud;
-  lua_State *L = xpu->L;
-  if (getHandle(xpu, EntityDeclKey) == 0) return;  /* no handle */
-  lua_pushstring(L, entityName);
-  lua_pushboolean(L, is_parameter_entity);
-  if (value == NULL) {
-    lua_pushnil(L);
-  } else {
-    lua_pushlstring(L, value, value_length);
+
+/*
+** Tokenize the document of a tape (on the worker)
+*/
+static void runtape (lxp_tape *t) {
+  XML_Parser p = (t->sep == '\0') ? XML_ParserCreate(NULL)
+                                   : XML_ParserCreateNS(NULL, t->sep);
+  t->parser = p;
+  if (p == NULL)
+    tapeerror(t, "XML_ParserCreate failed");
+  else {
+    size_t pos = 0;
+    XML_SetUserData(p, t);
+    XML_SetElementHandler(p, tape_StartElement, tape_EndElement);
+    XML_SetCharacterDataHandler(p, tape_CharData);
+    XML_SetCommentHandler(p, tape_Comment);
+    XML_SetProcessingInstructionHandler(p, tape_ProcessingInstruction);
+    do {  /* in slices, so that a cancel is seen even without events */
+      size_t n = t->doclen - pos;
+      if (n > TAPE_SLICE) n = TAPE_SLICE;
+      if (XML_Parse(p, t->doc + pos, (int)n, pos + n == t->doclen)
+                   == XML_STATUS_ERROR) {
+        if (XML_GetErrorCode(p) != XML_ERROR_ABORTED)
+          tapeerror(t, XML_ErrorString(XML_GetErrorCode(p)));
+        break;
+      }
+      pos += n;
+    } while (pos < t->doclen && !cancelled(t));
+    tapetext(t);
+    t->parser = NULL;
+    XML_ParserFree(p);
   }
-  lua_pushstring(L, base);
-  lua_pushstring(L, systemId);
-  lua_pushstring(L, publicId);
-  lua_pushstring(L, notationName);
-  docall(xpu, 7, 0);
+  publish(t);
+  free(t->text);
+  t->text = NULL;
+  tapelock(t);
+  t->done = 1;
+  tapesignal(t);
+  tapeunlock(t);
 }
 
-static void PushElementDeclType(lua_State *L, XML_Content *model) {
-  switch(model->type) {
-    case XML_CTYPE_EMPTY:
-      lua_pushliteral(L, "EMPTY");
-      return;
-    case XML_CTYPE_ANY:
-      lua_pushliteral(L, "ANY");
-      return;
-    case XML_CTYPE_MIXED:
-      lua_pushliteral(L, "MIXED");
-      return;
-    case XML_CTYPE_NAME:
-      lua_pushliteral(L, "NAME");
-      return;
-    case XML_CTYPE_CHOICE:
-      lua_pushliteral(L, "CHOICE");
-      return;
-    case XML_CTYPE_SEQ:
-      lua_pushliteral(L, "SEQUENCE");
-      return;
-    default:
-      /* safe guard, should not happen */
-      lua_pushliteral(L, "unknown");
-      return;
-  }
+
+#ifdef LXP_THREADS
+static void *tapethread (void *ud) {
+  runtape((lxp_tape *)ud);
+  return NULL;
 }
+#endif
 
-static int PushElementDeclQuant(lua_State *L, XML_Content *model) {
-  switch(model->quant) {
-    case XML_CQUANT_NONE:
-      return 0;
-    case XML_CQUANT_OPT:
-      lua_pushliteral(L, "?");
-      return 1;
-    case XML_CQUANT_REP:
-      lua_pushliteral(L, "*");
-      return 1;
-    case XML_CQUANT_PLUS:
-      lua_pushliteral(L, "+");
-      return 1;
-    default:
-      /* safe guard, should not happen */
-      lua_pushliteral(L, "unknown");
-      return 1;
+
+/*
+** Create a tape for the document at 'idx' and push it
+*/
+static lxp_tape *newtape (lua_State *L, int idx, char sep, int keep) {
+  lxp_tape *t = (lxp_tape *)lua_newuserdata(L, sizeof(lxp_tape));
+  memset(t, 0, sizeof(lxp_tape));
+  t->closed = 1;  /* until fully initialized */
+  luaL_getmetatable(L, TapeType);
+  lua_setmetatable(L, -2);
+  lua_createtable(L, 1, 0);
+  lua_pushvalue(L, idx);
+  t->doc = lua_tolstring(L, -1, &t->doclen);
+  lua_rawseti(L, -2, 1);
+  lua_setuservalue(L, -2);
+  t->sep = sep;
+  t->keep = keep;
+#ifdef LXP_THREADS
+  if (pthread_mutex_init(&t->lock, NULL) != 0)
+    luaL_error(L, "cannot create a mutex");
+  if (pthread_cond_init(&t->cond, NULL) != 0) {
+    pthread_mutex_destroy(&t->lock);
+    luaL_error(L, "cannot create a condition variable");
   }
+#endif
+  t->closed = 0;
+  return t;
 }
 
-static void PushElementDeclChildren(lua_State *L, XML_Content *model) {
-  lua_checkstack(L, 4);
-  int i;
-  XML_Content *child;
-  for (i = 0; i < model->numchildren; i++) {
-    child = model->children+i;
-    lua_newtable(L);
-    PushElementDeclType(L, child);
-    lua_setfield(L, -2, "type");
-    if (PushElementDeclQuant(L, child) != 0) {
-      lua_setfield(L, -2, "quantifier");
-    }
-    if (child->name != NULL) {
-      lua_pushstring(L, child->name);
-      lua_setfield(L, -2, "name");
-    }
-    if (child->numchildren > 0 ) {
-      lua_newtable(L);
-      PushElementDeclChildren(L, child);
-      lua_setfield(L, -2, "children");
-    }
 
-    lua_rawseti(L, -2, i+1);
-  }
+static lxp_tape *checktape (lua_State *L, int idx) {
+  lxp_tape *t = (lxp_tape *)luaL_checkudata(L, idx, TapeType);
+  if (t->closed)
+    luaL_error(L, "attempt to use a closed tape");
+  return t;
 }
 
-static void f_ElementDecl (void *ud, const char *name, XML_Content *model) {
-  lxp_userdata *xpu = (lxp_userdata *)ud;
-  lua_State *L = xpu->L;
-  if (getHandle(xpu, ElementDeclKey) == 0) {   /* no handle */
-    XML_FreeContentModel(xpu->parser, model);
-    return;
-  }
-  lua_pushstring(L, name);
-  PushElementDeclType(L, model);
-  if (PushElementDeclQuant(L, model) == 0) {
-    lua_pushnil(L);
-  }
-  if (model->numchildren == 0) {
-    XML_FreeContentModel(xpu->parser, model);
-    docall(xpu, 3, 0);
-  } else {
-    lua_newtable(L);
-    PushElementDeclChildren(L, model);
-    XML_FreeContentModel(xpu->parser, model);
-    docall(xpu, 4, 0);
+
+static void freeblocks (lxp_block *b) {
+  while (b != NULL) {
+    lxp_block *next = b->next;
+    free(b);
+    b = next;
   }
 }
 
-static void f_AttlistDecl (void *ud, const char *elName,
-                                     const char *attName,
-                                     const char *attType,
-                                     const char *dflt,
-                                     int isRequired) {
-  lxp_userdata *xpu = (lxp_userdata *)ud;
-  lua_State *L = xpu->L;
-  if (getHandle(xpu, AttlistDeclKey) == 0) return;  /* no handle */
-  lua_pushstring(L, elName);
-  lua_pushstring(L, attName);
-  lua_pushstring(L, attType);
-  lua_pushstring(L, dflt);
-  lua_pushboolean(L, isRequired);
-  docall(xpu, 5, 0);
-}
 
-static void f_SkippedEntity (void *ud, const char *entityName,
-                                       int isParameter) {
-  lxp_userdata *xpu = (lxp_userdata *)ud;
-  lua_State *L = xpu->L;
-  if (getHandle(xpu, SkippedEntityKey) == 0) return;  /* no handle */
-  lua_pushstring(L, entityName);
-  lua_pushboolean(L, isParameter);
-  docall(xpu, 2, 0);
+static int tape_close (lua_State *L) {
+  lxp_tape *t = (lxp_tape *)luaL_checkudata(L, 1, TapeType);
+  if (!t->closed) {
+    tapelock(t);
+    t->cancel = 1;
+    tapesignal(t);
+    tapeunlock(t);
+#ifdef LXP_THREADS
+    if (t->threaded)
+      pthread_join(t->thread, NULL);
+    pthread_cond_destroy(&t->cond);
+    pthread_mutex_destroy(&t->lock);
+#endif
+    freeblocks(t->first);
+    t->first = t->last = NULL;
+    t->closed = 1;
+  }
+  return 0;
 }
 
-static void f_StartDoctypeDecl (void *ud, const XML_Char *doctypeName,
-                                          const XML_Char *sysid,
-                                          const XML_Char *pubid,
-                                          int has_internal_subset) {
-  lxp_userdata *xpu = (lxp_userdata *)ud;
-  if (getHandle(xpu, StartDoctypeDeclKey) == 0) return;  /* no handle */
-  lua_pushstring(xpu->L, doctypeName);
-  lua_pushstring(xpu->L, sysid);
-  lua_pushstring(xpu->L, pubid);
-  lua_pushboolean(xpu->L, has_internal_subset);
-  docall(xpu, 4, 0);
+
+/*
+** Wait for the worker, which must no longer wait for the blocks to be
+** read: nobody reads them meanwhile
+*/
+static void waittape (lxp_tape *t) {
+  tapelock(t);
+  t->awaited = 1;
+  tapesignal(t);
+  while (!t->done)
+    tapewait(t);
+  tapeunlock(t);
 }
 
-static void f_EndDoctypeDecl (void *ud) {
-  lxp_userdata *xpu = (lxp_userdata *)ud;
-  if (getHandle(xpu, EndDoctypeDeclKey) == 0) return;  /* no handle */
-  docall(xpu, 0, 0);
+
+/*
+** Wait for the worker and return 'true', or 'nil', the error message,
+** and its position
+*/
+static int tape_status (lua_State *L) {
+  lxp_tape *t = checktape(L, 1);
+  int i;
+  waittape(t);
+  if (t->errmsg == NULL) {
+    lua_pushboolean(L, 1);
+    return 1;
+  }
+  lua_pushnil(L);
+  lua_pushstring(L, t->errmsg);
+  for (i = 0; i < 3; i++)
+    lua_pushinteger(L, t->errpos[i]);
+  return 5;
 }
 
-static void f_XmlDecl (void *ud, const XML_Char *version,
-                                 const XML_Char *encoding,
-                                 int standalone) {
-  lxp_userdata *xpu = (lxp_userdata *)ud;
-  if (getHandle(xpu, XmlDeclKey) == 0) return;  /* no handle */
-  lua_pushstring(xpu->L, version);
-  lua_pushstring(xpu->L, encoding);
-  if (standalone >= 0) {
-    lua_pushboolean(xpu->L, standalone);
-    docall(xpu, 3, 0);
-  } else {
-    docall(xpu, 2, 0);
+
+/*
+** A reader of a tape, at a position of a block
+*/
+typedef struct lxp_cursor {
+  lxp_block *block;  /* NULL before the first block */
+  size_t pos;
+} lxp_cursor;
+
+
+/*
+** Move the cursor to the next block, waiting for the worker if needed;
+** return 0 at the end of the tape
+*/
+static int nextblock (lxp_tape *t, lxp_cursor *c) {
+  int more;
+  tapelock(t);
+  for (;;) {
+    lxp_block *next = (c->block != NULL) ? c->block->next : t->first;
+    if (next != NULL || t->done) {
+      if (!t->keep && c->block != NULL) {  /* single pass: free it */
+        t->first = next;
+        if (next == NULL) t->last = NULL;
+        t->queued--;
+        free(c->block);
+        tapesignal(t);
+      }
+      c->block = next;
+      c->pos = 0;
+      more = (next != NULL);
+      break;
+    }
+    tapewait(t);
   }
+  tapeunlock(t);
+  return more;
 }
-/* }====================================================== */
 
 
+static const char *pushtapestring (lua_State *L, const char *p) {
+  size_t len = getvarint(&p);
+  lua_pushlstring(L, p, len);
+  return p + len;
+}
 
-static int hasfield (lua_State *L, const char *fname) {
-  int res;
-  lua_pushstring(L, fname);
-  lua_gettable(L, 1);
-  res = !lua_isnil(L, -1);
-  lua_pop(L, 1);
-  return res;
+
+/*
+** Push the event at 'p' as 'parser:events' gives it: its name and two
+** values; return the position of the next event
+*/
+static const char *pushtapeevent (lua_State *L, const char *p) {
+  enum XPEvent ev = (enum XPEvent)(unsigned char)*p++;
+  lua_pushstring(L, eventkeys[ev]);
+  switch (ev) {
+    case XPEStartElement: {
+      int nspec, nattrs, i;
+      p = pushtapestring(L, p);
+      nspec = (int)getvarint(&p);
+      nattrs = (int)getvarint(&p);
+      lua_createtable(L, nspec, nattrs);
+      for (i = 1; i <= nattrs; i++) {
+        p = pushtapestring(L, p);
+        if (i <= nspec) {
+          lua_pushvalue(L, -1);
+          lua_rawseti(L, -3, i);
+        }
+        p = pushtapestring(L, p);
+        lua_rawset(L, -3);
+      }
+      break;
+    }
+    case XPEProcessingInstruction:
+      p = pushtapestring(L, p);
+      p = pushtapestring(L, p);
+      break;
+    default:
+      p = pushtapestring(L, p);
+      lua_pushboolean(L, 0);
+      break;
+  }
+  return p;
 }
 
 
-static void checkcallbacks (lua_State *L) {
-  static const char *const validkeys[] = {
-    "StartCdataSection", "EndCdataSection", "CharacterData", "Comment",
-    "Default", "DefaultExpand", "StartElement", "EndElement",
-    "ExternalEntityRef", "StartNamespaceDecl", "EndNamespaceDecl",
-    "NotationDecl", "NotStandalone", "ProcessingInstruction",
-    "UnparsedEntityDecl", "EntityDecl", "StartDoctypeDecl", "EndDoctypeDecl",
-    "XmlDecl", "AttlistDecl", "SkippedEntity", "ElementDecl", NULL};
-  if (hasfield(L, "_nonstrict")) return;
-  lua_pushnil(L);
-  while (lua_next(L, 1)) {
-    lua_pop(L, 1);  /* remove value */
-#if ! defined (LUA_VERSION_NUM) || LUA_VERSION_NUM < 501
-    if (lua_type(L, -1) != LUA_TSTRING ||
-        luaL_findstring(lua_tostring(L, -1), validkeys) < 0)
-      luaL_error(L, "invalid key `%s' in callback table", lua_tostring(L, -1));
-#else
-    luaL_checkoption(L, -1, NULL, validkeys);
-#endif
+static int tape_next (lua_State *L) {
+  lxp_tape *t = checktape(L, lua_upvalueindex(1));
+  lxp_cursor *c = (lxp_cursor *)lua_touserdata(L, lua_upvalueindex(2));
+  const char *p;
+  while (c->block == NULL || c->pos >= c->block->len) {
+    if (!nextblock(t, c)) {
+      if (t->errmsg != NULL)
+        luaL_error(L, "%s (line %d, column %d, position %d)", t->errmsg,
+                   (int)t->errpos[0], (int)t->errpos[1], (int)t->errpos[2]);
+      return 0;
+    }
   }
+  p = blockdata(c->block) + c->pos;
+  c->pos = (size_t)(pushtapeevent(L, p) - blockdata(c->block));
+  return 3;
 }
 
 
-static int lxp_make_parser (lua_State *L) {
-  XML_Parser p;
-  int bufferCharData = (lua_type(L, 3) != LUA_TBOOLEAN) || (lua_toboolean(L, 3) != 0);
-  char sep = *luaL_optstring(L, 2, "");
-  lxp_userdata *xpu = createlxp(L);
-  xpu->bufferCharData = bufferCharData;
-  p = xpu->parser = (sep == '\0') ? XML_ParserCreate(NULL) :
-                                    XML_ParserCreateNS(NULL, sep);
-  if (!p)
-    luaL_error(L, "XML_ParserCreate failed");
-  luaL_checktype(L, 1, LUA_TTABLE);
-  checkcallbacks(L);
-  lua_pushvalue(L, 1);
-  lua_setuservalue(L, -2);
-  XML_SetUserData(p, xpu);
-  if (hasfield(L, StartCdataKey) || hasfield(L, EndCdataKey))
-    XML_SetCdataSectionHandler(p, f_StartCdata, f_EndCdataKey);
-  if (hasfield(L, CharDataKey))
-    XML_SetCharacterDataHandler(p, f_CharData);
-  if (hasfield(L, CommentKey))
-    XML_SetCommentHandler(p, f_Comment);
-  if (hasfield(L, DefaultKey))
-    XML_SetDefaultHandler(p, f_Default);
-  if (hasfield(L, DefaultExpandKey))
-    XML_SetDefaultHandlerExpand(p, f_DefaultExpand);
-  if (hasfield(L, StartElementKey) || hasfield(L, EndElementKey))
-    XML_SetElementHandler(p, f_StartElement, f_EndElement);
-  if (hasfield(L, ExternalEntityKey))
-    XML_SetExternalEntityRefHandler(p, f_ExternaEntity);
-  if (hasfield(L, StartNamespaceDeclKey) || hasfield(L, EndNamespaceDeclKey))
-    XML_SetNamespaceDeclHandler(p, f_StartNamespaceDecl, f_EndNamespaceDecl);
-  if (hasfield(L, NotationDeclKey))
-    XML_SetNotationDeclHandler(p, f_NotationDecl);
-  if (hasfield(L, NotStandaloneKey))
-    XML_SetNotStandaloneHandler(p, f_NotStandalone);
-  if (hasfield(L, ProcessingInstructionKey))
-    XML_SetProcessingInstructionHandler(p, f_ProcessingInstruction);
-  if (hasfield(L, UnparsedEntityDeclKey))
-    XML_SetUnparsedEntityDeclHandler(p, f_UnparsedEntityDecl);
-  if (hasfield(L, EntityDeclKey))
-    XML_SetEntityDeclHandler(p, f_EntityDecl);
-  if (hasfield(L, AttlistDeclKey))
-    XML_SetAttlistDeclHandler(p, f_AttlistDecl);
-  if (hasfield(L, SkippedEntityKey))
-    XML_SetSkippedEntityHandler(p, f_SkippedEntity);
-  if (hasfield(L, StartDoctypeDeclKey))
-    XML_SetStartDoctypeDeclHandler(p, f_StartDoctypeDecl);
-  if (hasfield(L, EndDoctypeDeclKey))
-    XML_SetEndDoctypeDeclHandler(p, f_EndDoctypeDecl);
-  if (hasfield(L, XmlDeclKey))
-    XML_SetXmlDeclHandler(p, f_XmlDecl);
-  if (hasfield(L, ElementDeclKey))
-    XML_SetElementDeclHandler(p, f_ElementDecl);
+/*
+** Return an iterator over the events of the tape, as 'parser:events'
+*/
+static int tape_events (lua_State *L) {
+  lxp_tape *t = checktape(L, 1);
+  lxp_cursor *c;
+  if (!t->keep) {
+    if (t->iterated)
+      luaL_error(L, "cannot iterate - tape is read in a single pass");
+    t->iterated = 1;
+  }
+  lua_settop(L, 1);
+  c = (lxp_cursor *)lua_newuserdata(L, sizeof(lxp_cursor));
+  c->block = NULL;
+  c->pos = 0;
+  lua_pushcclosure(L, tape_next, 2);
   return 1;
 }
 
 
-static lxp_userdata *checkparser (lua_State *L, int idx) {
-  lxp_userdata *xpu = (lxp_userdata *)luaL_checkudata(L, idx, ParserType);
-  luaL_argcheck(L, xpu, idx, "expat parser expected");
-  luaL_argcheck(L, xpu->parser, idx, "parser is closed");
-  return xpu;
+static int tape_tostring (lua_State *L) {
+  lua_pushfstring(L, "%s (%p)", TapeType, lua_touserdata(L, 1));
+  return 1;
 }
 
 
-static int parser_gc (lua_State *L) {
-  lxp_userdata *xpu = (lxp_userdata *)luaL_checkudata(L, 1, ParserType);
-  luaL_argcheck(L, xpu, 1, "expat parser expected");
-  lxpclose(L, xpu);
-  return 0;
+static char checksep (lua_State *L, int opts) {
+  size_t len;
+  const char *sep;
+  if (lua_isnoneornil(L, opts))
+    return '\0';
+  luaL_checktype(L, opts, LUA_TTABLE);
+  lua_getfield(L, opts, "separator");
+  sep = lua_isnil(L, -1) ? "" : luaL_checklstring(L, -1, &len);
+  lua_pop(L, 1);
+  return *sep;
 }
 
 
-static int setbase (lua_State *L) {
-  lxp_userdata *xpu = checkparser(L, 1);
-  if (XML_SetBase(xpu->parser, luaL_checkstring(L, 2)) == 0)
-    luaL_error(L, "no memory to store base");
-  lua_settop(L, 1);
+/*
+** lxp.tokenize(doc [, options]): the tape is read in a single pass
+*/
+static int lxp_tokenize (lua_State *L) {
+  lxp_tape *t;
+  luaL_checkstring(L, 1);
+  t = newtape(L, 1, checksep(L, 2), 0);
+#ifdef LXP_THREADS
+  if (pthread_create(&t->thread, NULL, tapethread, t) == 0)
+    t->threaded = 1;
+  else
+#endif
+    runtape(t);  /* no threads: tokenize it now */
   return 1;
 }
 
 
-static int getbase (lua_State *L) {
-  lxp_userdata *xpu = checkparser(L, 1);
-  lua_pushstring(L, XML_GetBase(xpu->parser));
-  return 1;
-}
+/*
+** Documents of 'lxp.tokenizeall', handed out to the workers
+*/
+typedef struct lxp_jobs {
+  lxp_tape **tapes;
+  int n;
+  int next;  /* next document to tokenize */
+#ifdef LXP_THREADS
+  pthread_mutex_t lock;
+#endif
+} lxp_jobs;
 
 
-static int getcallbacks (lua_State *L) {
-  checkparser(L, 1);
-  lua_getuservalue(L, 1);
-  return 1;
+static void *runjobs (void *ud) {
+  lxp_jobs *jobs = (lxp_jobs *)ud;
+  for (;;) {
+    int i;
+#ifdef LXP_THREADS
+    pthread_mutex_lock(&jobs->lock);
+#endif
+    i = jobs->next++;
+#ifdef LXP_THREADS
+    pthread_mutex_unlock(&jobs->lock);
+#endif
+    if (i >= jobs->n)
+      return NULL;
+    runtape(jobs->tapes[i]);
+  }
 }
 
 
-static int parse_aux (lua_State *L, lxp_userdata *xpu, const char *s,
-                      size_t len) {
-  luaL_Buffer b;
-  int status;
-  xpu->L = L;
-  xpu->state = XPSok;
-  xpu->b = &b;
+/*
+** lxp.tokenizeall(docs [, options]): tokenize a list of documents on a
+** pool of threads (the calling one included) and return their tapes,
+** which are complete and can be read many times
+*/
+static int lxp_tokenizeall (lua_State *L) {
+  lxp_jobs jobs;
+  int nthreads = 1;
+  char sep;
+  int i;
+  luaL_checktype(L, 1, LUA_TTABLE);
+  sep = checksep(L, 2);
+  jobs.n = (int)lua_rawlen(L, 1);
+#ifdef LXP_THREADS
+  nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  if (!lua_isnoneornil(L, 2)) {
+    lua_getfield(L, 2, "threads");
+    if (!lua_isnil(L, -1)) {
+      nthreads = (int)luaL_checkinteger(L, -1);
+      luaL_argcheck(L, nthreads >= 1, 2, "number of threads must be positive");
+    }
+    lua_pop(L, 1);
+  }
+  if (nthreads > jobs.n) nthreads = jobs.n;
   lua_settop(L, 2);
-  getcallbacks(L);
-  status = XML_Parse(xpu->parser, s, (int)len, s == NULL);
-  if (xpu->state == XPSstring) dischargestring(xpu);
-  if (xpu->state == XPSerror) {  /* callback error? */
-    lua_rawgeti(L, LUA_REGISTRYINDEX, xpu->errorref);  /* get original msg. */
-    lua_error(L);
+  lua_createtable(L, jobs.n, 0);  /* at 3 */
+  jobs.tapes = (lxp_tape **)lua_newuserdata(L, (jobs.n + 1) * sizeof(lxp_tape *));
+  for (i = 1; i <= jobs.n; i++) {
+    lua_rawgeti(L, 1, i);
+    if (lua_type(L, -1) != LUA_TSTRING)
+      luaL_error(L, "document %d is not a string", i);
+    jobs.tapes[i - 1] = newtape(L, lua_gettop(L), sep, 1);
+    lua_rawseti(L, 3, i);
+    lua_pop(L, 1);
   }
-  if (s == NULL) xpu->state = XPSfinished;
-  if (status) {
-    lua_settop(L, 1);  /* return parser userdata on success */
-    return 1;
+  jobs.next = 0;
+#ifdef LXP_THREADS
+  {
+    pthread_t *threads = (pthread_t *)lua_newuserdata(L, nthreads * sizeof(pthread_t));
+    int started = 0;
+    pthread_mutex_init(&jobs.lock, NULL);
+    while (started < nthreads - 1 &&
+           pthread_create(&threads[started], NULL, runjobs, &jobs) == 0)
+      started++;
+    runjobs(&jobs);  /* the calling thread works too */
+    for (i = 0; i < started; i++)
+      pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&jobs.lock);
   }
-  else { /* error */
-    return reporterror(xpu);
+#else
+  runjobs(&jobs);
+#endif
+  lua_settop(L, 3);
+  return 1;
+}
+
+
+static const struct luaL_Reg tape_meths[] = {
+  {"events", tape_events},
+  {"status", tape_status},
+  {"close", tape_close},
+  {"__gc", tape_close},
+  {"__tostring", tape_tostring},
+  {NULL, NULL}
+};
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Replay
+** 'lxp.replay' calls the callbacks of a table with the events of a
+** recording (see 'Recording'), which is checked as it is read: it may
+** come from a file. The first argument of every call is a parser
+** created for the replay, as if it had parsed the document.
+** =======================================================
+*/
+
+/* stack indices during a replay */
+#define REPLAY_PARSER	3
+#define replayhandler(code)	(REPLAY_PARSER + (code))
+#define REPLAY_NAMES	(REPLAY_PARSER + XPRn)
+
+static const char *const recordkeys[] = {NULL,
+  StartElementKey, EndElementKey, CharDataKey, CommentKey,
+  ProcessingInstructionKey, StartCdataKey, EndCdataKey};
+
+typedef struct lxp_reader {
+  lua_State *L;
+  const unsigned char *p;
+  const unsigned char *end;
+  int nnames;
+} lxp_reader;
+
+
+static size_t readnumber (lxp_reader *rd) {
+  size_t v = 0;
+  int shift = 0;
+  for (;;) {
+    unsigned char c;
+    if (rd->p == rd->end || shift >= (int)sizeof(size_t) * 8)
+      luaL_error(rd->L, "invalid tape (truncated or corrupt)");
+    c = *rd->p++;
+    v |= (size_t)(c & 0x7F) << shift;
+    if (c < 0x80)
+      return v;
+    shift += 7;
   }
 }
 
 
-static int lxp_parse (lua_State *L) {
-  lxp_userdata *xpu = checkparser(L, 1);
+static const char *readstring (lxp_reader *rd, size_t *len) {
+  const char *s;
+  *len = readnumber(rd);
+  if (*len > (size_t)(rd->end - rd->p))
+    luaL_error(rd->L, "invalid tape (truncated or corrupt)");
+  s = (const char *)rd->p;
+  rd->p += *len;
+  return s;
+}
+
+
+static void pushrecstring (lxp_reader *rd, int push) {
   size_t len;
-  const char *s = luaL_optlstring(L, 2, NULL, &len);
-  if (xpu->state == XPSfinished) {
-    if (s != NULL) {
-      lua_pushnil(L);
-      lua_pushliteral(L, "cannot parse - document is finished");
-      return 2;
-    } else {
-      lua_settop(L, 1);
-      return 1;
-    }
-  }
-  return parse_aux(L, xpu, s, len);
+  const char *s = readstring(rd, &len);
+  if (push) lua_pushlstring(rd->L, s, len);
 }
 
 
-static int lxp_close (lua_State *L) {
-  int status = 1;
-  lxp_userdata *xpu = (lxp_userdata *)luaL_checkudata(L, 1, ParserType);
-  luaL_argcheck(L, xpu, 1, "expat parser expected");
-  if (xpu->state != XPSfinished)
-    status = parse_aux(L, xpu, NULL, 0);
-  lxpclose(L, xpu);
-  if (status > 1) luaL_error(L, "error closing parser: %s",
-                                lua_tostring(L, -status+1));
-  lua_settop(L, 1);
-  return 1;
+/*
+** Read a name, which is pushed if 'push'; new names are kept anyway
+*/
+static void pushrecname (lxp_reader *rd, int push) {
+  lua_State *L = rd->L;
+  size_t id = readnumber(rd);
+  if (id == 0) {
+    pushrecstring(rd, 1);
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, REPLAY_NAMES, ++rd->nnames);
+    if (!push) lua_pop(L, 1);
+  }
+  else if (id > (size_t)rd->nnames)
+    luaL_error(L, "invalid tape (truncated or corrupt)");
+  else if (push)
+    lua_rawgeti(L, REPLAY_NAMES, (int)id);
 }
 
 
-static int lxp_pos (lua_State *L) {
-  lxp_userdata *xpu = checkparser(L, 1);
-  XML_Parser p = xpu->parser;
-  lua_pushinteger(L, XML_GetCurrentLineNumber(p));
-  lua_pushinteger(L, XML_GetCurrentColumnNumber(p) + 1);
-  lua_pushinteger(L, XML_GetCurrentByteIndex(p) + 1);
-  return 3;
+static void replayelement (lxp_reader *rd, int push) {
+  lua_State *L = rd->L;
+  size_t nspec, nattrs, i;
+  pushrecname(rd, push);
+  nspec = readnumber(rd);
+  nattrs = readnumber(rd);
+  if (nspec > nattrs || nattrs > (size_t)(rd->end - rd->p))
+    luaL_error(L, "invalid tape (truncated or corrupt)");
+  if (push)
+    lua_createtable(L, (int)nspec, (int)nattrs);
+  for (i = 1; i <= nattrs; i++) {
+    pushrecname(rd, push);
+    if (push && i <= nspec) {
+      lua_pushvalue(L, -1);
+      lua_rawseti(L, -3, (int)i);
+    }
+    pushrecstring(rd, push);
+    if (push) lua_rawset(L, -3);
+  }
 }
 
 
-static int lxp_setreturnnstriplet (lua_State *L) {
-  lxp_userdata *xpu = checkparser(L, 1);
-  luaL_argcheck(L, xpu->state == XPSpre, 1, "invalid parser state");
-  XML_SetReturnNSTriplet(xpu->parser, lua_toboolean(L, 2));
-  lua_settop(L, 1);
-  return 1;
+/*
+** Replay the recording 's' (anchored at 1) with the callbacks at 2
+*/
+static void replay (lua_State *L, const char *s, size_t len) {
+  lxp_reader rd;
+  char sep;
+  int code;
+  if (len < RECORD_HEADER || memcmp(s, RECORD_MAGIC, 4) != 0)
+    luaL_error(L, "invalid tape (not a recording)");
+  if (s[4] != RECORD_VERSION)
+    luaL_error(L, "invalid tape (version %d, expected %d)",
+                  (int)(unsigned char)s[4], RECORD_VERSION);
+  sep = s[5];
+  lua_settop(L, 2);
+  lua_pushcfunction(L, lxp_make_parser);
+  lua_pushvalue(L, 2);
+  lua_pushlstring(L, &sep, (sep == '\0') ? 0 : 1);
+  lua_call(L, 2, 1);  /* at REPLAY_PARSER */
+  for (code = 1; code < XPRn; code++) {
+    lua_getfield(L, 2, recordkeys[code]);
+    if (lua_toboolean(L, -1) && !lua_isfunction(L, -1))
+      luaL_error(L, "lxp '%s' callback is not a function", recordkeys[code]);
+  }
+  lua_newtable(L);  /* at REPLAY_NAMES */
+  rd.L = L;
+  rd.p = (const unsigned char *)s + RECORD_HEADER;
+  rd.end = (const unsigned char *)s + len;
+  rd.nnames = 0;
+  for (;;) {
+    int push, nargs;
+    if (rd.p == rd.end)
+      luaL_error(L, "invalid tape (truncated or corrupt)");
+    code = *rd.p++;
+    if (code == XPRend)
+      break;
+    if (code >= XPRn)
+      luaL_error(L, "invalid tape (truncated or corrupt)");
+    push = lua_toboolean(L, replayhandler(code));
+    if (push) {
+      lua_pushvalue(L, replayhandler(code));
+      lua_pushvalue(L, REPLAY_PARSER);
+    }
+    switch (code) {
+      case XPRstart:
+        replayelement(&rd, push);
+        nargs = 2;
+        break;
+      case XPRendelement:
+        pushrecname(&rd, push);
+        nargs = 1;
+        break;
+      case XPRpi:
+        pushrecname(&rd, push);
+        pushrecstring(&rd, push);
+        nargs = 2;
+        break;
+      case XPRstartcdata: case XPRendcdata:
+        nargs = 0;
+        break;
+      default:
+        pushrecstring(&rd, push);
+        nargs = 1;
+        break;
+    }
+    if (push)
+      lua_call(L, nargs + 1, 0);
+  }
+  if (rd.p != rd.end)
+    luaL_error(L, "invalid tape (truncated or corrupt)");
 }
 
 
-static int lxp_setencoding (lua_State *L) {
-  lxp_userdata *xpu = checkparser(L, 1);
-  const char *encoding = luaL_checkstring(L, 2);
-  luaL_argcheck(L, xpu->state == XPSpre, 1, "invalid parser state");
-  XML_SetEncoding(xpu->parser, encoding);
-  lua_settop(L, 1);
+static int lxp_replay (lua_State *L) {
+  size_t len;
+  const char *s = luaL_checklstring(L, 1, &len);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  replay(L, s, len);
+  lua_pushboolean(L, 1);
   return 1;
 }
 
 
-static int lxp_stop (lua_State *L) {
-  lxp_userdata *xpu = checkparser(L, 1);
-  lua_pushboolean(L, XML_StopParser(xpu->parser, XML_FALSE) == XML_STATUS_OK);
-  return 1;
+/*
+** A recording read by 'lxp.replayfile': mapped in memory when possible
+*/
+typedef struct lxp_mapping {
+  char *data;
+  size_t len;
+  int mapped;
+} lxp_mapping;
+
+
+static int mapping_gc (lua_State *L) {
+  lxp_mapping *m = (lxp_mapping *)luaL_checkudata(L, 1, MappingType);
+  if (m->data != NULL) {
+#ifdef LXP_MMAP
+    if (m->mapped)
+      munmap(m->data, m->len);
+    else
+#endif
+      free(m->data);
+    m->data = NULL;
+  }
+  return 0;
 }
 
 
-/* Billion Laughs Attack mitigation from Expat 2.4.0+ */
-#ifdef XML_DTD
-static int lxp_bla_maximum_amplification (lua_State *L) {
-  lxp_userdata *xpu = checkparser(L, 1);
-  if (! XML_SetBillionLaughsAttackProtectionMaximumAmplification(xpu->parser, luaL_checknumber(L, 2))) {
-    lua_pushnil(L);
-    lua_pushliteral(L, "failed to set BLA maximum amplification");
-    return 2;
+/*
+** Read the file 'f' (of 'len' bytes) into 'm'
+*/
+static int readmapping (lxp_mapping *m, FILE *f, size_t len) {
+#ifdef LXP_MMAP
+  if (len > 0) {
+    void *data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+    if (data != MAP_FAILED) {
+      m->data = (char *)data;
+      m->len = len;
+      m->mapped = 1;
+      return 1;
+    }
   }
-  lua_settop(L, 1);
-  return 1;
+#endif
+  m->data = (char *)malloc(len > 0 ? len : 1);
+  if (m->data == NULL)
+    return 0;
+  m->len = fread(m->data, 1, len, f);
+  return !ferror(f);
 }
 
 
-static int lxp_bla_activation_threshold (lua_State *L) {
-  lxp_userdata *xpu = checkparser(L, 1);
-  if (! XML_SetBillionLaughsAttackProtectionActivationThreshold(xpu->parser, luaL_checkinteger(L, 2))) {
+static int lxp_replayfile (lua_State *L) {
+  const char *path = luaL_checkstring(L, 1);
+  lxp_mapping *m;
+  FILE *f;
+  long len = 0;
+  int ok;
+  luaL_checktype(L, 2, LUA_TTABLE);
+  m = (lxp_mapping *)lua_newuserdata(L, sizeof(lxp_mapping));
+  m->data = NULL;
+  m->len = 0;
+  m->mapped = 0;
+  luaL_getmetatable(L, MappingType);
+  lua_setmetatable(L, -2);
+  f = fopen(path, "rb");
+  if (f == NULL) {
     lua_pushnil(L);
-    lua_pushliteral(L, "failed to set BLA activation threshold");
+    lua_pushfstring(L, "%s: %s", path, strerror(errno));
+    return 2;
+  }
+  ok = fseek(f, 0, SEEK_END) == 0 && (len = ftell(f)) >= 0 &&
+       fseek(f, 0, SEEK_SET) == 0 && readmapping(m, f, (size_t)len);
+  if (!ok) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s: %s", path, strerror(errno));
+    fclose(f);
     return 2;
   }
+  fclose(f);
+  lua_replace(L, 1);  /* keep it while replaying */
+  replay(L, m->data, m->len);
   lua_settop(L, 1);
+  mapping_gc(L);  /* no need to wait for the collector */
+  lua_pushboolean(L, 1);
   return 1;
 }
-#endif
+/* }====================================================== */
 
 
 #if !defined LUA_VERSION_NUM
@@ -774,12 +7224,26 @@ static int lxp_getcurrentbytecount (lua_State* L) {
 
 static const struct luaL_Reg lxp_meths[] = {
   {"parse", lxp_parse},
+  {"resume", lxp_resume},
+  {"events", lxp_events},
+  {"trees", lxp_trees},
+  {"blocks", lxp_blocks},
+  {"record", lxp_record},
+  {"gettape", lxp_gettape},
+  {"parsefile", lxp_parsefile},
   {"close", lxp_close},
+  {"reset", lxp_reset},
+  {"memory", lxp_getmemory},
+  {"stats", lxp_getstats},
   {"__gc", parser_gc},
   {"pos", lxp_pos},
   {"getcurrentbytecount", lxp_getcurrentbytecount},
   {"setencoding", lxp_setencoding},
   {"getcallbacks", getcallbacks},
+  {"refreshcallbacks", lxp_refreshcallbacks},
+  {"namecache", lxp_namecache},
+  {"gettree", lxp_gettree},
+  {"getindex", lxp_getindex},
   {"getbase", getbase},
   {"setbase", setbase},
   {"returnnstriplet", lxp_setreturnnstriplet},
@@ -793,6 +7257,13 @@ static const struct luaL_Reg lxp_meths[] = {
 
 static const struct luaL_Reg lxp_funcs[] = {
   {"new", lxp_make_parser},
+  {"tostring", lxp_tostring},
+  {"write", lxp_write},
+  {"indexof", lxp_indexof},
+  {"tokenize", lxp_tokenize},
+  {"tokenizeall", lxp_tokenizeall},
+  {"replay", lxp_replay},
+  {"replayfile", lxp_replayfile},
   {NULL, NULL}
 };
 
@@ -836,6 +7307,42 @@ int luaopen_lxp (lua_State *L) {
   luaL_setfuncs (L, lxp_meths, 0);
   lua_pop (L, 1); /* remove metatable */
 
+  luaL_newmetatable(L, AttributesType);
+  luaL_setfuncs (L, proxy_meths, 0);
+  lua_pop (L, 1);
+
+  luaL_newmetatable(L, FileType);
+  lua_pushcfunction(L, file_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop (L, 1);
+
+  luaL_newmetatable(L, MappingType);
+  lua_pushcfunction(L, mapping_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop (L, 1);
+
+  luaL_newmetatable(L, DocumentType);
+  lua_pushcfunction(L, dom_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop (L, 1);
+
+  luaL_newmetatable(L, NodeType);
+  luaL_setfuncs (L, node_meths, 0);
+  lua_pop (L, 1);
+
+  luaL_newmetatable(L, TapeType);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  luaL_setfuncs (L, tape_meths, 0);
+  lua_pop (L, 1);
+
+  lua_getfield(L, LUA_REGISTRYINDEX, IndexesKey);
+  if (lua_isnil(L, -1)) {
+    pushweak(L, "k");
+    lua_setfield(L, LUA_REGISTRYINDEX, IndexesKey);
+  }
+  lua_pop(L, 1);
+
   lua_newtable (L); /* push library table */
   luaL_setfuncs (L, lxp_funcs, 0);
   set_info (L);
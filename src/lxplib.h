@@ -5,6 +5,13 @@
 #define LuaExpatCopyright	"Copyright (C) 2003-2007 The Kepler Project, 2013-2024 Matthew Wild"
 #define LuaExpatVersion		"LuaExpat 1.5.2"
 #define ParserType		"Expat"
+#define AttributesType		"Expat.attributes"
+#define FileType		"Expat.file"
+#define TapeType		"Expat.tape"
+#define MappingType		"Expat.mapping"
+#define DocumentType		"Expat.document"
+#define NodeType		"Expat.node"
+#define IndexesKey		"Expat.indexes"
 
 #define StartCdataKey			"StartCdataSection"
 #define EndCdataKey			"EndCdataSection"
@@ -28,5 +35,6 @@
 #define EndDoctypeDeclKey		"EndDoctypeDecl"
 #define XmlDeclKey			"XmlDecl"
 #define ElementDeclKey			"ElementDecl"
+#define BatchKey			"Batch"
 
 int luaopen_lxp (lua_State *L);